@@ -33,6 +33,11 @@ G_DEFINE_TYPE(AccountEditDialog, account_edit_dialog, GTK_TYPE_DIALOG);
 
 static void on_auth_success(AccountEditDialog* dialog, gchar* err)
 {
+	if (err) {
+		g_warning("Authentication failed: %s", err);
+		g_free(err);
+		return;
+	}
 	// probably the email address was updated by the authentication process
 	gtk_entry_buffer_set_text(gtk_entry_get_buffer(GTK_ENTRY(dialog->email)), dialog->config->email, -1);
 	// fake like OK was pressed, close the dialog
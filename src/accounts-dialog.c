@@ -13,6 +13,7 @@
  */
 #include "accounts-dialog.h"
 #include "account-edit-dialog.h"
+#include "calendar-cache.h"
 #include "calendar-config.h"
 
 struct _AccountsDialog {
@@ -79,6 +80,7 @@ static void on_clicked_delete(AccountsDialog* dialog, GtkToolButton* button)
 		g_assert(selected_index >= 0);
 		GSList* to_remove = g_slist_nth(*dialog->accounts, (guint) selected_index);
 		*dialog->accounts = g_slist_remove_link(*dialog->accounts, to_remove);
+		calendar_cache_delete(to_remove->data);
 		calendar_config_free(to_remove->data);
 		g_signal_emit(dialog, accounts_dialog_signals[SIGNAL_CONFIG_CHANGED], 0);
 		populate_account_list(dialog);
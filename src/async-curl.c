@@ -16,6 +16,8 @@
 
 #include "async-curl.h"
 
+#include <string.h>
+
 /* GUnixFDSource doesn't provide a public API to access the tag member,
  * and consequently a polled unix FD can't be modified. "Fix" this by
  * peeking into the ABI. Will have to be fixed if GUnixFDSource changes */
@@ -25,13 +27,108 @@ typedef struct {
 	gpointer tag;
 } GUnixFDSource;
 
-typedef struct {
+struct _AsyncCurlRequest {
 	AsyncCurlCallback callback;
 	void* user;
 	struct curl_slist* headers;
-} CallbackInfo;
+	CURL* handle;
+	char* host;
+	AsyncCurlPriority priority;
+	// link in admitted_requests, NULL until the request has been added to the multi handle
+	GList* admitted;
+};
+
+// Requests are admitted to the multi handle only while the number of requests
+// in flight to the same host is below the limit for their priority. Lower
+// priorities have lower limits, so that there is always room for requests of
+// a higher priority however many background requests are waiting.
+static const int host_limit[ASYNC_CURL_N_PRIORITIES] = {
+	[ASYNC_CURL_PRIORITY_INTERACTIVE] = 8,
+	[ASYNC_CURL_PRIORITY_VISIBLE] = 6,
+	[ASYNC_CURL_PRIORITY_BACKGROUND] = 3,
+};
+
+// Idle easy handles are kept for reuse rather than destroyed, and all handles
+// share a DNS cache, TLS sessions and connections. Everything runs on the
+// main thread so the share needs no locking.
+#define MAX_IDLE_HANDLES 16
 
 static CURLM* multi;
+static CURLSH* share;
+static GQueue idle_handles = G_QUEUE_INIT;
+static gboolean http2;
+static AsyncCurlStats stats;
+// AsyncCurlRequest* waiting for admission, per priority
+static GQueue pending[ASYNC_CURL_N_PRIORITIES] = {G_QUEUE_INIT, G_QUEUE_INIT, G_QUEUE_INIT};
+// host -> number of requests in flight
+static GHashTable* in_flight;
+// AsyncCurlRequest* in the multi handle, so that they can be freed at exit
+static GQueue admitted_requests = G_QUEUE_INIT;
+
+static void request_free(AsyncCurlRequest* cbinfo)
+{
+	curl_slist_free_all(cbinfo->headers);
+	g_free(cbinfo->host);
+	free(cbinfo);
+}
+
+// scheme and authority of a URL, e.g. "https://example.com:8443"
+static char* url_host(const char* url)
+{
+	const char* p = url ? strstr(url, "://") : NULL;
+	if (!p)
+		return g_strdup("");
+	p += strlen("://");
+	return g_strndup(url, p + strcspn(p, "/?#") - url);
+}
+
+static int host_in_flight(const char* host)
+{
+	return GPOINTER_TO_INT(g_hash_table_lookup(in_flight, host));
+}
+
+// Removes an admitted request from the multi handle and frees its slot
+static void request_remove(AsyncCurlRequest* cbinfo)
+{
+	curl_multi_remove_handle(multi, cbinfo->handle);
+	g_queue_delete_link(&admitted_requests, cbinfo->admitted);
+	cbinfo->admitted = NULL;
+	int n = host_in_flight(cbinfo->host);
+	if (n > 1)
+		g_hash_table_insert(in_flight, g_strdup(cbinfo->host), GINT_TO_POINTER(n - 1));
+	else
+		g_hash_table_remove(in_flight, cbinfo->host);
+}
+
+// Moves every pending request which is within its host limit into the multi
+// handle, highest priority first. Requests to hosts at their limit are skipped
+// without holding up those to other hosts.
+static void dispatch_pending()
+{
+	gboolean added = FALSE;
+	for (int prio = 0; prio < ASYNC_CURL_N_PRIORITIES; ++prio) {
+		for (GList* it = pending[prio].head; it;) {
+			AsyncCurlRequest* cbinfo = it->data;
+			GList* next = it->next;
+			int n = host_in_flight(cbinfo->host);
+			if (n < host_limit[prio]) {
+				g_queue_delete_link(&pending[prio], it);
+				g_hash_table_insert(in_flight, g_strdup(cbinfo->host), GINT_TO_POINTER(n + 1));
+				curl_multi_add_handle(multi, cbinfo->handle);
+				g_queue_push_tail(&admitted_requests, cbinfo);
+				cbinfo->admitted = admitted_requests.tail;
+				added = TRUE;
+			}
+			it = next;
+		}
+	}
+
+	if (added) {
+		int still_running;
+		CURLMcode rc = curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &still_running);
+		g_assert(rc == 0);
+	}
+}
 
 static void check_multi_info()
 {
@@ -40,13 +137,20 @@ static void check_multi_info()
 	while ((msg = curl_multi_info_read(multi, &msgs_left))) {
 		if (msg->msg == CURLMSG_DONE) {
 			CURL* hdl = msg->easy_handle;
-			CallbackInfo* cbinfo;
+			AsyncCurlRequest* cbinfo;
 			curl_easy_getinfo(hdl, CURLINFO_PRIVATE, &cbinfo);
-			curl_multi_remove_handle(multi, hdl);
+			request_remove(cbinfo);
+			long connects = 0, version = 0;
+			curl_easy_getinfo(hdl, CURLINFO_NUM_CONNECTS, &connects);
+			curl_easy_getinfo(hdl, CURLINFO_HTTP_VERSION, &version);
+			stats.requests++;
+			stats.connections += connects;
+			if (version == CURL_HTTP_VERSION_2_0)
+				stats.http2_requests++;
 			(*cbinfo->callback)(hdl, msg->data.result, cbinfo->user);
-			curl_easy_cleanup(hdl);
-			curl_slist_free_all(cbinfo->headers);
-			free(cbinfo);
+			async_curl_release_handle(hdl);
+			request_free(cbinfo);
+			dispatch_pending();
 		} else {
 			fprintf(stderr, "error: unexpected message %d\n", msg->msg);
 		}
@@ -114,20 +218,64 @@ size_t curl_write_to_gstring(char* ptr, size_t size, size_t nmemb, void* userdat
 	return size * nmemb;
 }
 
-void async_curl_add_request(CURL* handle, struct curl_slist* headers, AsyncCurlCallback cb, void* user)
+CURL* async_curl_new_handle()
+{
+	g_assert_nonnull(share);
+	CURL* handle = g_queue_pop_head(&idle_handles);
+	if (!handle)
+		handle = curl_easy_init();
+	g_assert_nonnull(handle);
+	curl_easy_setopt(handle, CURLOPT_SHARE, share);
+	return handle;
+}
+
+void async_curl_release_handle(CURL* handle)
+{
+	if (g_queue_get_length(&idle_handles) >= MAX_IDLE_HANDLES) {
+		curl_easy_cleanup(handle);
+		return;
+	}
+	// Resets all options but keeps the handle's live connections and caches
+	curl_easy_reset(handle);
+	g_queue_push_head(&idle_handles, handle);
+}
+
+AsyncCurlRequest* async_curl_add_request(CURL* handle, const char* url, struct curl_slist* headers, AsyncCurlPriority priority, AsyncCurlCallback cb, void* user)
 {
 	g_assert_nonnull(multi);
-	CallbackInfo* cbinfo = (CallbackInfo*) malloc(sizeof(CallbackInfo));
+	g_assert(priority >= 0 && priority < ASYNC_CURL_N_PRIORITIES);
+	AsyncCurlRequest* cbinfo = (AsyncCurlRequest*) malloc(sizeof(AsyncCurlRequest));
 	cbinfo->callback = cb;
 	cbinfo->user = user;
 	cbinfo->headers = headers;
+	cbinfo->handle = handle;
+	cbinfo->priority = priority;
+	cbinfo->admitted = NULL;
+	cbinfo->host = url_host(url);
+	curl_easy_setopt(handle, CURLOPT_URL, url);
 	curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers);
 	curl_easy_setopt(handle, CURLOPT_PRIVATE, cbinfo);
-	curl_multi_add_handle(multi, handle);
+	if (http2) {
+		curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+		// wait for a connection being set up to the same host rather than opening
+		// another, in case it turns out to support multiplexing
+		curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+	}
+	g_queue_push_tail(&pending[priority], cbinfo);
+	dispatch_pending();
+	return cbinfo;
+}
 
-	int still_running;
-	CURLMcode rc = curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &still_running);
-	g_assert(rc == 0);
+void async_curl_cancel(AsyncCurlRequest* request)
+{
+	if (request->admitted)
+		request_remove(request);
+	else
+		g_queue_remove(&pending[request->priority], request);
+	async_curl_release_handle(request->handle);
+	request_free(request);
+	// a slot may have been freed
+	dispatch_pending();
 }
 
 void async_curl_init()
@@ -136,11 +284,60 @@ void async_curl_init()
 	multi = curl_multi_init();
 	curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, on_modify_socket);
 	curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+	in_flight = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	share = curl_share_init();
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+}
+
+void async_curl_set_http2(gboolean enable, long max_streams)
+{
+	g_assert_nonnull(multi);
+	http2 = enable;
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING, enable ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+#if LIBCURL_VERSION_NUM >= 0x074300
+	if (enable && max_streams > 0)
+		curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, max_streams);
+#endif
+}
+
+void async_curl_get_stats(AsyncCurlStats* out)
+{
+	*out = stats;
 }
 
 void async_curl_cleanup()
 {
 	g_assert_nonnull(multi);
+	// Requests still in flight are abandoned without calling back. Their
+	// handles have to go before the share they refer to.
+	AsyncCurlRequest* cbinfo;
+	while ((cbinfo = g_queue_peek_head(&admitted_requests))) {
+		request_remove(cbinfo);
+		curl_easy_cleanup(cbinfo->handle);
+		request_free(cbinfo);
+	}
 	curl_multi_cleanup(multi);
 	multi = NULL;
+	// requests never admitted are dropped like those in flight
+	for (int prio = 0; prio < ASYNC_CURL_N_PRIORITIES; ++prio) {
+		while ((cbinfo = g_queue_pop_head(&pending[prio]))) {
+			curl_easy_cleanup(cbinfo->handle);
+			request_free(cbinfo);
+		}
+	}
+	g_hash_table_destroy(in_flight);
+	in_flight = NULL;
+
+	CURL* handle;
+	while ((handle = g_queue_pop_head(&idle_handles)))
+		curl_easy_cleanup(handle);
+	// fails with CURLSHE_IN_USE if any handle is still outstanding
+	if (curl_share_cleanup(share) != CURLSHE_OK)
+		g_warning("curl share still in use at exit");
+	share = NULL;
 }
@@ -15,12 +15,48 @@
 #define ASYNC_CURL_H
 
 #include <curl/curl.h>
+#include <glib.h>
 
 typedef void (*AsyncCurlCallback)(CURL* handle, CURLcode ret, void* user);
 
+typedef struct _AsyncCurlRequest AsyncCurlRequest;
+
+// Requests are started in order of priority, then in the order they were added
+typedef enum {
+	ASYNC_CURL_PRIORITY_INTERACTIVE, // a direct result of a user action, e.g. saving an event
+	ASYNC_CURL_PRIORITY_VISIBLE,	 // fetches for the range currently displayed
+	ASYNC_CURL_PRIORITY_BACKGROUND,	 // periodic and other syncs nobody is waiting for
+	ASYNC_CURL_N_PRIORITIES
+} AsyncCurlPriority;
+
 // Call once at start of application. Configures libcurl-multi.
 void async_curl_init();
 
+// Opt-in HTTP/2. When enabled, requests negotiate HTTP/2 over TLS and
+// concurrent requests to the same host are multiplexed over one connection,
+// with at most max_streams in flight on it (requires libcurl >= 7.67, otherwise
+// the server's limit applies). Servers without HTTP/2 are unaffected.
+void async_curl_set_http2(gboolean enable, long max_streams);
+
+typedef struct {
+	unsigned long requests;
+	unsigned long connections; // newly opened, so excluding reused ones
+	unsigned long http2_requests;
+} AsyncCurlStats;
+
+// Totals for all requests completed so far
+void async_curl_get_stats(AsyncCurlStats* out);
+
+// Returns a CURL handle attached to the shared DNS, TLS session and connection
+// caches, reusing an idle handle where possible. All options are at their
+// defaults. Use this instead of curl_easy_init so that requests to the same
+// server, from any calendar, reuse warm connections.
+CURL* async_curl_new_handle();
+
+// Returns a handle obtained from async_curl_new_handle which was never passed
+// to async_curl_add_request, for reuse. Not needed for handles which were.
+void async_curl_release_handle(CURL* handle);
+
 // Helper method to fill a GString with a CURL handle's HTTP response body.
 // Usage:
 //   GString* str = g_string_new(NULL);
@@ -29,11 +65,21 @@ void async_curl_init();
 // Remember to free the GString afterwards.
 size_t curl_write_to_gstring(char* ptr, size_t size, size_t nmemb, void* userdata);
 
-// Adds a CURL request to be performed asynchronously. The CURL* handle
-// and the headers list will be freed automatically when the request finishes
+// Adds a CURL request for url to be performed asynchronously. The CURL* handle
+// and the headers list will be released automatically when the request finishes
 // (ownership transferred). The headers list may be NULL. The callback will
 // be invoked when the request completes.
-void async_curl_add_request(CURL* handle, struct curl_slist* headers, AsyncCurlCallback cb, void* user);
+// The request may be held back until fewer requests to the same host are in
+// flight. Each priority has its own cap on requests per host, lower for lower
+// priorities, so background requests can never occupy all of a host's slots.
+// The returned request remains valid until its callback is invoked or it is
+// cancelled, whichever comes first.
+AsyncCurlRequest* async_curl_add_request(CURL* handle, const char* url, struct curl_slist* headers, AsyncCurlPriority priority, AsyncCurlCallback cb, void* user);
+
+// Aborts a request, whether or not it has started, and frees it along with its
+// handle and headers. The callback is not invoked. Must not be called from the
+// request's own callback.
+void async_curl_cancel(AsyncCurlRequest* request);
 
 // Call once before application exit. Cleans up libcurl multi.
 void async_curl_cleanup();
@@ -14,17 +14,85 @@
 #include <curl/curl.h>
 #include <libxml/SAX2.h>
 #include <string.h>
+#include <time.h>
 
 #include "async-curl.h"
 #include "caldav-calendar.h"
+#include "calendar-cache.h"
 #include "remote-auth.h"
 
+// Defaults for the number of resources requested per calendar-multiget REPORT and
+// the number of such requests in flight at once. Overridden by the calendar config.
+// More requests than async-curl admits per host at background priority would
+// only wait in its queue.
+#define MULTIGET_BATCH_SIZE 250
+#define MULTIGET_MAX_REQUESTS 3
+
+// Maximum number of changes requested per sync-collection REPORT (DAV:limit).
+// Larger results are fetched page by page.
+#define SYNC_PAGE_SIZE 1000
+
+// Maximum number of PUT and DELETE requests in flight at once per calendar
+#define MAX_CONCURRENT_WRITES 4
+
+// Default number of days either side of today fetched by the initial sync
+// before the rest of the calendar. Overridden by the calendar config.
+#define INITIAL_SYNC_WINDOW_DAYS 7
+
+typedef struct _MultigetContext MultigetContext;
+
+// The kind of operation waiting for credentials, which determines how it is
+// abandoned if they cannot be obtained
+typedef enum {
+	CALDAV_AUTH_WRITE,		   // arg is the CaldavOp
+	CALDAV_AUTH_RANGE_QUERY,   // arg is the MultigetContext of the range
+	CALDAV_AUTH_SYNC,		   // a step of the running sync, arg is NULL
+	CALDAV_AUTH_SYNC_MULTIGET, // a step of the running sync, arg is the MultigetContext
+} CaldavAuthKind;
+
 struct _CaldavCalendar {
 	Calendar parent;
 	char* sync_token;
+	// CS:getctag as of the last completed sync, NULL if unknown
+	char* ctag;
+	// CS:getctag seen by the pre-check of the running sync, committed with it
+	char* pending_ctag;
 	RemoteAuth* auth;
-	gboolean op_pending;
-	GSList* events;
+	// Saves and deletes waiting to be sent, in submission order (CaldavOp*).
+	// They run concurrently up to MAX_CONCURRENT_WRITES, except that writes
+	// to the same event are kept in order. Writes take precedence over syncs,
+	// and run between the steps of a running sync, never during one.
+	GQueue ops;
+	GHashTable* ops_busy; // Event* with a write in flight
+	int writes_in_flight;
+	gboolean sync_requested; // repeated requests are merged
+	gboolean sync_running;
+	// The next step of the running sync, started once queued writes are done
+	void (*sync_next)();
+	CaldavAuthKind sync_next_kind;
+	void* sync_next_arg;
+	gboolean sync_next_invalidate;
+	// A date range query waiting to be requested, see caldav_sync_date_range
+	MultigetContext* range_next;
+	// Only one credential request may be outstanding at a time
+	gboolean auth_pending;
+	void (*auth_callback)(); // the operation waiting for auth_pending
+	CaldavAuthKind auth_kind;
+	guint op_queue_source;
+	// Events in a stable (insertion) order, indexed by href and by UID so that
+	// merging sync results is O(1) per resource
+	GQueue events;
+	GHashTable* events_by_href; // href -> GList* link in events
+	GHashTable* events_by_uid;  // uid -> Event*
+	CalendarCache* cache;
+	// Set if the server does not support sync-collection REPORTs. Changes are
+	// then found by comparing the etags of all resources with the local ones
+	gboolean etag_sync;
+	// Set if the server rejected a DAV:limit on the sync-collection REPORT
+	gboolean sync_unlimited;
+	// Date ranges (icaltime_span) fetched by calendar-query while the initial
+	// full sync has not yet completed, NULL otherwise
+	GArray* loaded_ranges;
 };
 G_DEFINE_TYPE(CaldavCalendar, caldav_calendar, TYPE_CALENDAR)
 
@@ -47,6 +115,14 @@ typedef struct {
 	// final results to be consumed by the caller
 	GSList* result_list;
 	char* sync_token;
+	char* ctag;
+	gboolean invalid_sync_token; // DAV:valid-sync-token precondition failed
+	gboolean unsupported_report; // DAV:supported-report precondition failed
+	gboolean truncated;			 // the server returned only part of the changes
+	// if set, each completed response element is passed to this callback as soon
+	// as it has been parsed instead of being collected in result_list
+	void (*on_response)(void* user, void* entry);
+	void* user;
 } XmlParseCtx;
 
 static void xmlns_free(XmlNs* ns)
@@ -148,7 +224,10 @@ static void xmlparse_find_caldata(void* ctx, const xmlChar* name)
 		e->href = xpc->current_href;
 		e->etag = xpc->current_etag;
 		e->caldata = xpc->current_caldata;
-		xpc->result_list = g_slist_append(xpc->result_list, e);
+		if (xpc->on_response)
+			xpc->on_response(xpc->user, e);
+		else
+			xpc->result_list = g_slist_prepend(xpc->result_list, e);
 
 		xpc->current_href = NULL;
 		xpc->current_etag = NULL;
@@ -163,10 +242,12 @@ static void xmlparse_find_caldata(void* ctx, const xmlChar* name)
 
 typedef struct {
 	char* href;
+	char* etag;
 	int status;
 } SyncEntry;
 
-// Callback when SAX parser finds a closing XML tag during sync-collection REPORT
+// Callback when SAX parser finds a closing XML tag during sync-collection REPORT,
+// or during the depth-1 PROPFIND which replaces it for an etag-based sync
 static void xmlparse_report_sync_collection(void* ctx, const xmlChar* name)
 {
 	XmlParseCtx* xpc = (XmlParseCtx*) ctx;
@@ -177,19 +258,56 @@ static void xmlparse_report_sync_collection(void* ctx, const xmlChar* name)
 	} else if (xml_tag_matches(xpc, name, "DAV:", "status")) {
 		// store the status for the current response element
 		sscanf(xpc->chars.str, "HTTP/1.1 %d ", &xpc->status);
+	} else if (xml_tag_matches(xpc, name, "DAV:", "getetag")) {
+		g_free(xpc->current_etag);
+		xpc->current_etag = g_strdup(xpc->chars.str);
 	} else if (xml_tag_matches(xpc, name, "DAV:", "response")) {
 		g_assert_nonnull(xpc->current_href);
-		SyncEntry* e = malloc(sizeof(SyncEntry));
-		e->href = xpc->current_href;
-		e->status = xpc->status;
-		xpc->result_list = g_slist_append(xpc->result_list, e);
+		if (xpc->status == 507) {
+			// a 507 for the collection itself signals a truncated result
+			xpc->truncated = TRUE;
+			g_free(xpc->current_href);
+			g_free(xpc->current_etag);
+		} else {
+			SyncEntry* e = malloc(sizeof(SyncEntry));
+			e->href = xpc->current_href;
+			e->etag = xpc->current_etag;
+			e->status = xpc->status;
+			xpc->result_list = g_slist_prepend(xpc->result_list, e);
+		}
 		xpc->current_href = NULL;
+		xpc->current_etag = NULL;
 		xpc->status = 0;
 	} else if (xml_tag_matches(xpc, name, "DAV:", "sync-token")) {
+		free(xpc->sync_token);
 		xpc->sync_token = strdup(xpc->chars.str);
+	} else if (xml_tag_matches(xpc, name, "http://calendarserver.org/ns/", "getctag")) {
+		g_free(xpc->ctag);
+		xpc->ctag = g_strdup(xpc->chars.str);
+	} else if (xml_tag_matches(xpc, name, "DAV:", "valid-sync-token")) {
+		xpc->invalid_sync_token = TRUE;
+	} else if (xml_tag_matches(xpc, name, "DAV:", "supported-report")) {
+		xpc->unsupported_report = TRUE;
+	} else if (xml_tag_matches(xpc, name, "DAV:", "number-of-matches-within-limits")) {
+		xpc->truncated = TRUE;
 	}
 	xmlparse_ns_pop(xpc);
 }
+
+// Callback when SAX parser finds a closing XML tag during the pre-sync PROPFIND
+static void xmlparse_find_ctag(void* ctx, const xmlChar* name)
+{
+	XmlParseCtx* xpc = (XmlParseCtx*) ctx;
+	if (xml_tag_matches(xpc, name, "http://calendarserver.org/ns/", "getctag")) {
+		g_free(xpc->ctag);
+		xpc->ctag = g_strdup(xpc->chars.str);
+	} else if (xml_tag_matches(xpc, name, "DAV:", "sync-token")) {
+		free(xpc->sync_token);
+		xpc->sync_token = strdup(xpc->chars.str);
+	}
+	xmlparse_ns_pop(xpc);
+}
+
 // Initializes an XmlParseCtx. Those members which are only used in specific operations
 // must be allocated manually after calling this function
 static void xmlctx_init(XmlParseCtx* ctx)
@@ -204,14 +322,106 @@ static void xmlctx_init(XmlParseCtx* ctx)
 // be cleaned up manually
 static void xmlctx_cleanup(XmlParseCtx* ctx)
 {
+	// only non-NULL if the document ended in the middle of a response element
+	g_free(ctx->current_href);
+	g_free(ctx->current_etag);
+	g_free(ctx->current_caldata);
 	g_queue_free_full(ctx->ns_defaults, (GDestroyNotify) xmlns_free);
 	g_hash_table_remove_all(ctx->ns_aliases);
 	g_free(ctx->chars.str);
 	g_hash_table_destroy(ctx->ns_aliases);
 }
 
+static Event* store_lookup(CaldavCalendar* rc, const char* href)
+{
+	GList* link = g_hash_table_lookup(rc->events_by_href, href);
+	return link ? (Event*) link->data : NULL;
+}
+
+// Adds the event to the local collection, taking over the caller's reference
+static void store_insert(CaldavCalendar* rc, Event* ev)
+{
+	g_queue_push_tail(&rc->events, ev);
+	g_hash_table_insert(rc->events_by_href, g_strdup(event_get_url(ev)), g_queue_peek_tail_link(&rc->events));
+	if (event_get_uid(ev))
+		g_hash_table_insert(rc->events_by_uid, g_strdup(event_get_uid(ev)), ev);
+}
+
+// Removes the event from the local collection. The reference is returned to the caller.
+static void store_remove(CaldavCalendar* rc, Event* ev)
+{
+	GList* link = g_hash_table_lookup(rc->events_by_href, event_get_url(ev));
+	if (!link || link->data != ev)
+		return;
+	g_hash_table_remove(rc->events_by_href, event_get_url(ev));
+	if (event_get_uid(ev) && g_hash_table_lookup(rc->events_by_uid, event_get_uid(ev)) == ev)
+		g_hash_table_remove(rc->events_by_uid, event_get_uid(ev));
+	g_queue_delete_link(&rc->events, link);
+}
+
+// Replaces old_event by new_event at the same position in the collection. The reference
+// to old_event is returned to the caller, the reference to new_event is taken over.
+static void store_replace(CaldavCalendar* rc, Event* old_event, Event* new_event)
+{
+	GList* link = g_hash_table_lookup(rc->events_by_href, event_get_url(old_event));
+	if (!link || link->data != old_event) {
+		store_insert(rc, new_event);
+		return;
+	}
+	if (event_get_uid(old_event) && g_hash_table_lookup(rc->events_by_uid, event_get_uid(old_event)) == old_event)
+		g_hash_table_remove(rc->events_by_uid, event_get_uid(old_event));
+	if (g_strcmp0(event_get_url(old_event), event_get_url(new_event)) != 0) {
+		g_hash_table_remove(rc->events_by_href, event_get_url(old_event));
+		g_hash_table_insert(rc->events_by_href, g_strdup(event_get_url(new_event)), link);
+	}
+	link->data = new_event;
+	if (event_get_uid(new_event))
+		g_hash_table_insert(rc->events_by_uid, g_strdup(event_get_uid(new_event)), new_event);
+}
+
+// Writes the event through to the on-disk cache, if one has been loaded.
+// The whole calendar object is stored so that any VTIMEZONE is preserved.
+static void cache_store_event(CaldavCalendar* rc, Event* ev)
+{
+	if (!rc->cache)
+		return;
+	icalcomponent* cmp = event_get_component(ev);
+	icalcomponent* parent = icalcomponent_get_parent(cmp);
+	char* data = icalcomponent_as_ical_string_r(parent ? parent : cmp);
+	calendar_cache_put(rc->cache, event_get_url(ev), event_get_etag(ev), data);
+	free(data);
+}
+
+static void cache_remove_event(CaldavCalendar* rc, Event* ev)
+{
+	if (rc->cache)
+		calendar_cache_remove(rc->cache, event_get_url(ev));
+}
+
+typedef enum {
+	CALDAV_OP_SAVE,
+	CALDAV_OP_DELETE,
+} CaldavOpType;
+
+typedef struct _CaldavOp {
+	CaldavOpType type;
+	Event* event; // referenced until the operation completes
+} CaldavOp;
+
+static void op_queue_schedule(CaldavCalendar* rc);
+
+static void op_queue_finish_write(CaldavCalendar* rc, CaldavOp* op)
+{
+	g_hash_table_remove(rc->ops_busy, op->event);
+	rc->writes_in_flight--;
+	g_object_unref(op->event);
+	g_free(op);
+	op_queue_schedule(rc);
+}
+
 typedef struct {
 	CaldavCalendar* cal;
+	CaldavOp* op;
 	char* url;
 	char* cal_postdata;
 	Event* old_event;
@@ -236,28 +446,36 @@ static void caldav_modify_done(CURL* curl, CURLcode ret, void* user)
 			// leak, later it would be better to perhaps remove it from the display
 			// before triggering the sync
 			// event_free(ac->new_event);
+			op_queue_finish_write(cc, ac->op);
 			g_free(ac);
-			cc->op_pending = FALSE;
 			calendar_sync(FOCAL_CALENDAR(cc));
 			return;
 		}
 
-		// "officially" append the event to the collection
+		// "officially" add the event to the collection
 		// TODO: event_replace_component?
-		if (ac->old_event)
-			ac->cal->events = g_slist_remove(ac->cal->events, ac->old_event);
+		if (ac->old_event && ac->new_event) {
+			store_replace(ac->cal, ac->old_event, ac->new_event);
+		} else if (ac->old_event) {
+			store_remove(ac->cal, ac->old_event);
+			cache_remove_event(ac->cal, ac->old_event);
+		} else if (ac->new_event) {
+			store_insert(ac->cal, ac->new_event);
+		}
 		if (ac->new_event)
-			ac->cal->events = g_slist_append(ac->cal->events, ac->new_event);
+			cache_store_event(ac->cal, ac->new_event);
+		if (ac->cal->cache)
+			calendar_cache_flush(ac->cal->cache);
 
-		g_signal_emit_by_name(ac->cal, "event-updated", ac->old_event, ac->new_event);
+		_calendar_event_changed(FOCAL_CALENDAR(ac->cal), ac->old_event, ac->new_event);
 
 		if (ac->old_event && ac->old_event != ac->new_event)
 			g_object_unref(ac->old_event);
 	} else {
-		_calendar_error(FOCAL_CALENDAR(ac), "Error modifying calendar: %s", curl_easy_strerror(ret));
+		_calendar_error(FOCAL_CALENDAR(ac->cal), "Error modifying calendar: %s", curl_easy_strerror(ret));
 	}
 
-	ac->cal->op_pending = FALSE;
+	op_queue_finish_write(ac->cal, ac->op);
 	g_free(ac);
 }
 
@@ -273,10 +491,13 @@ static size_t caldav_put_response_get_etag(char* ptr, size_t size, size_t nmemb,
 	return size * nmemb;
 }
 
-static void do_caldav_put(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers, Event* event)
+static void do_caldav_put(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers, CaldavOp* op)
 {
+	Event* event = op->event;
+
 	ModifyContext* ac = g_new0(ModifyContext, 1);
 	ac->cal = rc;
+	ac->op = op;
 	ac->new_event = event;
 
 	const char* event_url = event_get_url(event);
@@ -292,14 +513,11 @@ static void do_caldav_put(CaldavCalendar* rc, gchar* err, CURL* curl, struct cur
 	const char* url_path = strchrnul(strchr(root_url, ':') + 3, '/');
 	asprintf(&ac->url, "%.*s%s", (int) (url_path - root_url), root_url, event_get_url(event));
 
-	curl_easy_setopt(curl, CURLOPT_URL, ac->url);
-
 	headers = curl_slist_append(headers, "Content-Type: text/calendar; charset=utf-8");
 	headers = curl_slist_append(headers, "Expect:");
 
-	GSList* f = g_slist_find(rc->events, event);
-	if (f)
-		ac->old_event = f->data;
+	if (store_lookup(rc, event_url) == event)
+		ac->old_event = event;
 
 	if (ac->old_event) {
 		char* match;
@@ -319,29 +537,16 @@ static void do_caldav_put(CaldavCalendar* rc, gchar* err, CURL* curl, struct cur
 	curl_easy_setopt(curl, CURLOPT_HEADERDATA, ac->new_event);
 	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, caldav_put_response_get_etag);
 
-	async_curl_add_request(curl, headers, caldav_modify_done, ac);
+	async_curl_add_request(curl, ac->url, headers, ASYNC_CURL_PRIORITY_INTERACTIVE, caldav_modify_done, ac);
 }
 
-#define ENSURE_EXCLUSIVE(rc)                                                                   \
-	do {                                                                                       \
-		if (rc->op_pending) {                                                                  \
-			g_warning("Operation already pending, early return from %s", __PRETTY_FUNCTION__); \
-			return;                                                                            \
-		}                                                                                      \
-		rc->op_pending = TRUE;                                                                 \
-	} while (0)
-
-static void save_event(Calendar* c, Event* event)
+static void do_delete_event(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers, CaldavOp* op)
 {
-	CaldavCalendar* rc = FOCAL_CALDAV_CALENDAR(c);
-	ENSURE_EXCLUSIVE(rc);
-	remote_auth_new_request(rc->auth, do_caldav_put, rc, event);
-}
+	Event* event = op->event;
 
-static void do_delete_event(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers, Event* event)
-{
 	ModifyContext* pc = g_new0(ModifyContext, 1);
 	pc->cal = rc;
+	pc->op = op;
 	pc->old_event = event;
 	// TODO is this if stmt really needed?
 	const char* event_url = event_get_url(event);
@@ -355,7 +560,6 @@ static void do_delete_event(CaldavCalendar* rc, gchar* err, CURL* curl, struct c
 	char* url_path = strchrnul(strchr(root_url, ':') + 3, '/');
 	asprintf(&pc->url, "%.*s%s", (int) (url_path - root_url), root_url, event_url);
 
-	curl_easy_setopt(curl, CURLOPT_URL, pc->url);
 	curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
 
 	// set the If-Match header
@@ -364,41 +568,188 @@ static void do_delete_event(CaldavCalendar* rc, gchar* err, CURL* curl, struct c
 	headers = curl_slist_append(headers, match);
 	free(match);
 
-	async_curl_add_request(curl, headers, caldav_modify_done, pc);
+	async_curl_add_request(curl, pc->url, headers, ASYNC_CURL_PRIORITY_INTERACTIVE, caldav_modify_done, pc);
 }
 
-static void delete_event(Calendar* c, Event* event)
+static void do_caldav_sync(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers);
+
+// Returns the first queued write whose event has no write in flight or
+// queued ahead of it, removing it from the queue
+static CaldavOp* op_queue_take_next_write(CaldavCalendar* rc)
 {
-	CaldavCalendar* rc = FOCAL_CALDAV_CALENDAR(c);
-	ENSURE_EXCLUSIVE(rc);
+	for (GList* l = rc->ops.head; l; l = l->next) {
+		CaldavOp* op = l->data;
+		if (g_hash_table_contains(rc->ops_busy, op->event))
+			continue;
+		gboolean blocked = FALSE;
+		for (GList* e = rc->ops.head; e != l && !blocked; e = e->next)
+			blocked = ((CaldavOp*) e->data)->event == op->event;
+		if (blocked)
+			continue;
+		g_queue_delete_link(&rc->ops, l);
+		return op;
+	}
+	return NULL;
+}
+
+static void credentials_failed(CaldavCalendar* rc, CaldavAuthKind kind, void* arg, const char* err);
+static void do_range_query(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers, MultigetContext* mg);
+
+// Every credential request of the calendar is delivered here, so that an
+// operation whose credentials could not be obtained is always cleaned up.
+// The callback of the operation is only invoked with valid credentials.
+static void on_credentials(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers, void* arg)
+{
+	void (*callback)() = rc->auth_callback;
+	CaldavAuthKind kind = rc->auth_kind;
+	rc->auth_pending = FALSE;
+	rc->auth_callback = NULL;
+	op_queue_schedule(rc);
+
+	if (err) {
+		credentials_failed(rc, kind, arg, err);
+		g_free(err);
+		return;
+	}
+	(*callback)(rc, NULL, curl, headers, arg);
+}
+
+// Requests credentials for an operation. Only one request may be
+// outstanding at a time, see auth_pending. If invalidate is set, the
+// credentials were rejected by the server and are renewed first.
+static void request_credentials(CaldavCalendar* rc, CaldavAuthKind kind, gboolean invalidate, void (*callback)(), void* arg)
+{
+	g_assert_false(rc->auth_pending);
+	rc->auth_pending = TRUE;
+	rc->auth_callback = callback;
+	rc->auth_kind = kind;
+	if (invalidate)
+		remote_auth_invalidate_credential(rc->auth, on_credentials, rc, arg);
+	else
+		remote_auth_new_request(rc->auth, on_credentials, rc, arg);
+}
+
+// Starts whatever can be started. Credentials are requested for one
+// operation at a time, the next is started once they have been delivered.
+static void op_queue_run(CaldavCalendar* rc)
+{
+	if (rc->auth_pending)
+		return;
+
+	// A date range on display is wanted straight away
+	if (rc->range_next) {
+		MultigetContext* mg = rc->range_next;
+		rc->range_next = NULL;
+		request_credentials(rc, CALDAV_AUTH_RANGE_QUERY, FALSE, do_range_query, mg);
+		return;
+	}
+
+	// A running sync only gives way to writes between its steps
+	gboolean sync_busy = rc->sync_running && !rc->sync_next;
+	if (!sync_busy && rc->writes_in_flight < MAX_CONCURRENT_WRITES) {
+		CaldavOp* op = op_queue_take_next_write(rc);
+		if (op) {
+			g_hash_table_add(rc->ops_busy, op->event);
+			rc->writes_in_flight++;
+			request_credentials(rc, CALDAV_AUTH_WRITE, FALSE, op->type == CALDAV_OP_SAVE ? do_caldav_put : do_delete_event, op);
+			return;
+		}
+	}
+
+	if (sync_busy || rc->writes_in_flight > 0 || !g_queue_is_empty(&rc->ops))
+		return;
+
+	if (rc->sync_next) {
+		void (*callback)() = rc->sync_next;
+		rc->sync_next = NULL;
+		request_credentials(rc, rc->sync_next_kind, rc->sync_next_invalidate, callback, rc->sync_next_arg);
+	} else if (rc->sync_requested) {
+		rc->sync_requested = FALSE;
+		rc->sync_running = TRUE;
+		request_credentials(rc, CALDAV_AUTH_SYNC, FALSE, do_caldav_sync, NULL);
+	}
+}
+
+static gboolean op_queue_run_idle(gpointer user)
+{
+	CaldavCalendar* rc = (CaldavCalendar*) user;
+	rc->op_queue_source = 0;
+	op_queue_run(rc);
+	return G_SOURCE_REMOVE;
+}
+
+// The queue is always run from the main loop, since it may be triggered from
+// within a RemoteAuth callback which does not allow a new request to be made
+static void op_queue_schedule(CaldavCalendar* rc)
+{
+	if (!rc->op_queue_source)
+		rc->op_queue_source = g_idle_add(op_queue_run_idle, rc);
+}
+
+static void op_queue_push_write(CaldavCalendar* rc, CaldavOpType type, Event* event)
+{
+	CaldavOp* op = g_new0(CaldavOp, 1);
+	op->type = type;
+	op->event = g_object_ref(event);
+	g_queue_push_tail(&rc->ops, op);
+	op_queue_schedule(rc);
+}
+
+// Continues the running sync with callback once any queued writes are done
+static void sync_continue(CaldavCalendar* rc, CaldavAuthKind kind, void (*callback)(), void* arg, gboolean invalidate)
+{
+	rc->sync_next = callback;
+	rc->sync_next_kind = kind;
+	rc->sync_next_arg = arg;
+	rc->sync_next_invalidate = invalidate;
+	op_queue_schedule(rc);
+}
+
+static void op_queue_sync_done(CaldavCalendar* rc)
+{
+	rc->sync_running = FALSE;
+	op_queue_schedule(rc);
+}
 
+static void save_event(Calendar* c, Event* event)
+{
+	op_queue_push_write(FOCAL_CALDAV_CALENDAR(c), CALDAV_OP_SAVE, event);
+}
+
+static void delete_event(Calendar* c, Event* event)
+{
 	// if the event has no etag, it has never been added to this calendar
 	if (!event_get_etag(event))
 		return;
 
-	remote_auth_new_request(rc->auth, do_delete_event, rc, event);
+	op_queue_push_write(FOCAL_CALDAV_CALENDAR(c), CALDAV_OP_DELETE, event);
 }
 
 static void each_event(Calendar* c, CalendarEachEventCallback callback, void* user)
 {
 	CaldavCalendar* rc = FOCAL_CALDAV_CALENDAR(c);
-	for (GSList* p = rc->events; p; p = p->next) {
+	for (GList* p = rc->events.head; p; p = p->next) {
 		callback(user, (Event*) p->data);
 	}
 }
 
 static void free_events(CaldavCalendar* rc)
 {
-	g_slist_free_full(rc->events, (GDestroyNotify) g_object_unref);
+	g_hash_table_remove_all(rc->events_by_href);
+	g_hash_table_remove_all(rc->events_by_uid);
+	g_queue_foreach(&rc->events, (GFunc) g_object_unref, NULL);
+	g_queue_clear(&rc->events);
 }
 
-static Event* create_event_from_parsed_xml(CaldavCalendar* cal, CaldavEntry* cde)
+// Creates an Event from the calendar-data of a multiget response, already parsed
+// into comp (which may be NULL if parsing failed). On success, ownership of comp
+// and cde is taken. Otherwise comp is freed and cde is left to the caller.
+static Event* create_event_from_parsed_xml(CaldavCalendar* cal, CaldavEntry* cde, icalcomponent* comp)
 {
-	// event updated
-	icalcomponent* comp = icalparser_parse_string(cde->caldata);
-	icalcomponent* vev = icalcomponent_get_first_component(comp, ICAL_VEVENT_COMPONENT);
+	icalcomponent* vev = comp ? icalcomponent_get_first_component(comp, ICAL_VEVENT_COMPONENT) : NULL;
 	if (!vev) {
-		icalcomponent_free(comp);
+		if (comp)
+			icalcomponent_free(comp);
 		return NULL;
 	}
 	Event* ev = event_new_from_icalcomponent(vev);
@@ -419,258 +770,736 @@ static void caldav_entry_free(CaldavEntry* cde)
 	free(cde);
 }
 
+// Removes an event that has been deleted on the server from the local collection
+static void sync_delete_event(CaldavCalendar* rc, Event* ee)
+{
+	// Notify anyone using the event that it's about to disappear
+	_calendar_event_changed(FOCAL_CALENDAR(rc), ee, NULL);
+	cache_remove_event(rc, ee);
+	store_remove(rc, ee);
+	g_object_unref(ee);
+}
+
+// State shared by all calendar-multiget batches belonging to one sync operation
+struct _MultigetContext {
+	CaldavCalendar* cal;
+	// authenticated handle and headers from which each batch request is cloned
+	CURL* curl;
+	struct curl_slist* headers;
+	// hrefs not yet requested
+	GSList* hrefs;
+	int batch_size;
+	int max_requests;
+	int in_flight;
+	gboolean failed;
+	// calendar-data responses handed to the parser pool and not yet merged
+	int pending_parses;
+	// only committed once every batch has succeeded, so that resources from a
+	// failed batch are reported again by the next sync-collection REPORT
+	char* sync_token;
+	// set if the sync-collection result was truncated. Unless the server
+	// returned a new sync-token to continue from, the sync then ends without
+	// having seen the whole collection
+	gboolean truncated;
+	gboolean more;
+	// set if changes are delivered batch by batch, since the calendar is
+	// already displayed while the initial sync fetches the rest of it
+	gboolean backfill;
+	// set for a calendar-query REPORT of a single date range instead
+	gboolean range_query;
+	gboolean initial; // the range query which starts the initial sync
+	icaltime_span range;
+	// debug counters
+	int nUpdated, nNew;
+};
+
+// Frees a MultigetContext which has no requests or parses outstanding
+static void multiget_context_free(MultigetContext* mg)
+{
+	g_slist_free_full(mg->hrefs, free);
+	free(mg->sync_token);
+	if (mg->curl)
+		async_curl_release_handle(mg->curl);
+	curl_slist_free_all(mg->headers);
+	g_free(mg);
+}
+
 typedef struct {
 	CaldavCalendar* cal;
+	MultigetContext* mg;
 	GString* report_req;
-	GString* report_resp;
+	// the response body is parsed incrementally as it arrives
+	xmlParserCtxtPtr parser;
+	XmlParseCtx xml;
 } SyncContext;
 
-static void sync_multiget_report_done(CURL* curl, CURLcode ret, void* user)
+// CURLOPT_WRITEFUNCTION which feeds the response body straight into the push
+// parser, so the whole multistatus document never has to be held in memory
+static size_t curl_write_to_xml_parser(char* ptr, size_t size, size_t nmemb, void* userdata)
+{
+	SyncContext* sc = (SyncContext*) userdata;
+	xmlParseChunk(sc->parser, ptr, size * nmemb, 0);
+	return size * nmemb;
+}
+
+static void sync_context_begin_parse(SyncContext* sc, CURL* curl, xmlSAXHandler* handler)
+{
+	xmlctx_init(&sc->xml);
+	sc->parser = xmlCreatePushParserCtxt(handler, &sc->xml, NULL, 0, NULL);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, sc);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_to_xml_parser);
+}
+
+// Terminates the push parser. Results not already delivered through the
+// on_response callback remain in sc->xml for the caller to consume.
+static void sync_context_end_parse(SyncContext* sc)
+{
+	xmlParseChunk(sc->parser, NULL, 0, 1);
+	xmlFreeParserCtxt(sc->parser);
+	xmlctx_cleanup(&sc->xml);
+}
+
+// iCalendar parsing is by far the most expensive part of a sync, so it is done
+// on a pool of worker threads shared by all calendars. Only the resulting merge
+// into the collection, and the signals it emits, happen on the main thread.
+// A job holds a reference to the calendar until it has been merged.
+typedef struct {
+	MultigetContext* mg;
+	CaldavEntry* cde;
+	icalcomponent* comp;
+} ParseJob;
+
+static GThreadPool* parse_pool;
+
+static void multiget_maybe_finish(MultigetContext* mg);
+
+// Main thread: merge a parsed calendar-multiget response into the collection
+static gboolean parse_job_done(gpointer user)
+{
+	ParseJob* job = (ParseJob*) user;
+	MultigetContext* mg = job->mg;
+	CaldavCalendar* rc = mg->cal;
+	CaldavEntry* cde = job->cde;
+	// Look up again, the collection may have changed while the job was queued
+	Event* ee = store_lookup(rc, cde->href);
+	Event* event = create_event_from_parsed_xml(rc, cde, job->comp);
+	// An event created here may have been stored by the server under another
+	// href than the one it was PUT to. UIDs are unique within a collection
+	// (RFC 4791 section 5.3.2), so it still replaces the local copy
+	if (event && !ee && event_get_uid(event)) {
+		ee = g_hash_table_lookup(rc->events_by_uid, event_get_uid(event));
+		if (ee)
+			cache_remove_event(rc, ee);
+	}
+	if (!event) {
+		// unparseable calendar-data. Treat as deleted, like a missing one
+		if (ee)
+			sync_delete_event(rc, ee);
+		caldav_entry_free(cde);
+	} else if (ee) {
+		// event updated. Notify anyone using the old event that it's about to disappear
+		_calendar_event_changed(FOCAL_CALENDAR(rc), ee, event);
+		// replace the old event with the new one
+		store_replace(rc, ee, event);
+		g_object_unref(ee);
+		cache_store_event(rc, event);
+		mg->nUpdated++;
+	} else {
+		store_insert(rc, event);
+		cache_store_event(rc, event);
+		mg->nNew++;
+		_calendar_event_changed(FOCAL_CALENDAR(rc), NULL, event);
+	}
+	g_free(job);
+
+	mg->pending_parses--;
+	multiget_maybe_finish(mg);
+	g_object_unref(rc);
+	return G_SOURCE_REMOVE;
+}
+
+// Worker thread: parse the calendar-data and hand the result back to the main loop
+static void parse_job_run(gpointer data, gpointer user)
+{
+	ParseJob* job = (ParseJob*) data;
+	job->comp = icalparser_parse_string(job->cde->caldata);
+	g_idle_add(parse_job_done, job);
+}
+
+// Merges a single calendar-multiget response into the local collection. Called
+// from the SAX parser while the rest of the response is still being received.
+static void sync_merge_multiget_entry(void* user, void* entry)
 {
 	SyncContext* sc = (SyncContext*) user;
 	CaldavCalendar* rc = sc->cal;
+	CaldavEntry* cde = (CaldavEntry*) entry;
+	Event* ee = store_lookup(rc, cde->href);
+	if (!cde->caldata) {
+		// If the calendar-data is NULL, assume the event is deleted. This can
+		// happen if an event is removed after the sync-collection request but
+		// before the response to this multiget. A removal or permission denied
+		// that does not match a local resource can be ignored.
+		if (ee)
+			sync_delete_event(rc, ee);
+		caldav_entry_free(cde);
+	} else if (ee && g_strcmp0(cde->etag, event_get_etag(ee)) == 0) {
+		// we already knew about this update (we probably did it ourselves). Just ignore it.
+		caldav_entry_free(cde);
+	} else {
+		if (!parse_pool)
+			parse_pool = g_thread_pool_new(parse_job_run, NULL, g_get_num_processors(), FALSE, NULL);
+		ParseJob* job = g_new0(ParseJob, 1);
+		job->mg = sc->mg;
+		job->cde = cde;
+		g_object_ref(rc);
+		sc->mg->pending_parses++;
+		g_thread_pool_push(parse_pool, job, NULL);
+	}
+}
+
+static xmlSAXHandler multiget_sax_handler = {.characters = xmlparse_characters,
+											 .startElement = xmlparse_tag_open,
+											 .endElement = xmlparse_find_caldata};
+
+static xmlSAXHandler sync_collection_sax_handler = {.characters = xmlparse_characters,
+													.startElement = xmlparse_tag_open,
+													.endElement = xmlparse_report_sync_collection};
+
+static xmlSAXHandler ctag_sax_handler = {.characters = xmlparse_characters,
+										 .startElement = xmlparse_tag_open,
+										 .endElement = xmlparse_find_ctag};
+
+// Records the getctag seen before a sync once the sync has completed
+static void sync_commit_ctag(CaldavCalendar* rc)
+{
+	if (!rc->pending_ctag)
+		return;
+	g_free(rc->ctag);
+	rc->ctag = rc->pending_ctag;
+	rc->pending_ctag = NULL;
+	if (rc->cache)
+		calendar_cache_set_token(rc->cache, "ctag", rc->ctag);
+}
+
+static void multiget_next_batches(MultigetContext* mg);
+
+static void sync_multiget_report_done(CURL* curl, CURLcode ret, void* user)
+{
+	SyncContext* sc = (SyncContext*) user;
+	MultigetContext* mg = sc->mg;
 
 	g_string_free(sc->report_req, TRUE);
 
-	// Debug
-	//printf("sync done: [%s]\n", sc->report_resp->str);
+	// Flush the parser. Every complete response has already been merged or
+	// handed to the parser pool
+	sync_context_end_parse(sc);
+	g_free(sc);
 
-	// Handle the case where the http request failed
+	long response_code = 0;
+	if (ret == CURLE_OK)
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+	// A failed batch does not affect the others, those resources will be
+	// fetched again in the next sync
 	if (ret != CURLE_OK) {
-		_calendar_error(FOCAL_CALENDAR(rc), "Error syncing calendar: %s", curl_easy_strerror(ret));
-		sc->cal->op_pending = FALSE;
-		g_string_free(sc->report_resp, TRUE);
-		free(sc);
-		g_signal_emit_by_name(rc, "sync-done", FALSE, 0);
-		return;
+		g_critical("multiget failed: %s", curl_easy_strerror(ret));
+		mg->failed = TRUE;
+	} else if (response_code != 207) {
+		g_critical("unexpected response code %ld", response_code);
+		mg->failed = TRUE;
 	}
 
-	// Parse the response
-	XmlParseCtx ctx;
-	xmlctx_init(&ctx);
-	xmlSAXHandler my_handler = {.characters = xmlparse_characters,
-								.startElement = xmlparse_tag_open,
-								.endElement = xmlparse_find_caldata};
-	xmlSAXUserParseMemory(&my_handler, &ctx, sc->report_resp->str, sc->report_resp->len);
-	xmlctx_cleanup(&ctx);
-	g_string_free(sc->report_resp, TRUE);
-	// ctx.result_list now contains a GSList of CaldavEntry structs
-
-	// Debug counters
-	int nUpdated = 0, nNew = 0;
-
-	// Merge the results from the sync with the existing events
-	GSList** n = &ctx.result_list;
-	while (*n) {
-		CaldavEntry* cde = (*n)->data;
-		// Look through the existing list of events for matching resources
-		for (GSList** p = &sc->cal->events; *p; p = &(*p)->next) {
-			Event* ee = (Event*) (*p)->data;
-			if (strcmp(cde->href, event_get_url(ee)) == 0) {
-				if (cde->caldata) {
-					// event updated
-					if (strcmp(cde->etag, event_get_etag(ee)) == 0) {
-						// we already knew about this update (we probably did it ourselves). Just ignore it.
-						caldav_entry_free(cde);
-					} else {
-						Event* updated_event = create_event_from_parsed_xml(rc, cde);
-						// notify anyone using the old event that it's about to disappear
-						g_signal_emit_by_name(rc, "event-updated", (*p)->data, updated_event);
-						// replace the old event with the new one
-						g_object_unref((*p)->data);
-						(*p)->data = updated_event;
-						nUpdated++;
-					}
-				} else {
-					// If the calendar-data is NULL, assume the event is deleted. This can
-					// happen if an event is removed after the sync-collection request but
-					// before the response to this multiget. Notify anyone using the event
-					// that it's about to disappear.
-					g_signal_emit_by_name(rc, "event-updated", (*p)->data, NULL);
-					g_object_unref((*p)->data);
-					*p = (*p)->next;
-					caldav_entry_free(cde);
-				}
-				// Since a match was found and dealt with, remove this entry from the list
-				gpointer next = (*n)->next;
-				g_slist_free_1(*n);
-				*n = next;
-				// break & continue,
-				goto sync_populate_local_list_event_matched;
-			}
-		}
-		// if we get here, there was no matching resource in the existing list.
-		// so move onto the next entry. If it was matched we have already advanced
-		n = &(*n)->next;
-		// empty statement for "break & continue"
-	sync_populate_local_list_event_matched:
-		(void) 0;
-	}
-
-	// Everything remaining in ctx.event_list should be new events
-	for (GSList* e = ctx.result_list; e; e = e->next) {
-		CaldavEntry* cde = e->data;
-		Event* event;
-		// A removal or permission denied that was not matched in the local list above will still be here,
-		// but its caldata member will be empty. So it can be ignored.
-		if (cde->caldata && (event = create_event_from_parsed_xml(rc, cde))) {
-			sc->cal->events = g_slist_append(sc->cal->events, event);
-			nNew++;
-			g_signal_emit_by_name(rc, "event-updated", NULL, event);
-		} else {
-			caldav_entry_free(cde);
+	mg->in_flight--;
+	if (mg->backfill) {
+		// deliver what has been merged so far
+		_calendar_end_changes(FOCAL_CALENDAR(mg->cal));
+		_calendar_begin_changes(FOCAL_CALENDAR(mg->cal));
+	}
+	multiget_next_batches(mg);
+	multiget_maybe_finish(mg);
+}
+
+// Called once the collection is known to be complete, from then on ranges
+// are covered by the regular sync
+static void loaded_ranges_clear(CaldavCalendar* rc)
+{
+	if (rc->loaded_ranges) {
+		g_array_free(rc->loaded_ranges, TRUE);
+		rc->loaded_ranges = NULL;
+	}
+}
+
+// Ranges are recorded as soon as they are requested, so that a range still in
+// flight is not requested again. A failed range is removed again.
+static void loaded_ranges_add(CaldavCalendar* rc, icaltime_span range)
+{
+	if (!rc->loaded_ranges)
+		rc->loaded_ranges = g_array_new(FALSE, FALSE, sizeof(icaltime_span));
+	g_array_append_val(rc->loaded_ranges, range);
+}
+
+static void loaded_ranges_remove(CaldavCalendar* rc, icaltime_span range)
+{
+	for (guint i = 0; rc->loaded_ranges && i < rc->loaded_ranges->len; ++i) {
+		icaltime_span r = g_array_index(rc->loaded_ranges, icaltime_span, i);
+		if (r.start == range.start && r.end == range.end) {
+			g_array_remove_index_fast(rc->loaded_ranges, i);
+			return;
 		}
 	}
-	g_slist_free(ctx.result_list);
+}
+
+static void do_sync_collection(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers);
+
+// Completes a calendar-query REPORT. The sync-token is left alone, since only
+// part of the collection has been fetched. The range query which starts the
+// initial sync makes the calendar available, and is followed by a full
+// sync-collection REPORT for the rest of it.
+static void range_query_finish(MultigetContext* mg)
+{
+	CaldavCalendar* rc = mg->cal;
+	gboolean ok = !mg->failed;
+	gboolean initial = mg->initial;
+
+	printf("sync: %d updated, %d new in date range\n", mg->nUpdated, mg->nNew);
+	if (!ok)
+		loaded_ranges_remove(rc, mg->range);
+	if (rc->cache)
+		calendar_cache_flush(rc->cache);
+	g_free(mg);
+	_calendar_end_changes(FOCAL_CALENDAR(rc));
+
+	if (!initial)
+		return;
+	// The sync keeps running until the whole collection has been fetched. On
+	// failure, the full sync will report the error if there is a real problem
+	if (ok)
+		g_signal_emit_by_name(rc, "initial-window-synced");
+	sync_continue(rc, CALDAV_AUTH_SYNC, do_sync_collection, NULL, FALSE);
+}
+
+// Commits the sync-token of one page of a truncated sync-collection result
+// once all of its changes have been merged, and requests the next page. Only
+// one page is held at a time, however large the result.
+static void sync_next_page(CaldavCalendar* rc, char* sync_token)
+{
+	free(rc->sync_token);
+	rc->sync_token = sync_token; // (xfer ownership)
+	if (rc->cache) {
+		calendar_cache_set_token(rc->cache, "sync-token", rc->sync_token);
+		calendar_cache_flush(rc->cache);
+	}
+	sync_continue(rc, CALDAV_AUTH_SYNC, do_sync_collection, NULL, FALSE);
+}
+
+static void do_multiget_events(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers, MultigetContext* mg);
+
+// Completes the sync once every batch has been received and merged
+static void multiget_maybe_finish(MultigetContext* mg)
+{
+	CaldavCalendar* rc = mg->cal;
+	if (mg->in_flight > 0 || mg->pending_parses > 0)
+		return;
+
+	if (mg->hrefs) {
+		// Paused for queued writes, which run before the remaining batches
+		_calendar_end_changes(FOCAL_CALENDAR(rc));
+		async_curl_release_handle(mg->curl);
+		curl_slist_free_all(mg->headers);
+		mg->curl = NULL;
+		mg->headers = NULL;
+		sync_continue(rc, CALDAV_AUTH_SYNC_MULTIGET, do_multiget_events, mg, FALSE);
+		return;
+	}
+
+	if (mg->range_query) {
+		range_query_finish(mg);
+		return;
+	}
 
 	// print debug counters
-	printf("sync: %d updated, %d new\n", nUpdated, nNew);
+	printf("sync: %d updated, %d new\n", mg->nUpdated, mg->nNew);
+
+	gboolean ok = !mg->failed;
+	if (ok && mg->more) {
+		// deliver the changes of this page, the sync keeps running
+		_calendar_end_changes(FOCAL_CALENDAR(rc));
+		char* sync_token = mg->sync_token;
+		async_curl_release_handle(mg->curl);
+		curl_slist_free_all(mg->headers);
+		g_free(mg);
+		sync_next_page(rc, sync_token);
+		return;
+	}
 
-	g_free(sc);
+	if (ok) {
+		free(rc->sync_token);
+		rc->sync_token = mg->sync_token; // (xfer ownership)
+	} else {
+		free(mg->sync_token);
+	}
+
+	// The sync-token is only persisted once the corresponding resources have been
+	// fetched, otherwise a restart in between would skip over those changes.
+	// Only a complete result shows that the whole collection is known.
+	if (ok && !mg->truncated) {
+		sync_commit_ctag(rc);
+		loaded_ranges_clear(rc);
+	}
+	if (rc->cache) {
+		if (ok)
+			calendar_cache_set_token(rc->cache, "sync-token", rc->sync_token);
+		calendar_cache_flush(rc->cache);
+	}
+
+	async_curl_release_handle(mg->curl);
+	curl_slist_free_all(mg->headers);
+	g_free(mg);
 
 	// All done, notify
-	rc->op_pending = FALSE;
-	g_signal_emit_by_name(rc, "sync-done", TRUE, 0);
+	op_queue_sync_done(rc);
+	_calendar_end_changes(FOCAL_CALENDAR(rc));
+	if (!ok)
+		_calendar_error(FOCAL_CALENDAR(rc), "Error syncing calendar: some events could not be fetched");
+	g_signal_emit_by_name(rc, "sync-done", ok, 0);
 }
 
-static void do_multiget_events(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers, GSList* hrefs)
+// Issues calendar-multiget REPORTs for the pending hrefs until either all have
+// been requested or the maximum number of concurrent requests is reached. No
+// more are issued while writes are queued, see multiget_maybe_finish.
+static void multiget_next_batches(MultigetContext* mg)
 {
-	SyncContext* sc = g_new0(SyncContext, 1);
-	sc->cal = rc;
+	while (mg->hrefs && mg->in_flight < mg->max_requests && g_queue_is_empty(&mg->cal->ops)) {
+		SyncContext* sc = g_new0(SyncContext, 1);
+		sc->cal = mg->cal;
+		sc->mg = mg;
+
+		// Build the query
+		sc->report_req = g_string_new(
+			"<?xml version=\"1.0\" encoding=\"utf-8\" ?>"
+			"<C:calendar-multiget xmlns:D=\"DAV:\" xmlns:C=\"urn:ietf:params:xml:ns:caldav\">"
+			"  <D:prop>"
+			"    <D:getetag/>"
+			"    <C:calendar-data/>"
+			"  </D:prop>");
+		for (int i = 0; mg->hrefs && i < mg->batch_size; ++i) {
+			char* href = mg->hrefs->data;
+			g_string_append_printf(sc->report_req, "<D:href>%s</D:href>", href);
+			free(href);
+			mg->hrefs = g_slist_delete_link(mg->hrefs, mg->hrefs);
+		}
+		g_string_append(sc->report_req, "</C:calendar-multiget>");
+
+		// Each batch needs its own handle. Cloning the authenticated one avoids a
+		// round trip through the RemoteAuth for every batch
+		CURL* curl = curl_easy_duphandle(mg->curl);
+		struct curl_slist* headers = NULL;
+		for (struct curl_slist* h = mg->headers; h; h = h->next)
+			headers = curl_slist_append(headers, h->data);
+
+		// Finalise and fire the multiget request
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, sc->report_req->str);
+
+		sync_context_begin_parse(sc, curl, &multiget_sax_handler);
+		sc->xml.on_response = sync_merge_multiget_entry;
+		sc->xml.user = sc;
+
+		mg->in_flight++;
+		async_curl_add_request(curl, calendar_get_location(FOCAL_CALENDAR(mg->cal)), headers, ASYNC_CURL_PRIORITY_BACKGROUND, sync_multiget_report_done, sc);
+	}
+}
 
+static void do_multiget_events(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers, MultigetContext* mg)
+{
 	// According to RFC6578 Appendix B, the next step is to send GET requests
 	// for each resource returned in the earlier sync-collection REPORT method.
-	// Here we instead use a calendar-multiget REPORT for efficiency.
+	// Here we instead use calendar-multiget REPORTs for efficiency, split into
+	// batches so that no single request or response grows unreasonably large.
 	// See https://tools.ietf.org/html/rfc6578#appendix-B
 
-	curl_easy_setopt(curl, CURLOPT_URL, calendar_get_location(FOCAL_CALENDAR(rc)));
-
 	headers = curl_slist_append(headers, "Depth: 1");
 	headers = curl_slist_append(headers, "Prefer: return-minimal");
 	headers = curl_slist_append(headers, "Content-Type: application/xml; charset=utf-8");
 	curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "REPORT");
 
-	// Build the query
-	sc->report_req = g_string_new(
-		"<?xml version=\"1.0\" encoding=\"utf-8\" ?>"
-		"<C:calendar-multiget xmlns:D=\"DAV:\" xmlns:C=\"urn:ietf:params:xml:ns:caldav\">"
-		"  <D:prop>"
-		"    <D:getetag/>"
-		"    <C:calendar-data/>"
-		"  </D:prop>");
-	for (GSList* p = hrefs; p; p = p->next)
-		g_string_append_printf(sc->report_req, "<D:href>%s</D:href>", (const char*) p->data);
-	g_string_append(sc->report_req, "</C:calendar-multiget>");
-
-	// Free the list of hrefs
-	g_slist_free_full(hrefs, free);
-
-	// Finalise and fire the multiget request
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, sc->report_req->str);
+	mg->curl = curl;
+	mg->headers = headers;
+	// Opened only now that nothing can fail before the sync ends it
+	_calendar_begin_changes(FOCAL_CALENDAR(rc));
+	multiget_next_batches(mg);
+}
 
-	sc->report_resp = g_string_new(NULL);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, sc->report_resp);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_to_gstring);
+static void do_caldav_sync(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers);
 
-	async_curl_add_request(curl, headers, sync_multiget_report_done, sc);
+static void sync_entries_free(GSList* entries)
+{
+	for (GSList* s = entries; s; s = s->next) {
+		free(((SyncEntry*) s->data)->href);
+		g_free(((SyncEntry*) s->data)->etag);
+	}
+	g_slist_free_full(entries, free);
 }
 
-static void do_caldav_sync(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers);
+// Fetches the new and updated resources found by a sync and completes it once
+// they have been merged
+static void sync_fetch_resources(CaldavCalendar* rc, GSList* hrefs, char* sync_token, int nDeleted, gboolean truncated)
+{
+	// A truncated result continues from the returned sync-token. If it is the
+	// one just sent, another request would return the same result
+	gboolean more = truncated && sync_token && g_strcmp0(sync_token, rc->sync_token) != 0;
+	if (more)
+		printf("sync: result truncated, continuing\n");
+	else if (truncated)
+		printf("sync: result truncated without progress, continuing in the next sync\n");
 
-static void sync_collection_report_done(CURL* curl, CURLcode ret, void* user)
+	// early return in the case where there are no new or updated events
+	if (hrefs == NULL && more) {
+		printf("sync: %d deleted\n", nDeleted);
+		sync_next_page(rc, sync_token);
+		return;
+	} else if (hrefs == NULL) {
+		// Store the new sync-token for subsequent sync operations
+		free(rc->sync_token);
+		rc->sync_token = sync_token; // (xfer ownership)
+		if (!truncated) {
+			sync_commit_ctag(rc);
+			loaded_ranges_clear(rc);
+		}
+		if (nDeleted) {
+			printf("sync: %d deleted\n", nDeleted);
+		} else {
+			printf("sync: no changes\n");
+		}
+		if (rc->cache) {
+			calendar_cache_set_token(rc->cache, "sync-token", rc->sync_token);
+			calendar_cache_flush(rc->cache);
+		}
+		// sync-done here is necessary if items were deleted OR it's the initial sync.
+		// We know whether we deleted something but don't know if this is an initial sync.
+		g_signal_emit_by_name(rc, "sync-done", TRUE, 0);
+		op_queue_sync_done(rc);
+		return;
+	}
+
+	const CalendarConfig* cfg = calendar_get_config(FOCAL_CALENDAR(rc));
+	MultigetContext* mg = g_new0(MultigetContext, 1);
+	mg->cal = rc;
+	mg->hrefs = hrefs;
+	mg->sync_token = sync_token; // (xfer ownership)
+	mg->truncated = truncated;
+	mg->more = more;
+	mg->batch_size = cfg->multiget_batch_size > 0 ? cfg->multiget_batch_size : MULTIGET_BATCH_SIZE;
+	mg->max_requests = cfg->multiget_max_requests > 0 ? cfg->multiget_max_requests : MULTIGET_MAX_REQUESTS;
+	mg->backfill = rc->loaded_ranges != NULL;
+	sync_continue(rc, CALDAV_AUTH_SYNC_MULTIGET, do_multiget_events, mg, FALSE);
+}
+
+static void etag_sync_propfind_done(CURL* curl, CURLcode ret, void* user)
 {
 	SyncContext* sc = (SyncContext*) user;
 	CaldavCalendar* rc = sc->cal;
 
 	g_string_free(sc->report_req, TRUE);
+	sync_context_end_parse(sc);
+	XmlParseCtx ctx = sc->xml;
+	free(sc);
 
-	// Debug
-	//printf("sync done: [%s]\n", sc->report_resp->str);
-
-	// Handle the case where the http request failed
-	if (ret != CURLE_OK) {
-		_calendar_error(FOCAL_CALENDAR(rc), "Error syncing calendar: %s", curl_easy_strerror(ret));
-		sc->cal->op_pending = FALSE;
-		g_string_free(sc->report_resp, TRUE);
-		free(sc);
+	long response_code = 0;
+	if (ret == CURLE_OK)
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+	if (ret != CURLE_OK || response_code != 207) {
+		sync_entries_free(ctx.result_list);
+		free(ctx.sync_token);
+		g_free(ctx.ctag);
+		if (response_code == 401) {
+			g_warning("401 Unauthorized. Assuming auth token has expired and attempting refresh");
+			sync_continue(rc, CALDAV_AUTH_SYNC, do_caldav_sync, NULL, TRUE);
+			return;
+		}
+		if (ret != CURLE_OK)
+			_calendar_error(FOCAL_CALENDAR(rc), "Error syncing calendar: %s", curl_easy_strerror(ret));
+		else
+			_calendar_error(FOCAL_CALENDAR(rc), "Error syncing calendar: unexpected response code %ld", response_code);
+		op_queue_sync_done(rc);
 		g_signal_emit_by_name(rc, "sync-done", FALSE, 0);
 		return;
 	}
 
-	long response_code;
-	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-	if (response_code == 401) {
-		g_warning("401 Unauthorized. Assuming auth token has expired and attempting refresh");
-		remote_auth_invalidate_credential(rc->auth, do_caldav_sync, rc, NULL);
-		return;
-	} else if (response_code != 207) {
-		g_critical("unexpected response code %ld", response_code);
+	// The listing is consistent with the getctag and sync-token reported with
+	// it. The latter is only of use if the server supports sync-collection
+	g_free(rc->pending_ctag);
+	rc->pending_ctag = ctx.ctag; // (xfer ownership)
+	if (rc->etag_sync || !ctx.sync_token) {
+		free(ctx.sync_token);
+		ctx.sync_token = strdup("");
+	}
+
+	// Deletions are delivered together, changed resources once fetched
+	_calendar_begin_changes(FOCAL_CALENDAR(rc));
+
+	// Resources whose etag differs from the local one are fetched. The
+	// collection itself and anything else without an etag is not an event.
+	// Servers cannot be relied on for the status here, since it may belong
+	// to the propstat of a property only the collection has.
+	GHashTable* listed = g_hash_table_new(g_str_hash, g_str_equal);
+	GSList* hrefs = NULL;
+	for (GSList* s = ctx.result_list; s; s = s->next) {
+		SyncEntry* se = s->data;
+		if (!se->etag || g_str_has_suffix(se->href, "/"))
+			continue;
+		g_hash_table_add(listed, se->href);
+		Event* ee = store_lookup(rc, se->href);
+		if (!ee || g_strcmp0(se->etag, event_get_etag(ee)) != 0)
+			hrefs = g_slist_prepend(hrefs, strdup(se->href));
 	}
 
-	// Parse the response
-	XmlParseCtx ctx;
-	xmlctx_init(&ctx);
-	xmlSAXHandler my_handler = {.characters = xmlparse_characters,
-								.startElement = xmlparse_tag_open,
-								.endElement = xmlparse_report_sync_collection};
-	xmlSAXUserParseMemory(&my_handler, &ctx, sc->report_resp->str, sc->report_resp->len);
-	xmlctx_cleanup(&ctx);
-	g_string_free(sc->report_resp, TRUE);
+	// Any local event no longer listed has been deleted from the server
+	GSList* deleted = NULL;
+	for (GList* l = rc->events.head; l; l = l->next) {
+		if (!g_hash_table_contains(listed, event_get_url(l->data)))
+			deleted = g_slist_prepend(deleted, l->data);
+	}
+	int nDeleted = 0;
+	for (GSList* s = deleted; s; s = s->next) {
+		sync_delete_event(rc, s->data);
+		nDeleted++;
+	}
+	g_slist_free(deleted);
+	g_hash_table_destroy(listed);
+	sync_entries_free(ctx.result_list);
+	_calendar_end_changes(FOCAL_CALENDAR(rc));
+
+	sync_fetch_resources(rc, hrefs, ctx.sync_token, nDeleted, FALSE);
+}
+
+// Fallback for servers which do not support sync-collection, or have expired
+// the sync-token. A depth-1 PROPFIND lists the etag of every resource, so
+// that only those which have changed need to be fetched.
+static void do_etag_sync(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers)
+{
+	SyncContext* sc = g_new0(SyncContext, 1);
+	sc->cal = rc;
+
+	headers = curl_slist_append(headers, "Depth: 1");
+	headers = curl_slist_append(headers, "Content-Type: application/xml; charset=utf-8");
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PROPFIND");
+
+	sc->report_req = g_string_new("<d:propfind xmlns:d=\"DAV:\" xmlns:cs=\"http://calendarserver.org/ns/\">"
+								  "  <d:prop><d:getetag/><cs:getctag/><d:sync-token/></d:prop>"
+								  "</d:propfind>");
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, sc->report_req->str);
+
+	sync_context_begin_parse(sc, curl, &sync_collection_sax_handler);
+
+	async_curl_add_request(curl, calendar_get_location(FOCAL_CALENDAR(rc)), headers, ASYNC_CURL_PRIORITY_BACKGROUND, etag_sync_propfind_done, sc);
+}
+
+// Whether a sync-collection REPORT failed because the server does not support
+// it at all. A 403 only says so with a precondition: a server which rejects
+// even the initial, empty sync token cannot sync that way either.
+static gboolean sync_collection_unsupported(long response_code, const XmlParseCtx* ctx, const char* sync_token)
+{
+	if (response_code == 405 || response_code == 415 || response_code == 501)
+		return TRUE;
+	return response_code == 403 && (ctx->unsupported_report || (ctx->invalid_sync_token && *sync_token == '\0'));
+}
+
+static void sync_collection_report_done(CURL* curl, CURLcode ret, void* user)
+{
+	SyncContext* sc = (SyncContext*) user;
+	CaldavCalendar* rc = sc->cal;
+
+	g_string_free(sc->report_req, TRUE);
+
+	// Flush the parser. The (small) sync entries are collected in the context
+	sync_context_end_parse(sc);
+	XmlParseCtx ctx = sc->xml;
+	ctx.result_list = g_slist_reverse(ctx.result_list);
+	g_free(ctx.ctag);
+	free(sc);
+
+	long response_code = 0;
+	if (ret == CURLE_OK)
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+	// Handle the case where the http request failed
+	if (ret != CURLE_OK || response_code != 207) {
+		sync_entries_free(ctx.result_list);
+		free(ctx.sync_token);
+		if (response_code == 401) {
+			g_warning("401 Unauthorized. Assuming auth token has expired and attempting refresh");
+			sync_continue(rc, CALDAV_AUTH_SYNC, do_caldav_sync, NULL, TRUE);
+		} else if (response_code == 507 && !rc->sync_unlimited) {
+			// The server refuses to truncate the result at the requested limit
+			printf("sync: DAV:limit not supported\n");
+			rc->sync_unlimited = TRUE;
+			sync_continue(rc, CALDAV_AUTH_SYNC, do_sync_collection, NULL, FALSE);
+		} else if (sync_collection_unsupported(response_code, &ctx, rc->sync_token)) {
+			// Changes can still be found by comparing etags, from now on
+			printf("sync: sync-collection not supported (%ld), comparing etags\n", response_code);
+			rc->etag_sync = TRUE;
+			if (rc->cache)
+				calendar_cache_set_token(rc->cache, "etag-sync", "1");
+			sync_continue(rc, CALDAV_AUTH_SYNC, do_etag_sync, NULL, FALSE);
+		} else if (ctx.invalid_sync_token || response_code == 400 || response_code == 403) {
+			// Likely temporary, e.g. the server merely expired the token, so
+			// only this sync compares etags. The next one tries sync-collection
+			// again, with the token listed alongside the etags if there is one
+			if (ctx.invalid_sync_token)
+				printf("sync: sync-token rejected, comparing etags\n");
+			else
+				printf("sync: sync-collection failed (%ld), comparing etags\n", response_code);
+			sync_continue(rc, CALDAV_AUTH_SYNC, do_etag_sync, NULL, FALSE);
+		} else {
+			if (ret != CURLE_OK)
+				_calendar_error(FOCAL_CALENDAR(rc), "Error syncing calendar: %s", curl_easy_strerror(ret));
+			else
+				_calendar_error(FOCAL_CALENDAR(rc), "Error syncing calendar: unexpected response code %ld", response_code);
+			op_queue_sync_done(rc);
+			g_signal_emit_by_name(rc, "sync-done", FALSE, 0);
+		}
+		return;
+	}
 
-	// Store the new sync-token for subsequent sync operations
-	free(sc->cal->sync_token);
-	sc->cal->sync_token = ctx.sync_token; // (xfer ownership)
+	// Deletions are delivered together, changed resources once fetched
+	_calendar_begin_changes(FOCAL_CALENDAR(rc));
 
 	// Any resource that returned a 404 shall be deleted from the local collection.
-	// All others will be queried. Servers cannot be relied on to deliver status 200 here.
+	// All others will be queried, unless the etag shows that the local copy is
+	// current, e.g. one fetched by a time-range query during the initial sync.
+	// Servers cannot be relied on to deliver status 200 here.
 	int nDeleted = 0;
 	GSList* hrefs = NULL;
 	for (GSList* s = ctx.result_list; s; s = s->next) {
 		SyncEntry* se = s->data;
+		Event* ee = store_lookup(rc, se->href);
 		if (se->status == 404) {
-			for (GSList** p = &sc->cal->events; *p; p = &(*p)->next) {
-				Event* ee = (Event*) (*p)->data;
-				if (strcmp(se->href, event_get_url(ee)) == 0) {
-					g_signal_emit_by_name(rc, "event-updated", (*p)->data, NULL);
-					g_object_unref((*p)->data);
-					*p = (*p)->next;
-					nDeleted++;
-					break;
-				}
+			if (ee) {
+				sync_delete_event(rc, ee);
+				nDeleted++;
 			}
 			free(se->href);
+		} else if (ee && se->etag && g_strcmp0(se->etag, event_get_etag(ee)) == 0) {
+			free(se->href);
 		} else {
-			hrefs = g_slist_append(hrefs, se->href);
+			hrefs = g_slist_prepend(hrefs, se->href);
 		}
+		g_free(se->etag);
 	}
 	g_slist_free_full(ctx.result_list, free);
+	_calendar_end_changes(FOCAL_CALENDAR(rc));
 
-	free(sc);
-
-	// early return in the case where there are no new or updated events
-	if (hrefs == NULL) {
-		if (nDeleted) {
-			printf("sync: %d deleted\n", nDeleted);
-		} else {
-			printf("sync: no changes\n");
-		}
-		// sync-done here is necessary if items were deleted OR it's the initial sync.
-		// We know whether we deleted something but don't know if this is an initial sync.
-		g_signal_emit_by_name(rc, "sync-done", TRUE, 0);
-		rc->op_pending = FALSE;
-		return;
-	}
-
-	remote_auth_new_request(rc->auth, do_multiget_events, rc, hrefs);
+	sync_fetch_resources(rc, hrefs, ctx.sync_token, nDeleted, ctx.truncated);
 }
 
-static void do_caldav_sync(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers)
+static void do_sync_collection(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers)
 {
 	// Begin sync operation. According to RFC6578, the first step is to send
 	// a sync-collection REPORT to retrieve a list of hrefs that have been
 	// updated since the last call to the API (identified by the sync-token)
 	// See https://tools.ietf.org/html/rfc6578#appendix-B
-	curl_easy_setopt(curl, CURLOPT_URL, calendar_get_location(FOCAL_CALENDAR(rc)));
 
 	// Userdata for the sync operation
 	SyncContext* sc = g_new0(SyncContext, 1);
@@ -682,29 +1511,261 @@ static void do_caldav_sync(CaldavCalendar* rc, gchar* err, CURL* curl, struct cu
 	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 	curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "REPORT");
 
+	// Large results are requested in pages, so that neither the server nor
+	// the client has to hold every change at once
 	sc->report_req = g_string_new("");
 	g_string_append_printf(sc->report_req,
 						   "<d:sync-collection xmlns:d=\"DAV:\" xmlns:c=\"urn:ietf:params:xml:ns:caldav\">"
 						   "  <d:sync-token>%s</d:sync-token>"
-						   "  <d:sync-level>infinite</d:sync-level>"
-						   "  <d:prop><d:getetag/></d:prop>" // dav:prop always required by sabredav, getetag required by google
-						   "</d:sync-collection>",
+						   "  <d:sync-level>infinite</d:sync-level>",
 						   rc->sync_token);
+	if (!rc->sync_unlimited)
+		g_string_append_printf(sc->report_req, "  <d:limit><d:nresults>%d</d:nresults></d:limit>", SYNC_PAGE_SIZE);
+	g_string_append(sc->report_req,
+					"  <d:prop><d:getetag/></d:prop>" // dav:prop always required by sabredav, getetag required by google
+					"</d:sync-collection>");
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, sc->report_req->str);
+
+	sync_context_begin_parse(sc, curl, &sync_collection_sax_handler);
+
+	async_curl_add_request(curl, calendar_get_location(FOCAL_CALENDAR(rc)), headers, ASYNC_CURL_PRIORITY_BACKGROUND, sync_collection_report_done, sc);
+}
+
+// Fetches the events overlapping a date range with a calendar-query REPORT.
+// Used until the initial sync has completed, so that the range on display
+// does not have to wait for the whole collection. The response is merged
+// exactly like a calendar-multiget one.
+static void range_query_send(MultigetContext* mg, CURL* curl, struct curl_slist* headers, AsyncCurlPriority priority)
+{
+	CaldavCalendar* rc = mg->cal;
+	SyncContext* sc = g_new0(SyncContext, 1);
+	sc->cal = rc;
+	sc->mg = mg;
+	mg->range_query = TRUE;
+
+	headers = curl_slist_append(headers, "Depth: 1");
+	headers = curl_slist_append(headers, "Prefer: return-minimal");
+	headers = curl_slist_append(headers, "Content-Type: application/xml; charset=utf-8");
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "REPORT");
+
+	GDateTime* start = g_date_time_new_from_unix_utc(mg->range.start);
+	GDateTime* end = g_date_time_new_from_unix_utc(mg->range.end);
+	char* start_str = g_date_time_format(start, "%Y%m%dT%H%M%SZ");
+	char* end_str = g_date_time_format(end, "%Y%m%dT%H%M%SZ");
+	sc->report_req = g_string_new("");
+	g_string_append_printf(sc->report_req,
+						   "<?xml version=\"1.0\" encoding=\"utf-8\" ?>"
+						   "<C:calendar-query xmlns:D=\"DAV:\" xmlns:C=\"urn:ietf:params:xml:ns:caldav\">"
+						   "  <D:prop>"
+						   "    <D:getetag/>"
+						   "    <C:calendar-data/>"
+						   "  </D:prop>"
+						   "  <C:filter>"
+						   "    <C:comp-filter name=\"VCALENDAR\">"
+						   "      <C:comp-filter name=\"VEVENT\">"
+						   "        <C:time-range start=\"%s\" end=\"%s\"/>"
+						   "      </C:comp-filter>"
+						   "    </C:comp-filter>"
+						   "  </C:filter>"
+						   "</C:calendar-query>",
+						   start_str, end_str);
+	g_free(start_str);
+	g_free(end_str);
+	g_date_time_unref(start);
+	g_date_time_unref(end);
 	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, sc->report_req->str);
 
-	sc->report_resp = g_string_new(NULL);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, sc->report_resp);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_to_gstring);
+	sync_context_begin_parse(sc, curl, &multiget_sax_handler);
+	sc->xml.on_response = sync_merge_multiget_entry;
+	sc->xml.user = sc;
+
+	// Changes are delivered together once the query completes
+	_calendar_begin_changes(FOCAL_CALENDAR(rc));
+	mg->in_flight++;
+	async_curl_add_request(curl, calendar_get_location(FOCAL_CALENDAR(rc)), headers, priority, sync_multiget_report_done, sc);
+}
+
+static void do_range_query(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers, MultigetContext* mg)
+{
+	range_query_send(mg, curl, headers, ASYNC_CURL_PRIORITY_VISIBLE);
+}
+
+static gboolean range_is_loaded(CaldavCalendar* rc, icaltime_span range)
+{
+	for (guint i = 0; i < rc->loaded_ranges->len; ++i) {
+		icaltime_span r = g_array_index(rc->loaded_ranges, icaltime_span, i);
+		if (r.start <= range.start && r.end >= range.end)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void caldav_sync_date_range(Calendar* c, icaltime_span range)
+{
+	CaldavCalendar* rc = FOCAL_CALDAV_CALENDAR(c);
+	// Once the initial sync has completed every range is already available
+	if (!rc->loaded_ranges || range_is_loaded(rc, range))
+		return;
 
-	async_curl_add_request(curl, headers, sync_collection_report_done, sc);
+	// Only the range most recently displayed is of interest, one which has not
+	// been requested yet is replaced
+	if (rc->range_next) {
+		loaded_ranges_remove(rc, rc->range_next->range);
+		g_free(rc->range_next);
+	}
+	MultigetContext* mg = g_new0(MultigetContext, 1);
+	mg->cal = rc;
+	mg->range = range;
+	loaded_ranges_add(rc, range);
+	rc->range_next = mg;
+	op_queue_schedule(rc);
+}
+
+static void sync_precheck_done(CURL* curl, CURLcode ret, void* user)
+{
+	SyncContext* sc = (SyncContext*) user;
+	CaldavCalendar* rc = sc->cal;
+
+	g_string_free(sc->report_req, TRUE);
+	sync_context_end_parse(sc);
+	char* ctag = sc->xml.ctag;
+	char* sync_token = sc->xml.sync_token;
+	free(sc);
+
+	long response_code = 0;
+	if (ret == CURLE_OK)
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+	if (ret != CURLE_OK) {
+		_calendar_error(FOCAL_CALENDAR(rc), "Error syncing calendar: %s", curl_easy_strerror(ret));
+		op_queue_sync_done(rc);
+		g_signal_emit_by_name(rc, "sync-done", FALSE, 0);
+	} else if (response_code == 401) {
+		g_warning("401 Unauthorized. Assuming auth token has expired and attempting refresh");
+		sync_continue(rc, CALDAV_AUTH_SYNC, do_caldav_sync, NULL, TRUE);
+	} else if (response_code == 207 && ((sync_token && *sync_token && strcmp(sync_token, rc->sync_token) == 0) || (ctag && rc->ctag && strcmp(ctag, rc->ctag) == 0))) {
+		printf("sync: no changes\n");
+		op_queue_sync_done(rc);
+		g_signal_emit_by_name(rc, "sync-done", TRUE, 0);
+	} else {
+		// Changed, or the server supports neither property
+		g_free(rc->pending_ctag);
+		rc->pending_ctag = response_code == 207 ? g_strdup(ctag) : NULL;
+		sync_continue(rc, CALDAV_AUTH_SYNC, rc->etag_sync ? do_etag_sync : do_sync_collection, NULL, FALSE);
+	}
+	g_free(ctag);
+	free(sync_token);
+}
+
+static void do_caldav_sync(CaldavCalendar* rc, gchar* err, CURL* curl, struct curl_slist* headers)
+{
+	// Without a sync-token the REPORT is a full sync, which is needed anyway
+	if (*rc->sync_token == '\0' && !rc->etag_sync) {
+		g_free(rc->pending_ctag);
+		rc->pending_ctag = NULL;
+
+		// The full sync of a large calendar can take a long time. The events
+		// around today are fetched first, so that the calendar can be shown
+		// while the rest of it is loaded in the background
+		const CalendarConfig* cfg = calendar_get_config(FOCAL_CALENDAR(rc));
+		int days = cfg->initial_sync_window ? cfg->initial_sync_window : INITIAL_SYNC_WINDOW_DAYS;
+		if (!rc->loaded_ranges && days > 0) {
+			MultigetContext* mg = g_new0(MultigetContext, 1);
+			mg->cal = rc;
+			mg->initial = TRUE;
+			time_t now = time(NULL);
+			mg->range.start = now - days * 24 * 3600;
+			mg->range.end = now + days * 24 * 3600;
+			loaded_ranges_add(rc, mg->range);
+			range_query_send(mg, curl, headers, ASYNC_CURL_PRIORITY_VISIBLE);
+			return;
+		}
+
+		do_sync_collection(rc, err, curl, headers);
+		return;
+	}
+
+	// Likewise, without a getctag to compare the etag listing is needed anyway
+	if (*rc->sync_token == '\0' && !rc->ctag) {
+		do_etag_sync(rc, err, curl, headers);
+		return;
+	}
+
+	// Most periodic syncs find nothing new. A depth-0 PROPFIND for the
+	// collection's getctag and sync-token tells whether anything has changed
+	// at a fraction of the cost of a sync-collection REPORT
+	SyncContext* sc = g_new0(SyncContext, 1);
+	sc->cal = rc;
+
+	headers = curl_slist_append(headers, "Depth: 0");
+	headers = curl_slist_append(headers, "Content-Type: application/xml; charset=utf-8");
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PROPFIND");
+
+	sc->report_req = g_string_new("<d:propfind xmlns:d=\"DAV:\" xmlns:cs=\"http://calendarserver.org/ns/\">"
+								  "  <d:prop><cs:getctag/><d:sync-token/></d:prop>"
+								  "</d:propfind>");
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, sc->report_req->str);
+
+	sync_context_begin_parse(sc, curl, &ctag_sax_handler);
+
+	async_curl_add_request(curl, calendar_get_location(FOCAL_CALENDAR(rc)), headers, ASYNC_CURL_PRIORITY_BACKGROUND, sync_precheck_done, sc);
 }
 
 static void caldav_sync(Calendar* c)
 {
 	CaldavCalendar* rc = FOCAL_CALDAV_CALENDAR(c);
-	ENSURE_EXCLUSIVE(rc);
+	// merged with any sync already waiting, run once pending writes are done
+	rc->sync_requested = TRUE;
+	op_queue_schedule(rc);
+}
 
-	remote_auth_new_request(rc->auth, do_caldav_sync, rc, NULL);
+static void load_cached_event(void* user, const char* href, const char* etag, const char* data)
+{
+	CaldavCalendar* rc = (CaldavCalendar*) user;
+	icalcomponent* comp = icalparser_parse_string(data);
+	if (!comp)
+		return;
+	icalcomponent* vev = icalcomponent_isa(comp) == ICAL_VEVENT_COMPONENT ? comp : icalcomponent_get_first_component(comp, ICAL_VEVENT_COMPONENT);
+	if (!vev) {
+		icalcomponent_free(comp);
+		return;
+	}
+	Event* ev = event_new_from_icalcomponent(vev);
+	event_set_calendar(ev, FOCAL_CALENDAR(rc));
+	event_set_url(ev, href);
+	event_update_etag(ev, g_strdup(etag));
+	store_insert(rc, ev);
+	_calendar_event_changed(FOCAL_CALENDAR(rc), NULL, ev);
+}
+
+static gboolean caldav_load_cache(Calendar* c, CalendarCache* cache)
+{
+	CaldavCalendar* rc = FOCAL_CALDAV_CALENDAR(c);
+	g_assert_true(g_queue_is_empty(&rc->events));
+	rc->cache = cache;
+
+	// Without a stored token the first sync will be a full one anyway, so
+	// there is no value in presenting possibly outdated events
+	char* token = calendar_cache_get_token(cache, "sync-token");
+	if (!token) {
+		calendar_cache_clear(cache);
+		return FALSE;
+	}
+	free(rc->sync_token);
+	rc->sync_token = token;
+	g_free(rc->ctag);
+	rc->ctag = calendar_cache_get_token(cache, "ctag");
+	char* etag_sync = calendar_cache_get_token(cache, "etag-sync");
+	rc->etag_sync = etag_sync != NULL;
+	g_free(etag_sync);
+
+	_calendar_begin_changes(c);
+	calendar_cache_each(cache, load_cached_event, rc);
+	_calendar_end_changes(c);
+	printf("cache: loaded %u events\n", g_queue_get_length(&rc->events));
+	return !g_queue_is_empty(&rc->events);
 }
 
 static gboolean caldav_is_read_only(Calendar* c)
@@ -713,9 +1774,34 @@ static gboolean caldav_is_read_only(Calendar* c)
 	return FALSE;
 }
 
-static void caldav_auth_cancelled(CaldavCalendar* rc)
+// Abandons an operation whose credentials could not be obtained, e.g.
+// because the user declined to enter a password
+static void credentials_failed(CaldavCalendar* rc, CaldavAuthKind kind, void* arg, const char* err)
 {
-	rc->op_pending = FALSE;
+	switch (kind) {
+	case CALDAV_AUTH_WRITE:
+		_calendar_error(FOCAL_CALENDAR(rc), "Error modifying calendar: %s", err);
+		op_queue_finish_write(rc, (CaldavOp*) arg);
+		return;
+	case CALDAV_AUTH_RANGE_QUERY: {
+		MultigetContext* mg = (MultigetContext*) arg;
+		loaded_ranges_remove(rc, mg->range);
+		g_free(mg);
+		return;
+	}
+	case CALDAV_AUTH_SYNC_MULTIGET:
+		// holds the resources still to be fetched, but has not opened a
+		// change set yet
+		multiget_context_free((MultigetContext*) arg);
+		break;
+	case CALDAV_AUTH_SYNC:
+		break;
+	}
+
+	// a step of the running sync
+	_calendar_error(FOCAL_CALENDAR(rc), "Error syncing calendar: %s", err);
+	op_queue_sync_done(rc);
+	g_signal_emit_by_name(rc, "sync-done", FALSE, 0);
 }
 
 static void constructed(GObject* gobject)
@@ -725,9 +1811,7 @@ static void constructed(GObject* gobject)
 	g_assert_true(strrchr(calendar_get_location(FOCAL_CALENDAR(rc)), '/')[1] == 0);
 	// auth member must have been supplied by attach_authenticator
 	g_assert_nonnull(rc->auth);
-	rc->events = NULL;
 	rc->sync_token = g_strdup("");
-	g_signal_connect_swapped(rc->auth, "cancelled", G_CALLBACK(caldav_auth_cancelled), rc);
 }
 
 static void finalize(GObject* gobject)
@@ -735,12 +1819,32 @@ static void finalize(GObject* gobject)
 	CaldavCalendar* rc = FOCAL_CALDAV_CALENDAR(gobject);
 	g_object_unref(rc->auth);
 	free(rc->sync_token);
+	g_free(rc->ctag);
+	g_free(rc->pending_ctag);
+	if (rc->loaded_ranges)
+		g_array_free(rc->loaded_ranges, TRUE);
 	free_events(rc);
+	g_hash_table_destroy(rc->events_by_href);
+	g_hash_table_destroy(rc->events_by_uid);
+	if (rc->op_queue_source)
+		g_source_remove(rc->op_queue_source);
+	while (!g_queue_is_empty(&rc->ops)) {
+		CaldavOp* op = g_queue_pop_head(&rc->ops);
+		g_object_unref(op->event);
+		g_free(op);
+	}
+	g_hash_table_destroy(rc->ops_busy);
+	g_free(rc->range_next);
 	G_OBJECT_CLASS(caldav_calendar_parent_class)->finalize(gobject);
 }
 
 void caldav_calendar_init(CaldavCalendar* rc)
 {
+	g_queue_init(&rc->events);
+	rc->events_by_href = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	rc->events_by_uid = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	g_queue_init(&rc->ops);
+	rc->ops_busy = g_hash_table_new(NULL, NULL);
 }
 
 static void attach_authenticator(Calendar* c, RemoteAuth* auth)
@@ -755,9 +1859,18 @@ void caldav_calendar_class_init(CaldavCalendarClass* klass)
 	FOCAL_CALENDAR_CLASS(klass)->each_event = each_event;
 	FOCAL_CALENDAR_CLASS(klass)->sync = caldav_sync;
 	FOCAL_CALENDAR_CLASS(klass)->read_only = caldav_is_read_only;
-	FOCAL_CALENDAR_CLASS(klass)->sync_date_range = NULL;
+	FOCAL_CALENDAR_CLASS(klass)->sync_date_range = caldav_sync_date_range;
+	FOCAL_CALENDAR_CLASS(klass)->load_cache = caldav_load_cache;
 
 	FOCAL_CALENDAR_CLASS(klass)->attach_authenticator = attach_authenticator;
 	G_OBJECT_CLASS(klass)->constructed = constructed;
 	G_OBJECT_CLASS(klass)->finalize = finalize;
 }
+
+void caldav_calendar_cleanup(void)
+{
+	if (parse_pool) {
+		g_thread_pool_free(parse_pool, TRUE, TRUE);
+		parse_pool = NULL;
+	}
+}
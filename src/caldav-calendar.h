@@ -21,4 +21,8 @@ G_DECLARE_FINAL_TYPE(CaldavCalendar, caldav_calendar, FOCAL, CALDAV_CALENDAR, Ca
 
 Calendar* caldav_calendar_new(CalendarConfig* cfg);
 
+// Call once before application exit. Stops the threads shared by all
+// CalDAV calendars for parsing sync results.
+void caldav_calendar_cleanup(void);
+
 #endif // CALDAV_CALENDAR_H
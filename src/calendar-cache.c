@@ -0,0 +1,206 @@
+/*
+ * calendar-cache.c
+ * This file is part of focal, a calendar application for Linux
+ * Copyright 2020 Oliver Giles and focal contributors.
+ *
+ * Focal is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Focal is distributed without any explicit or implied warranty.
+ * You should have received a copy of the GNU General Public License
+ * version 3 with focal. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "calendar-cache.h"
+#include "calendar-config.h"
+
+#include <errno.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+// Bump when the layout of the cache file changes, older files are discarded
+#define CACHE_VERSION 2
+
+// Group holding the version and named tokens. All other groups are resources
+// keyed by their URI-escaped href. Neither CalDAV hrefs (absolute paths) nor
+// Graph event ids (base64) can collide with this name.
+#define META_GROUP "focal-cache"
+
+// Modifications are written out at most this often, in seconds. A sync makes
+// many in quick succession.
+#define CACHE_FLUSH_DELAY 2
+
+// Characters left as they are in group names. GKeyFile does not allow '['
+// or ']' in a group name, and '%' has to be escaped to be decoded again.
+#define HREF_ALLOWED_CHARS "!$&'()*+,;=:@/"
+
+struct _CalendarCache {
+	char* path;
+	GKeyFile* keyfile;
+	gboolean dirty;
+	guint flush_source;
+	// set once the cache has been deleted, see calendar_cache_delete
+	gboolean deleted;
+};
+
+// Every cache currently open, so that a deleted one is not written again
+static GSList* open_caches;
+
+static char* cache_path_for_config(const CalendarConfig* cfg)
+{
+	// Include everything that identifies the remote collection, so that an
+	// account edited in place does not pick up a stale cache. The label is
+	// only for display, renaming an account keeps its cache.
+	char* id = g_strdup_printf("%d|%s|%s", cfg->type, cfg->location ? cfg->location : "", cfg->login ? cfg->login : "");
+	char* digest = g_compute_checksum_for_string(G_CHECKSUM_SHA1, id, -1);
+	char* path = g_strdup_printf("%s/focal/%s.cache", g_get_user_cache_dir(), digest);
+	g_free(digest);
+	g_free(id);
+	return path;
+}
+
+CalendarCache* calendar_cache_open(const CalendarConfig* cfg)
+{
+	CalendarCache* cache = g_new0(CalendarCache, 1);
+	cache->path = cache_path_for_config(cfg);
+	cache->keyfile = g_key_file_new();
+
+	GError* err = NULL;
+	if (!g_key_file_load_from_file(cache->keyfile, cache->path, G_KEY_FILE_NONE, &err)) {
+		if (!g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			g_warning("Discarding unreadable cache %s: %s", cache->path, err->message);
+		g_error_free(err);
+		calendar_cache_clear(cache);
+	} else if (g_key_file_get_integer(cache->keyfile, META_GROUP, "version", NULL) != CACHE_VERSION) {
+		calendar_cache_clear(cache);
+	}
+
+	open_caches = g_slist_prepend(open_caches, cache);
+	return cache;
+}
+
+static void cache_write(CalendarCache* cache)
+{
+	if (!cache->dirty || cache->deleted)
+		return;
+
+	char* dir = g_path_get_dirname(cache->path);
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	// Written to a temporary file which is then renamed, so a crash while
+	// saving cannot leave a truncated cache behind. The cache holds the
+	// user's events, so it is only readable by the user.
+	gsize length;
+	gchar* data = g_key_file_to_data(cache->keyfile, &length, NULL);
+	GError* err = NULL;
+	if (!g_file_set_contents_full(cache->path, data, length, G_FILE_SET_CONTENTS_CONSISTENT, 0600, &err)) {
+		g_warning("Failed to write cache %s: %s", cache->path, err->message);
+		g_error_free(err);
+	} else {
+		cache->dirty = FALSE;
+	}
+	g_free(data);
+}
+
+static gboolean on_flush_due(gpointer user)
+{
+	CalendarCache* cache = (CalendarCache*) user;
+	cache->flush_source = 0;
+	cache_write(cache);
+	return G_SOURCE_REMOVE;
+}
+
+void calendar_cache_free(CalendarCache* cache)
+{
+	if (cache->flush_source)
+		g_source_remove(cache->flush_source);
+	cache_write(cache);
+	open_caches = g_slist_remove(open_caches, cache);
+	g_key_file_free(cache->keyfile);
+	g_free(cache->path);
+	g_free(cache);
+}
+
+gchar* calendar_cache_get_token(CalendarCache* cache, const char* name)
+{
+	return g_key_file_get_string(cache->keyfile, META_GROUP, name, NULL);
+}
+
+void calendar_cache_set_token(CalendarCache* cache, const char* name, const char* value)
+{
+	if (value)
+		g_key_file_set_string(cache->keyfile, META_GROUP, name, value);
+	else
+		g_key_file_remove_key(cache->keyfile, META_GROUP, name, NULL);
+	cache->dirty = TRUE;
+}
+
+void calendar_cache_each(CalendarCache* cache, CalendarCacheEachCallback callback, void* user)
+{
+	gchar** groups = g_key_file_get_groups(cache->keyfile, NULL);
+	for (gchar** g = groups; *g; ++g) {
+		if (strcmp(*g, META_GROUP) == 0)
+			continue;
+		gchar* href = g_uri_unescape_string(*g, NULL);
+		gchar* etag = g_key_file_get_string(cache->keyfile, *g, "etag", NULL);
+		gchar* data = g_key_file_get_string(cache->keyfile, *g, "data", NULL);
+		if (href && data)
+			callback(user, href, etag, data);
+		g_free(href);
+		g_free(etag);
+		g_free(data);
+	}
+	g_strfreev(groups);
+}
+
+void calendar_cache_put(CalendarCache* cache, const char* href, const char* etag, const char* data)
+{
+	g_assert_nonnull(href);
+	g_assert_nonnull(data);
+	gchar* group = g_uri_escape_string(href, HREF_ALLOWED_CHARS, FALSE);
+	if (etag)
+		g_key_file_set_string(cache->keyfile, group, "etag", etag);
+	else
+		g_key_file_remove_key(cache->keyfile, group, "etag", NULL);
+	g_key_file_set_string(cache->keyfile, group, "data", data);
+	g_free(group);
+	cache->dirty = TRUE;
+}
+
+void calendar_cache_remove(CalendarCache* cache, const char* href)
+{
+	gchar* group = g_uri_escape_string(href, HREF_ALLOWED_CHARS, FALSE);
+	if (g_key_file_remove_group(cache->keyfile, group, NULL))
+		cache->dirty = TRUE;
+	g_free(group);
+}
+
+void calendar_cache_clear(CalendarCache* cache)
+{
+	g_key_file_free(cache->keyfile);
+	cache->keyfile = g_key_file_new();
+	g_key_file_set_integer(cache->keyfile, META_GROUP, "version", CACHE_VERSION);
+	cache->dirty = TRUE;
+}
+
+void calendar_cache_flush(CalendarCache* cache)
+{
+	if (!cache->dirty || cache->flush_source)
+		return;
+	cache->flush_source = g_timeout_add_seconds(CACHE_FLUSH_DELAY, on_flush_due, cache);
+}
+
+void calendar_cache_delete(const CalendarConfig* cfg)
+{
+	char* path = cache_path_for_config(cfg);
+	// A calendar of the removed account may still be around for a while
+	for (GSList* p = open_caches; p; p = p->next) {
+		CalendarCache* cache = (CalendarCache*) p->data;
+		if (strcmp(cache->path, path) == 0)
+			cache->deleted = TRUE;
+	}
+	if (g_unlink(path) != 0 && errno != ENOENT)
+		g_warning("Failed to delete cache %s: %s", path, g_strerror(errno));
+	g_free(path);
+}
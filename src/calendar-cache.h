@@ -0,0 +1,57 @@
+/*
+ * calendar-cache.h
+ * This file is part of focal, a calendar application for Linux
+ * Copyright 2020 Oliver Giles and focal contributors.
+ *
+ * Focal is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Focal is distributed without any explicit or implied warranty.
+ * You should have received a copy of the GNU General Public License
+ * version 3 with focal. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CALENDAR_CACHE_H
+#define CALENDAR_CACHE_H
+
+#include <glib.h>
+
+typedef struct _CalendarConfig CalendarConfig;
+
+// CalendarCache is a persistent per-calendar store under the XDG cache
+// directory. It holds the raw iCalendar data and ETag of each resource
+// (keyed by href) as well as arbitrary named tokens such as a CalDAV
+// sync-token, so that a calendar can be displayed and incrementally
+// synchronised immediately after startup.
+typedef struct _CalendarCache CalendarCache;
+
+// Opens the cache file belonging to the given calendar configuration. The
+// file is created once calendar_cache_flush has been called.
+CalendarCache* calendar_cache_open(const CalendarConfig* cfg);
+
+// Writes any pending modifications to disk and frees the cache
+void calendar_cache_free(CalendarCache* cache);
+
+// Returns a newly allocated copy of the named token, or NULL if not present
+gchar* calendar_cache_get_token(CalendarCache* cache, const char* name);
+void calendar_cache_set_token(CalendarCache* cache, const char* name, const char* value);
+
+typedef void (*CalendarCacheEachCallback)(void* user, const char* href, const char* etag, const char* data);
+void calendar_cache_each(CalendarCache* cache, CalendarCacheEachCallback callback, void* user);
+
+// Stores or replaces the resource at href. Passed strings are copied.
+void calendar_cache_put(CalendarCache* cache, const char* href, const char* etag, const char* data);
+void calendar_cache_remove(CalendarCache* cache, const char* href);
+
+// Removes all resources and tokens, e.g. when the server invalidates the sync state
+void calendar_cache_clear(CalendarCache* cache);
+
+// Writes the cache to disk shortly if it has been modified since the last
+// write. Modifications made in the meantime are written together.
+void calendar_cache_flush(CalendarCache* cache);
+
+// Deletes the cache file of a calendar whose account has been removed. A
+// cache of that calendar which is still open is no longer written.
+void calendar_cache_delete(const CalendarConfig* cfg);
+
+#endif // CALENDAR_CACHE_H
@@ -16,17 +16,36 @@
 
 #include "calendar.h"
 
+// Each calendar is synced on its own schedule. The interval starts at the
+// configured one and doubles, up to SYNC_MAX_BACKOFF times, for each sync
+// which finds nothing new. Any change resets it. Hidden calendars are synced
+// SYNC_HIDDEN_FACTOR times less often. Due times are jittered by up to
+// SYNC_JITTER of the interval so that accounts do not all sync at once. A
+// failed sync is retried after at most SYNC_RETRY_DELAY seconds, and leaves
+// the interval as it was
+#define SYNC_MAX_BACKOFF 8
+#define SYNC_HIDDEN_FACTOR 4
+#define SYNC_JITTER 0.1
+#define SYNC_RETRY_DELAY 60
+
 typedef struct {
 	Calendar* calendar;
 	GHashTable* attributes;
 	GHashTable* links;
 	gboolean initial_sync_done;
 	gboolean enabled;
+	// scheduling state, times are monotonic
+	gboolean syncing;
+	gboolean changed; // since the last sync completed
+	int interval;	  // seconds
+	gint64 next_due;
 } CalendarItem;
 
 struct _CalendarCollection {
 	GObject parent;
 	GSList* items;
+	int sync_interval; // base interval in seconds, 0 if automatic sync is disabled
+	guint sync_source;
 };
 
 enum {
@@ -34,6 +53,7 @@ enum {
 	SIGNAL_CALENDAR_ADDED,
 	SIGNAL_CALENDAR_REMOVED,
 	SIGNAL_SYNC_DONE,
+	SIGNAL_EVENTS_CHANGED,
 	LAST_SIGNAL,
 };
 
@@ -158,6 +178,8 @@ static void remove_all_calendars(CalendarCollection* cc)
 static void finalize(GObject* obj)
 {
 	CalendarCollection* cc = FOCAL_CALENDAR_COLLECTION(obj);
+	if (cc->sync_source)
+		g_source_remove(cc->sync_source);
 	remove_all_calendars(cc);
 	G_OBJECT_CLASS(calendar_collection_parent_class)->finalize(obj);
 }
@@ -198,6 +220,7 @@ static void calendar_collection_class_init(CalendarCollectionClass* ccc)
 	calendar_collection_signals[SIGNAL_CALENDAR_ADDED] = g_signal_new("calendar-added", G_TYPE_FROM_CLASS(object_class), G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION, 0, NULL, NULL, NULL, G_TYPE_NONE, 1, G_TYPE_POINTER);
 	calendar_collection_signals[SIGNAL_CALENDAR_REMOVED] = g_signal_new("calendar-removed", G_TYPE_FROM_CLASS(object_class), G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION, 0, NULL, NULL, NULL, G_TYPE_NONE, 1, G_TYPE_POINTER);
 	calendar_collection_signals[SIGNAL_SYNC_DONE] = g_signal_new("sync-done", G_TYPE_FROM_CLASS(object_class), G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION, 0, NULL, NULL, NULL, G_TYPE_NONE, 2, G_TYPE_BOOLEAN, G_TYPE_POINTER);
+	calendar_collection_signals[SIGNAL_EVENTS_CHANGED] = g_signal_new("events-changed", G_TYPE_FROM_CLASS(object_class), G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION, 0, NULL, NULL, NULL, G_TYPE_NONE, 2, G_TYPE_POINTER, G_TYPE_POINTER);
 }
 
 static void calendar_collection_init(CalendarCollection* cc)
@@ -232,29 +255,146 @@ static gint calendar_item_from_calendar(CalendarItem* item, Calendar* cal)
 	return item->calendar == cal ? 0 : 1;
 }
 
+static CalendarItem* find_item(CalendarCollection* cc, Calendar* cal)
+{
+	GSList* el = g_slist_find_custom(cc->items, cal, (GCompareFunc) calendar_item_from_calendar);
+	g_assert_nonnull(el);
+	return (CalendarItem*) el->data;
+}
+
+static gboolean on_sync_due(gpointer user);
+
+// Arms the timer for the earliest due calendar
+static void schedule_syncs(CalendarCollection* cc)
+{
+	if (cc->sync_source) {
+		g_source_remove(cc->sync_source);
+		cc->sync_source = 0;
+	}
+	if (!cc->sync_interval)
+		return;
+
+	gint64 next = G_MAXINT64;
+	for (GSList* p = cc->items; p; p = p->next) {
+		CalendarItem* item = (CalendarItem*) p->data;
+		if (!item->syncing)
+			next = MIN(next, item->next_due);
+	}
+	if (next == G_MAXINT64)
+		return;
+
+	gint64 delay = (next - g_get_monotonic_time() + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC;
+	cc->sync_source = g_timeout_add_seconds(MAX(delay, 1), on_sync_due, cc);
+	g_source_set_name_by_id(cc->sync_source, "[focal] sync_timer");
+}
+
+static void set_next_due(CalendarCollection* cc, CalendarItem* item)
+{
+	int interval = item->enabled ? item->interval : MIN(item->interval * SYNC_HIDDEN_FACTOR, cc->sync_interval * SYNC_MAX_BACKOFF);
+	double jitter = g_random_double_range(-SYNC_JITTER, SYNC_JITTER);
+	item->next_due = g_get_monotonic_time() + (gint64) (interval * (1.0 + jitter) * G_USEC_PER_SEC);
+}
+
+// Returns FALSE if the calendar is already being synced
+static gboolean start_sync(CalendarItem* item)
+{
+	if (item->syncing)
+		return FALSE;
+	item->syncing = TRUE;
+	calendar_sync(item->calendar);
+	return TRUE;
+}
+
+static gboolean on_sync_due(gpointer user)
+{
+	CalendarCollection* cc = FOCAL_CALENDAR_COLLECTION(user);
+	cc->sync_source = 0;
+
+	gint64 now = g_get_monotonic_time();
+	for (GSList* p = cc->items; p; p = p->next) {
+		CalendarItem* item = (CalendarItem*) p->data;
+		if (item->next_due <= now)
+			start_sync(item);
+	}
+	schedule_syncs(cc);
+	return G_SOURCE_REMOVE;
+}
+
+// Adapts the interval of a calendar to what its sync found, and schedules the next
+static void sync_finished(CalendarCollection* cc, CalendarItem* item, gboolean success)
+{
+	item->syncing = FALSE;
+	if (!success) {
+		// Nothing was learned about how often the calendar changes
+		int delay = item->interval ? MIN(item->interval, SYNC_RETRY_DELAY) : SYNC_RETRY_DELAY;
+		item->next_due = g_get_monotonic_time() + (gint64) delay * G_USEC_PER_SEC;
+		schedule_syncs(cc);
+		return;
+	}
+	if (!item->interval) {
+		// The first sync, which all calendars start together. Staggered from here on
+		item->interval = cc->sync_interval;
+		item->next_due = g_get_monotonic_time() + (gint64) (item->interval * g_random_double_range(0.5, 1.5) * G_USEC_PER_SEC);
+	} else {
+		if (item->changed)
+			item->interval = cc->sync_interval;
+		else
+			item->interval = MIN(item->interval * 2, cc->sync_interval * SYNC_MAX_BACKOFF);
+		set_next_due(cc, item);
+	}
+	item->changed = FALSE;
+	schedule_syncs(cc);
+}
+
 static void on_calendar_sync_done(CalendarCollection* cc, gboolean success, Calendar* cal)
 {
+	// Syncs not started here, e.g. of a newly displayed date range, say nothing
+	// about how often the calendar changes
+	CalendarItem* item = find_item(cc, cal);
+	if (item->syncing)
+		sync_finished(cc, item, success);
 	g_signal_emit(cc, calendar_collection_signals[SIGNAL_SYNC_DONE], 0, success, cal);
 }
 
-static void on_calendar_initial_sync_done(CalendarCollection* cc, gboolean success, Calendar* cal)
+static void on_calendar_events_changed(CalendarCollection* cc, const CalendarChanges* changes, Calendar* cal)
 {
-	g_signal_handlers_disconnect_by_func(cal, (gpointer) on_calendar_initial_sync_done, cc);
+	find_item(cc, cal)->changed = TRUE;
+	g_signal_emit(cc, calendar_collection_signals[SIGNAL_EVENTS_CHANGED], 0, changes, cal);
+}
 
-	GSList* el = g_slist_find_custom(cc->items, cal, (GCompareFunc) calendar_item_from_calendar);
-	g_assert_nonnull(el);
+static void on_calendar_initial_sync_done(CalendarCollection* cc, gboolean success, Calendar* cal);
+static void on_calendar_initial_window_synced(CalendarCollection* cc, Calendar* cal);
 
-	CalendarItem* item = (CalendarItem*) el->data;
+// Adds a calendar to the collection once the events it will first display are available
+static void initial_sync_complete(CalendarCollection* cc, CalendarItem* item)
+{
+	Calendar* cal = item->calendar;
+	g_signal_handlers_disconnect_by_func(cal, (gpointer) on_calendar_initial_sync_done, cc);
+	g_signal_handlers_disconnect_by_func(cal, (gpointer) on_calendar_initial_window_synced, cc);
 	item->initial_sync_done = TRUE;
 
 	// Whether the initial sync succeeded or not is ignored. This is imperfect because if it later
-	// succeeds, the WeekView might get a *large* number of event-updated signals.
+	// succeeds, the WeekView might get a *large* events-changed set.
 	// In conjunction with this, FocalApp needs to check if there are any errors when a calendar is
 	// added to the collection (and not just when it receives an error signal)
 	g_signal_connect_swapped(cal, "sync-done", (GCallback) on_calendar_sync_done, cc);
+	g_signal_connect_swapped(cal, "events-changed", (GCallback) on_calendar_events_changed, cc);
 	g_signal_emit(cc, calendar_collection_signals[SIGNAL_CALENDAR_ADDED], 0, cal);
 }
 
+static void on_calendar_initial_sync_done(CalendarCollection* cc, gboolean success, Calendar* cal)
+{
+	CalendarItem* item = find_item(cc, cal);
+	sync_finished(cc, item, success);
+	initial_sync_complete(cc, item);
+}
+
+// The sync carries on after the initial window, its sync-done is handled as usual
+static void on_calendar_initial_window_synced(CalendarCollection* cc, Calendar* cal)
+{
+	initial_sync_complete(cc, find_item(cc, cal));
+}
+
 void calendar_collection_populate_from_config(CalendarCollection* cc, GSList* configs)
 {
 	remove_all_calendars(cc);
@@ -275,18 +415,55 @@ void calendar_collection_populate_from_config(CalendarCollection* cc, GSList* co
 		g_free(action_name);
 
 		cc->items = g_slist_append(cc->items, item);
-		// Perform initial sync once, before signalling calendar-added. This means for example,
-		// the calendar won't be added to the week view before the initial sync, which would have
-		// caused it to be inundanted with event-updated signals.
-		g_signal_connect_swapped(cal, "sync-done", G_CALLBACK(on_calendar_initial_sync_done), cc);
-		calendar_sync(cal);
+		if (calendar_load_cache(cal)) {
+			// The events from the on-disk cache can be displayed straight away. The sync
+			// below will then only deliver the (usually few) changes since the last run.
+			item->initial_sync_done = TRUE;
+			g_signal_connect_swapped(cal, "sync-done", (GCallback) on_calendar_sync_done, cc);
+			g_signal_connect_swapped(cal, "events-changed", (GCallback) on_calendar_events_changed, cc);
+			g_signal_emit(cc, calendar_collection_signals[SIGNAL_CALENDAR_ADDED], 0, cal);
+		} else {
+			// Perform initial sync once, before signalling calendar-added. This means for example,
+			// the calendar won't be added to the week view before the initial sync, which would have
+			// caused it to be redrawn for every change made by the initial sync.
+			g_signal_connect_swapped(cal, "sync-done", G_CALLBACK(on_calendar_initial_sync_done), cc);
+			g_signal_connect_swapped(cal, "initial-window-synced", G_CALLBACK(on_calendar_initial_window_synced), cc);
+		}
+		start_sync(item);
+	}
+}
+
+guint calendar_collection_sync_all(CalendarCollection* cc)
+{
+	guint started = 0;
+	for (GSList* p = cc->items; p; p = p->next) {
+		if (start_sync((CalendarItem*) p->data))
+			started++;
+	}
+	return started;
+}
+
+gboolean calendar_collection_is_syncing(CalendarCollection* cc)
+{
+	for (GSList* p = cc->items; p; p = p->next) {
+		if (((CalendarItem*) p->data)->syncing)
+			return TRUE;
 	}
+	return FALSE;
 }
 
-void calendar_collection_sync_all(CalendarCollection* cc)
+void calendar_collection_set_sync_interval(CalendarCollection* cc, int interval)
 {
-	for (GSList* p = cc->items; p; p = p->next)
-		calendar_sync(FOCAL_CALENDAR(((CalendarItem*) p->data)->calendar));
+	cc->sync_interval = interval;
+	// Spread the calendars evenly over the first interval
+	guint n = g_slist_length(cc->items), i = 0;
+	for (GSList* p = cc->items; p; p = p->next, ++i) {
+		CalendarItem* item = (CalendarItem*) p->data;
+		item->interval = interval;
+		double jitter = g_random_double_range(-SYNC_JITTER, SYNC_JITTER);
+		item->next_due = g_get_monotonic_time() + (gint64) (interval * ((i + 1.0) / n + jitter) * G_USEC_PER_SEC);
+	}
+	schedule_syncs(cc);
 }
 
 static gint is_enabled(gconstpointer data, CalendarItem* item)
@@ -347,6 +524,14 @@ GtkTreeModel* calendar_collection_new_filtered_model(CalendarCollection* cc, gbo
 
 void calendar_collection_set_enabled(CalendarCollection* cc, Calendar* c, gboolean enabled)
 {
-	GSList* el = g_slist_find_custom(cc->items, c, (GCompareFunc) calendar_item_from_calendar);
-	((CalendarItem*) el->data)->enabled = enabled;
+	CalendarItem* item = find_item(cc, c);
+	gboolean was_enabled = item->enabled;
+	item->enabled = enabled;
+	// A calendar becoming visible is synced on its shorter schedule from now
+	if (enabled && !was_enabled && !item->syncing && item->interval) {
+		gint64 due = item->next_due;
+		set_next_due(cc, item);
+		item->next_due = MIN(item->next_due, due);
+		schedule_syncs(cc);
+	}
 }
@@ -33,7 +33,16 @@ Calendar* calendar_collection_get_by_name(CalendarCollection* cc, const gchar* n
 
 void calendar_collection_set_enabled(CalendarCollection* cc, Calendar* c, gboolean enabled);
 
-void calendar_collection_sync_all(CalendarCollection* cc);
+// Syncs every calendar not already being synced. Returns the number started
+guint calendar_collection_sync_all(CalendarCollection* cc);
+
+// Returns TRUE while any calendar is being synced
+gboolean calendar_collection_is_syncing(CalendarCollection* cc);
+
+// Syncs each calendar automatically, independently of the others, staggered
+// over the given interval in seconds. The interval is adapted per calendar:
+// see calendar-collection.c. 0 disables automatic sync.
+void calendar_collection_set_sync_interval(CalendarCollection* cc, int interval);
 
 GtkTreeModel* calendar_collection_new_filtered_model(CalendarCollection* cc, gboolean only_enabled, gboolean only_writable);
 
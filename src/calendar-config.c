@@ -70,6 +70,9 @@ GSList* calendar_config_load_from_file(const char* config_file)
 
 		cfg->label = g_strdup(groups[i]);
 		cfg->email = g_key_file_get_string(keyfile, groups[i], "email", NULL);
+		cfg->multiget_batch_size = g_key_file_get_integer(keyfile, groups[i], "multiget_batch_size", NULL);
+		cfg->multiget_max_requests = g_key_file_get_integer(keyfile, groups[i], "multiget_max_requests", NULL);
+		cfg->initial_sync_window = g_key_file_get_integer(keyfile, groups[i], "initial_sync_window", NULL);
 		calendar_configs = g_slist_append(calendar_configs, cfg);
 	}
 	g_strfreev(groups);
@@ -104,6 +107,12 @@ void calendar_config_write_to_file(const char* config_file, GSList* confs)
 		}
 		if (cfg->email)
 			g_key_file_set_string(keyfile, cfg->label, "email", cfg->email);
+		if (cfg->multiget_batch_size)
+			g_key_file_set_integer(keyfile, cfg->label, "multiget_batch_size", cfg->multiget_batch_size);
+		if (cfg->multiget_max_requests)
+			g_key_file_set_integer(keyfile, cfg->label, "multiget_max_requests", cfg->multiget_max_requests);
+		if (cfg->initial_sync_window)
+			g_key_file_set_integer(keyfile, cfg->label, "initial_sync_window", cfg->initial_sync_window);
 	}
 
 	if (!g_key_file_save_to_file(keyfile, config_file, &error)) {
@@ -32,6 +32,12 @@ typedef struct _CalendarConfig {
 	gchar* email;
 	gchar* login;
 	CalendarAccountType type;
+	// optional tuning of CalDAV synchronisation, zero selects the default
+	int multiget_batch_size;
+	int multiget_max_requests;
+	// days either side of today fetched first by the initial sync, before the
+	// rest of the calendar. Zero selects the default, negative disables
+	int initial_sync_window;
 } CalendarConfig;
 
 void calendar_config_free(CalendarConfig* cfg);
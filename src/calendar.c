@@ -12,7 +12,9 @@
  * version 3 with focal. If not, see <http://www.gnu.org/licenses/>.
  */
 #include "calendar.h"
+#include "calendar-cache.h"
 #include "calendar-config.h"
+#include "interval-tree.h"
 #include "remote-auth-basic.h"
 #include "remote-auth-oauth2.h"
 
@@ -21,13 +23,27 @@ typedef struct {
 	RemoteAuth* auth;
 	GdkRGBA color;
 	char* error_message;
+	CalendarCache* cache;
+	// changes collected since the outermost _calendar_begin_changes
+	int changes_depth;
+	CalendarChanges pending;
+	// every event of the calendar, by the span returned by event_get_span
+	IntervalTree* index;
+	// latest range passed to calendar_sync_date_range, not yet synced
+	icaltime_span pending_range;
+	guint range_sync_source;
 } CalendarPrivate;
 
+// Range syncs are deferred until no other has been requested for this long,
+// so that paging quickly through weeks only fetches the week paged to
+#define RANGE_SYNC_DELAY_MS 250
+
 G_DEFINE_TYPE_WITH_PRIVATE(Calendar, calendar, G_TYPE_OBJECT)
 
 enum {
 	SIGNAL_SYNC_DONE,
-	SIGNAL_EVENT_UPDATED,
+	SIGNAL_INITIAL_WINDOW_SYNCED,
+	SIGNAL_EVENTS_CHANGED,
 	SIGNAL_REQUEST_PASSWORD,
 	SIGNAL_CONFIG_MODIFIED,
 	SIGNAL_ERROR,
@@ -60,24 +76,61 @@ void calendar_each_event(Calendar* self, CalendarEachEventCallback callback, voi
 	FOCAL_CALENDAR_GET_CLASS(self)->each_event(self, callback, user);
 }
 
+typedef struct {
+	CalendarEachEventCallback callback;
+	void* user;
+} EachEventInRangeContext;
+
+static void each_event_in_range_marshaller(gpointer item, gpointer user)
+{
+	EachEventInRangeContext* ctx = (EachEventInRangeContext*) user;
+	ctx->callback(ctx->user, FOCAL_EVENT(item));
+}
+
+void calendar_each_event_in_range(Calendar* self, icaltime_span range, CalendarEachEventCallback callback, void* user)
+{
+	CalendarPrivate* priv = (CalendarPrivate*) calendar_get_instance_private(self);
+	EachEventInRangeContext ctx = {callback, user};
+	interval_tree_query(priv->index, range.start, range.end, each_event_in_range_marshaller, &ctx);
+}
+
 void calendar_sync(Calendar* self)
 {
 	_calendar_clear_error(self);
 	FOCAL_CALENDAR_GET_CLASS(self)->sync(self);
 }
 
+gboolean calendar_load_cache(Calendar* self)
+{
+	CalendarClass* cc = FOCAL_CALENDAR_GET_CLASS(self);
+	if (!cc->load_cache)
+		return FALSE;
+	return cc->load_cache(self, _calendar_get_cache(self));
+}
+
 gboolean calendar_is_read_only(Calendar* self)
 {
 	return FOCAL_CALENDAR_GET_CLASS(self)->read_only(self);
 }
 
+static gboolean run_range_sync(Calendar* self)
+{
+	CalendarPrivate* priv = (CalendarPrivate*) calendar_get_instance_private(self);
+	priv->range_sync_source = 0;
+	_calendar_clear_error(self);
+	FOCAL_CALENDAR_GET_CLASS(self)->sync_date_range(self, priv->pending_range);
+	return G_SOURCE_REMOVE;
+}
+
 void calendar_sync_date_range(Calendar* self, icaltime_span range)
 {
-	CalendarClass* cc = FOCAL_CALENDAR_GET_CLASS(self);
-	if (cc->sync_date_range) {
-		_calendar_clear_error(self);
-		cc->sync_date_range(self, range);
-	}
+	CalendarPrivate* priv = (CalendarPrivate*) calendar_get_instance_private(self);
+	if (!FOCAL_CALENDAR_GET_CLASS(self)->sync_date_range)
+		return;
+	priv->pending_range = range;
+	if (priv->range_sync_source)
+		g_source_remove(priv->range_sync_source);
+	priv->range_sync_source = g_timeout_add(RANGE_SYNC_DELAY_MS, (GSourceFunc) run_range_sync, self);
 }
 
 static void on_config_modified(Calendar* self)
@@ -102,22 +155,57 @@ static void set_property(GObject* object, guint prop_id, const GValue* value, GP
 	}
 }
 
+static void calendar_event_change_clear(CalendarEventChange* change)
+{
+	if (change->old_event)
+		g_object_unref(change->old_event);
+	if (change->new_event)
+		g_object_unref(change->new_event);
+}
+
+static GArray* calendar_changes_array_new(void)
+{
+	GArray* changes = g_array_new(FALSE, FALSE, sizeof(CalendarEventChange));
+	g_array_set_clear_func(changes, (GDestroyNotify) calendar_event_change_clear);
+	return changes;
+}
+
+static void finalize(GObject* gobject)
+{
+	CalendarPrivate* priv = (CalendarPrivate*) calendar_get_instance_private(FOCAL_CALENDAR(gobject));
+	if (priv->range_sync_source)
+		g_source_remove(priv->range_sync_source);
+	if (priv->cache)
+		calendar_cache_free(priv->cache);
+	free(priv->error_message);
+	g_array_free(priv->pending.changes, TRUE);
+	interval_tree_free(priv->index);
+	G_OBJECT_CLASS(calendar_parent_class)->finalize(gobject);
+}
+
 void calendar_class_init(CalendarClass* klass)
 {
 	GObjectClass* goc = (GObjectClass*) klass;
 	calendar_signals[SIGNAL_SYNC_DONE] = g_signal_new("sync-done", G_TYPE_FROM_CLASS(goc), G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION, 0, NULL, NULL, NULL, G_TYPE_NONE, 1, G_TYPE_BOOLEAN);
-	calendar_signals[SIGNAL_EVENT_UPDATED] = g_signal_new("event-updated", G_TYPE_FROM_CLASS(goc), G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION, 0, NULL, NULL, NULL, G_TYPE_NONE, 2, G_TYPE_POINTER, G_TYPE_POINTER);
+	// Emitted during the initial sync of a calendar once the events around today have
+	// been fetched. The sync carries on with the rest and emits sync-done when complete.
+	calendar_signals[SIGNAL_INITIAL_WINDOW_SYNCED] = g_signal_new("initial-window-synced", G_TYPE_FROM_CLASS(goc), G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION, 0, NULL, NULL, NULL, G_TYPE_NONE, 0);
+	calendar_signals[SIGNAL_EVENTS_CHANGED] = g_signal_new("events-changed", G_TYPE_FROM_CLASS(goc), G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION, 0, NULL, NULL, NULL, G_TYPE_NONE, 1, G_TYPE_POINTER);
 	// TODO: learn how to use G_TYPE_STRING in return value properly...
 	calendar_signals[SIGNAL_REQUEST_PASSWORD] = g_signal_new("request-password", G_TYPE_FROM_CLASS(goc), G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION, 0, NULL, NULL, NULL, G_TYPE_POINTER, 2, G_TYPE_POINTER, G_TYPE_POINTER);
 	calendar_signals[SIGNAL_CONFIG_MODIFIED] = g_signal_new("config-modified", G_TYPE_FROM_CLASS(goc), G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION, 0, NULL, NULL, NULL, G_TYPE_NONE, 0);
 	calendar_signals[SIGNAL_ERROR] = g_signal_new("error", G_TYPE_FROM_CLASS(goc), G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION, 0, NULL, NULL, NULL, G_TYPE_NONE, 0);
 	goc->set_property = set_property;
+	goc->finalize = finalize;
 	g_object_class_install_property(goc, PROP_CALENDAR_CONFIG, g_param_spec_pointer("cfg", "Calendar Configuration", "", G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY));
 	g_object_class_install_property(goc, PROP_REMOTE_AUTH, g_param_spec_pointer("auth", "Remote Authenticator", "", G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY));
 }
 
 void calendar_init(Calendar* self)
 {
+	CalendarPrivate* priv = (CalendarPrivate*) calendar_get_instance_private(self);
+	priv->pending.changes = calendar_changes_array_new();
+	priv->index = interval_tree_new(g_object_unref);
 }
 
 const CalendarConfig* calendar_get_config(Calendar* self)
@@ -176,6 +264,71 @@ void _calendar_clear_error(Calendar* self)
 	priv->error_message = NULL;
 }
 
+static void calendar_emit_pending_changes(Calendar* self)
+{
+	CalendarPrivate* priv = (CalendarPrivate*) calendar_get_instance_private(self);
+	if (priv->pending.changes->len == 0)
+		return;
+	// Detach the set first, handlers may themselves cause further changes
+	CalendarChanges changes = priv->pending;
+	priv->pending.changes = calendar_changes_array_new();
+	g_signal_emit(self, calendar_signals[SIGNAL_EVENTS_CHANGED], 0, &changes);
+	// releases the references held on the events
+	g_array_free(changes.changes, TRUE);
+}
+
+void _calendar_begin_changes(Calendar* self)
+{
+	CalendarPrivate* priv = (CalendarPrivate*) calendar_get_instance_private(self);
+	priv->changes_depth++;
+}
+
+void _calendar_event_changed(Calendar* self, Event* old_event, Event* new_event)
+{
+	CalendarPrivate* priv = (CalendarPrivate*) calendar_get_instance_private(self);
+	if (!old_event && !new_event)
+		return;
+
+	// Hold references so that the events stay valid until delivered, even if
+	// the implementation releases them in the meantime
+	CalendarEventChange change = {
+		.old_event = old_event ? g_object_ref(old_event) : NULL,
+		.new_event = new_event ? g_object_ref(new_event) : NULL};
+	g_array_append_val(priv->pending.changes, change);
+
+	// The index is updated immediately so that it is consistent with the
+	// implementation's own storage by the time any handler runs. The event
+	// is re-inserted even if unchanged since it may have been modified in place
+	if (old_event && old_event != new_event)
+		interval_tree_remove(priv->index, old_event);
+	if (new_event) {
+		icaltime_span span = event_get_span(new_event);
+		// drops the reference held by the index, the change still holds one
+		interval_tree_remove(priv->index, new_event);
+		interval_tree_insert(priv->index, span.start, span.end, g_object_ref(new_event));
+	}
+
+	if (priv->changes_depth == 0)
+		calendar_emit_pending_changes(self);
+}
+
+void _calendar_end_changes(Calendar* self)
+{
+	CalendarPrivate* priv = (CalendarPrivate*) calendar_get_instance_private(self);
+	g_assert_true(priv->changes_depth > 0);
+	if (--priv->changes_depth == 0)
+		calendar_emit_pending_changes(self);
+}
+
+CalendarCache* _calendar_get_cache(Calendar* self)
+{
+	CalendarPrivate* priv = (CalendarPrivate*) calendar_get_instance_private(self);
+	// opened lazily since the config is not available until construction is complete
+	if (!priv->cache)
+		priv->cache = calendar_cache_open(priv->config);
+	return priv->cache;
+}
+
 #include "caldav-calendar.h"
 #include "ics-calendar.h"
 #include "oauth2-provider-google.h"
@@ -24,8 +24,26 @@ G_DECLARE_DERIVABLE_TYPE(Calendar, calendar, FOCAL, CALENDAR, GObject)
 
 typedef void (*CalendarEachEventCallback)(void* user, Event*);
 
+// A single change to a calendar's events. For an added event, old_event is NULL,
+// for a removed event, new_event is NULL. Both may be the same Event if it was
+// modified in place.
+typedef struct {
+	Event* old_event;
+	Event* new_event;
+} CalendarEventChange;
+
+// Passed to handlers of the events-changed signal. The changes are in the order
+// they were made and should be applied in that order. All events referenced in
+// the set, including those removed or replaced, remain valid until the handlers
+// return.
+typedef struct {
+	GArray* changes; // CalendarEventChange
+} CalendarChanges;
+
 typedef struct _RemoteAuth RemoteAuth;
 
+typedef struct _CalendarCache CalendarCache;
+
 struct _CalendarClass {
 	GObjectClass parent;
 	void (*save_event)(Calendar*, Event* event);
@@ -34,6 +52,7 @@ struct _CalendarClass {
 	void (*sync)(Calendar*);
 	gboolean (*read_only)(Calendar*);
 	void (*sync_date_range)(Calendar*, icaltime_span range);
+	gboolean (*load_cache)(Calendar*, CalendarCache* cache);
 	/* protected */
 	void (*attach_authenticator)(Calendar*, RemoteAuth* auth);
 };
@@ -42,16 +61,29 @@ void calendar_save_event(Calendar* self, Event* event);
 
 void calendar_delete_event(Calendar* self, Event* event);
 
-// TODO: will this only ever be used to call event_get_ocurrences? If so, consider making this directly get the occurrences
-// TODO: consider storing the events in the Calendar class instead of forcing each child class to reimplement
 void calendar_each_event(Calendar* self, CalendarEachEventCallback callback, void* user);
 
+// Calls the callback for each event that may have an occurrence within the
+// range, ordered by start. Events are indexed by a conservative span, so the
+// callback should still expand the recurrences of each event it receives.
+// Only events reported through _calendar_event_changed are visited.
+void calendar_each_event_in_range(Calendar* self, icaltime_span range, CalendarEachEventCallback callback, void* user);
+
 void calendar_sync(Calendar* self);
 
+// Populates the calendar from its on-disk cache, if the implementation supports
+// one. Should be called once before the first calendar_sync. Returns TRUE if any
+// events were loaded, in which case the calendar can be displayed immediately.
+gboolean calendar_load_cache(Calendar* self);
+
 gboolean calendar_is_read_only(Calendar* self);
 
-// Some calendar types (Outlook 365) will not return complete recurrence information to a broad request, but must be
-// interrogated specifically for a certain range. Proper CalDAV implementations should not implement this method.
+// Fetches the events of a range about to be displayed ahead of the rest of the calendar. Outlook 365 will not return
+// complete recurrence information to a broad request, so every displayed range is interrogated specifically. CalDAV
+// calendars only do so until their initial sync has fetched the whole collection: that sync first fetches a window
+// around today and emits initial-window-synced once it is available, so that the calendar can be displayed before
+// the rest arrives, and ranges displayed in the meantime are fetched before the rest too. Only the latest range is
+// fetched if this is called again before the previous one has started. Changes arrive through events-changed as usual.
 void calendar_sync_date_range(Calendar*, icaltime_span range);
 
 const CalendarConfig* calendar_get_config(Calendar* self);
@@ -70,6 +102,19 @@ char* calendar_get_error(Calendar* self);
 void _calendar_error(Calendar* self, const char* fmt, ...);
 void _calendar_clear_error(Calendar* self);
 
+// Calendar implementations report every change to their events with
+// _calendar_event_changed, before releasing any reference to old_event.
+// Changes made between _calendar_begin_changes and _calendar_end_changes
+// (typically a whole sync) are delivered in a single events-changed signal,
+// otherwise each change is delivered immediately. Calls may be nested.
+void _calendar_begin_changes(Calendar* self);
+void _calendar_event_changed(Calendar* self, Event* old_event, Event* new_event);
+void _calendar_end_changes(Calendar* self);
+
+// Returns the on-disk cache for this calendar, for use by implementations
+// of load_cache which should write subsequent changes back to it.
+CalendarCache* _calendar_get_cache(Calendar* self);
+
 // factory method
 Calendar* calendar_create(CalendarConfig* config);
 
@@ -266,11 +266,13 @@ static void on_description_modified(GtkTextBuffer* description, EventPanel* ew)
 	// No signal emitted since the description is not visible in the main view anyway
 }
 
-static void event_updated(EventPanel* ep, Event* old_event, Event* new_event, Calendar* cal)
+static void events_changed(EventPanel* ep, const CalendarChanges* changes, Calendar* cal)
 {
 	// TODO: maybe notify the user that the event has changed out from underneath them?
-	if (old_event == ep->selected_event && new_event) {
-		event_panel_set_event(ep, new_event);
+	for (guint i = 0; i < changes->changes->len; ++i) {
+		CalendarEventChange* change = &g_array_index(changes->changes, CalendarEventChange, i);
+		if (change->old_event == ep->selected_event && change->new_event)
+			event_panel_set_event(ep, change->new_event);
 	}
 }
 
@@ -322,6 +324,6 @@ void event_panel_set_event(EventPanel* ew, Event* ev)
 		gtk_widget_set_sensitive(ew->ends_date, editable);
 
 		// TODO what if the event doesn't have a calendar yet?
-		g_signal_connect_swapped(event_get_calendar(ev), "event-updated", G_CALLBACK(event_updated), ew);
+		g_signal_connect_swapped(event_get_calendar(ev), "events-changed", G_CALLBACK(events_changed), ew);
 	}
 }
@@ -203,11 +203,13 @@ static void on_duration_modified(GtkSpinButton* duration, EventPopup* ep)
 	g_signal_emit(ep, event_panel_signals[SIGNAL_EVENT_MODIFIED], 0, ep->selected_event);
 }
 
-static void event_updated(EventPopup* ep, Event* old_event, Event* new_event, Calendar* cal)
+static void events_changed(EventPopup* ep, const CalendarChanges* changes, Calendar* cal)
 {
 	// TODO: maybe notify the user that the event has changed out from underneath them?
-	if (old_event == ep->selected_event) {
-		event_popup_set_event(ep, new_event);
+	for (guint i = 0; i < changes->changes->len; ++i) {
+		CalendarEventChange* change = &g_array_index(changes->changes, CalendarEventChange, i);
+		if (change->old_event == ep->selected_event)
+			event_popup_set_event(ep, change->new_event);
 	}
 }
 
@@ -244,7 +246,7 @@ void event_popup_set_event(EventPopup* ew, Event* ev)
 		gtk_widget_set_sensitive(ew->btn_save, editable);
 		gtk_widget_set_sensitive(ew->btn_delete, editable);
 
-		g_signal_connect_swapped(event_get_calendar(ev), "event-updated", G_CALLBACK(event_updated), ew);
+		g_signal_connect_swapped(event_get_calendar(ev), "events-changed", G_CALLBACK(events_changed), ew);
 	}
 }
 
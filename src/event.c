@@ -13,6 +13,8 @@
  */
 #include "event.h"
 #include "calendar.h"
+#include "interval-tree.h"
+#include "timezone.h"
 
 struct _Event {
 	GObject parent;
@@ -21,6 +23,13 @@ struct _Event {
 	char* url;
 	char* etag;
 	gboolean dirty;
+	// bumped whenever the occurrences of the event may have changed
+	guint revision;
+	// occurrence spans expanded over occurrences_window at occurrences_revision,
+	// NULL until first needed
+	GArray* occurrences;
+	icaltime_span occurrences_window;
+	guint occurrences_revision;
 };
 
 G_DEFINE_TYPE(Event, event, G_TYPE_OBJECT)
@@ -155,6 +164,7 @@ void event_set_calendar(Event* ev, Calendar* cal)
 void event_set_dtstart(Event* ev, icaltimetype dt)
 {
 	icalcomponent_set_dtstart(ev->cmp, dt);
+	event_invalidate_occurrences(ev);
 	ev->dirty = TRUE;
 }
 
@@ -165,6 +175,7 @@ void event_set_dtend(Event* ev, icaltimetype dt)
 	// a DURATION. So unconditionally remove any DURATION property before calling set_dtend.
 	icalcomponent_remove_property(ev->cmp, icalcomponent_get_first_property(ev->cmp, ICAL_DURATION_PROPERTY));
 	icalcomponent_set_dtend(ev->cmp, dt);
+	event_invalidate_occurrences(ev);
 	ev->dirty = TRUE;
 }
 
@@ -273,10 +284,396 @@ typedef struct {
 static void each_recurrence_marshaller(icalcomponent* comp, struct icaltime_span* span, void* data)
 {
 	EventRecurrenceContext* ctx = (EventRecurrenceContext*) data;
-	icaltimetype tt = icaltime_from_timet_with_zone(span->start, ctx->all_day, ctx->user_tz);
+	icaltimetype tt = timezone_time_from_timet(span->start, ctx->all_day, ctx->user_tz);
 	ctx->callback(ctx->ev, tt, ctx->duration, ctx->user_data);
 }
 
+typedef void (*OccurrenceCallback)(icalcomponent* comp, struct icaltime_span* span, void* data);
+
+// State for expanding an event arithmetically rather than with libical's
+// recurrence iterator. The results are intended to be identical to those of
+// icalcomponent_foreach_recurrence: DTSTART is reported first, then the RRULE
+// instances after it, then RDATEs, all with the duration of the base instance
+// and filtered by EXDATE.
+typedef struct {
+	icalcomponent* cmp;
+	icaltimetype dtstart;
+	time_t duration;
+	icaltime_span limit;
+	struct icalrecurrencetype rule;
+	time_t until;	  // rule.until, if it is a DATE-TIME
+	GArray* exdates;  // icaltimetype
+	gint64 skip_days; // instances starting fewer days than this after DTSTART cannot overlap limit
+	OccurrenceCallback callback;
+	void* data;
+} FastExpansion;
+
+static GDateWeekday weekday_from_ical(int ical_weekday)
+{
+	// libical counts from SUNDAY = 1, GDate from MONDAY = 1
+	return (GDateWeekday)((ical_weekday + 5) % 7 + 1);
+}
+
+static guint32 julian_from_icaltime(icaltimetype tt)
+{
+	GDate date;
+	g_date_clear(&date, 1);
+	g_date_set_dmy(&date, tt.day, tt.month, tt.year);
+	return g_date_get_julian(&date);
+}
+
+static gboolean fast_expansion_is_excluded(FastExpansion* fx, icaltimetype tt)
+{
+	for (guint i = 0; i < fx->exdates->len; ++i) {
+		icaltimetype ex = g_array_index(fx->exdates, icaltimetype, i);
+		if (ex.is_date ? (tt.year == ex.year && tt.month == ex.month && tt.day == ex.day) : icaltime_compare(tt, ex) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void fast_expansion_report(FastExpansion* fx, icaltimetype tt, icaltime_span* span)
+{
+	if (!fast_expansion_is_excluded(fx, tt) && icaltime_span_overlaps(span, &fx->limit))
+		fx->callback(fx->cmp, span, fx->data);
+}
+
+// Reports the rule instance falling on the given day. Returns FALSE once past
+// the end of the rule or of the requested range
+static gboolean fast_expansion_emit(FastExpansion* fx, gint64 julian)
+{
+	if (julian > G_MAXUINT32 || !g_date_valid_julian((guint32) julian))
+		return FALSE;
+	GDate date;
+	g_date_clear(&date, 1);
+	g_date_set_julian(&date, (guint32) julian);
+	icaltimetype tt = fx->dtstart;
+	tt.year = g_date_get_year(&date);
+	tt.month = g_date_get_month(&date);
+	tt.day = g_date_get_day(&date);
+
+	time_t start = timezone_time_as_timet(tt);
+	icaltimetype until = fx->rule.until;
+	if (!icaltime_is_null_time(until)) {
+		gboolean past = until.is_date ? (tt.year * 10000 + tt.month * 100 + tt.day > until.year * 10000 + until.month * 100 + until.day) : start > fx->until;
+		if (past)
+			return FALSE;
+	}
+	if (start >= fx->limit.end)
+		return FALSE;
+
+	icaltime_span span = {start, start + fx->duration, 1};
+	fast_expansion_report(fx, tt, &span);
+	return TRUE;
+}
+
+static void fast_expand_daily(FastExpansion* fx)
+{
+	int interval = fx->rule.interval;
+	gint64 origin = julian_from_icaltime(fx->dtstart);
+	// instance i (DTSTART being 0) falls i * interval days after DTSTART
+	for (gint64 i = MAX(1, fx->skip_days / interval); fx->rule.count == 0 || i < fx->rule.count; ++i) {
+		if (!fast_expansion_emit(fx, origin + i * interval))
+			break;
+	}
+}
+
+static void fast_expand_weekly(FastExpansion* fx)
+{
+	int interval = fx->rule.interval;
+	GDateWeekday wkst = weekday_from_ical(fx->rule.week_start == ICAL_NO_WEEKDAY ? ICAL_MONDAY_WEEKDAY : fx->rule.week_start);
+
+	GDate date;
+	g_date_clear(&date, 1);
+	g_date_set_dmy(&date, fx->dtstart.day, fx->dtstart.month, fx->dtstart.year);
+	int dtstart_offset = (g_date_get_weekday(&date) - wkst + 7) % 7;
+	gint64 week_origin = g_date_get_julian(&date) - dtstart_offset;
+
+	// offsets of the selected days from the start of the week, in order
+	gboolean selected[7] = {FALSE};
+	if (fx->rule.by_day[0] == ICAL_RECURRENCE_ARRAY_MAX)
+		selected[dtstart_offset] = TRUE;
+	for (int i = 0; i < ICAL_BY_DAY_SIZE && fx->rule.by_day[i] != ICAL_RECURRENCE_ARRAY_MAX; ++i)
+		selected[(weekday_from_ical(icalrecurrencetype_day_day_of_week(fx->rule.by_day[i])) - wkst + 7) % 7] = TRUE;
+	int offsets[7], n = 0, first_week_count = 0;
+	for (int i = 0; i < 7; ++i) {
+		if (selected[i]) {
+			offsets[n++] = i;
+			if (i >= dtstart_offset)
+				first_week_count++;
+		}
+	}
+
+	for (gint64 w = fx->skip_days / (7 * interval); TRUE; ++w) {
+		for (int k = 0; k < n; ++k) {
+			// DTSTART and anything before it in the first week are not rule instances
+			if (w == 0 && offsets[k] <= dtstart_offset)
+				continue;
+			// instances are counted from DTSTART, which is always the first
+			gint64 ordinal = w == 0 ? k - (n - first_week_count) : first_week_count + (w - 1) * n + k;
+			if (fx->rule.count && ordinal >= fx->rule.count)
+				return;
+			if (!fast_expansion_emit(fx, week_origin + w * 7 * interval + offsets[k]))
+				return;
+		}
+	}
+}
+
+// Returns the day of the month selected by a monthly rule, or 0 if the month
+// has no such day
+static int monthly_rule_day(const struct icalrecurrencetype* rule, int default_day, int month, int year)
+{
+	int days_in_month = g_date_get_days_in_month(month, year);
+	if (rule->by_day[0] == ICAL_RECURRENCE_ARRAY_MAX) {
+		int day = rule->by_month_day[0] != ICAL_RECURRENCE_ARRAY_MAX ? rule->by_month_day[0] : default_day;
+		return day <= days_in_month ? day : 0;
+	}
+
+	GDateWeekday weekday = weekday_from_ical(icalrecurrencetype_day_day_of_week(rule->by_day[0]));
+	int pos = icalrecurrencetype_day_position(rule->by_day[0]);
+	GDate date;
+	g_date_clear(&date, 1);
+	int day;
+	if (pos > 0) {
+		g_date_set_dmy(&date, 1, month, year);
+		day = 1 + (weekday - g_date_get_weekday(&date) + 7) % 7 + (pos - 1) * 7;
+	} else {
+		g_date_set_dmy(&date, days_in_month, month, year);
+		day = days_in_month - (g_date_get_weekday(&date) - weekday + 7) % 7 + (pos + 1) * 7;
+	}
+	return day >= 1 && day <= days_in_month ? day : 0;
+}
+
+static void fast_expand_monthly(FastExpansion* fx)
+{
+	int interval = fx->rule.interval;
+	gint64 first = 1;
+	// With a COUNT, months without an instance have to be accounted for, so
+	// walk from DTSTART. There are only ever twelve candidates per year.
+	if (fx->rule.count == 0)
+		first = MAX(1, fx->skip_days / 31 / interval);
+
+	gint64 ordinal = 1;
+	for (gint64 m = first; fx->rule.count == 0 || ordinal < fx->rule.count; ++m) {
+		gint64 months = (fx->dtstart.month - 1) + m * interval;
+		int year = fx->dtstart.year + months / 12, month = months % 12 + 1;
+		if (year > 9999)
+			break;
+		int day = monthly_rule_day(&fx->rule, fx->dtstart.day, month, year);
+		if (!day)
+			continue;
+		GDate date;
+		g_date_clear(&date, 1);
+		g_date_set_dmy(&date, day, month, year);
+		if (!fast_expansion_emit(fx, g_date_get_julian(&date)))
+			break;
+		ordinal++;
+	}
+}
+
+// Only rules whose instances can be computed directly, and for which DTSTART is
+// itself an instance (so that COUNT is unambiguous), are handled by the fast path
+static gboolean fast_expansion_supports_rule(const struct icalrecurrencetype* rule, icaltimetype dtstart)
+{
+	if (rule->by_second[0] != ICAL_RECURRENCE_ARRAY_MAX || rule->by_minute[0] != ICAL_RECURRENCE_ARRAY_MAX || rule->by_hour[0] != ICAL_RECURRENCE_ARRAY_MAX || rule->by_year_day[0] != ICAL_RECURRENCE_ARRAY_MAX || rule->by_week_no[0] != ICAL_RECURRENCE_ARRAY_MAX || rule->by_month[0] != ICAL_RECURRENCE_ARRAY_MAX || rule->by_set_pos[0] != ICAL_RECURRENCE_ARRAY_MAX)
+		return FALSE;
+#if defined(ICAL_MAJOR_VERSION) && ICAL_MAJOR_VERSION >= 2
+	if (rule->rscale)
+		return FALSE;
+#endif
+	if (rule->count < 0 || !g_date_valid_dmy(dtstart.day, dtstart.month, dtstart.year))
+		return FALSE;
+
+	GDate date;
+	g_date_clear(&date, 1);
+	g_date_set_dmy(&date, dtstart.day, dtstart.month, dtstart.year);
+
+	switch (rule->freq) {
+	case ICAL_DAILY_RECURRENCE:
+		return rule->by_day[0] == ICAL_RECURRENCE_ARRAY_MAX && rule->by_month_day[0] == ICAL_RECURRENCE_ARRAY_MAX;
+	case ICAL_WEEKLY_RECURRENCE: {
+		if (rule->by_month_day[0] != ICAL_RECURRENCE_ARRAY_MAX)
+			return FALSE;
+		if (rule->by_day[0] == ICAL_RECURRENCE_ARRAY_MAX)
+			return TRUE;
+		gboolean dtstart_selected = FALSE;
+		for (int i = 0; i < ICAL_BY_DAY_SIZE && rule->by_day[i] != ICAL_RECURRENCE_ARRAY_MAX; ++i) {
+			if (icalrecurrencetype_day_position(rule->by_day[i]) != 0)
+				return FALSE;
+			if (weekday_from_ical(icalrecurrencetype_day_day_of_week(rule->by_day[i])) == g_date_get_weekday(&date))
+				dtstart_selected = TRUE;
+		}
+		return dtstart_selected;
+	}
+	case ICAL_MONTHLY_RECURRENCE:
+		if (rule->by_day[0] != ICAL_RECURRENCE_ARRAY_MAX) {
+			// a single nth weekday of the month, e.g. 2TU or -1FR
+			int pos = icalrecurrencetype_day_position(rule->by_day[0]);
+			if (rule->by_day[1] != ICAL_RECURRENCE_ARRAY_MAX || rule->by_month_day[0] != ICAL_RECURRENCE_ARRAY_MAX || pos == 0 || pos > 5 || pos < -5)
+				return FALSE;
+		} else if (rule->by_month_day[0] != ICAL_RECURRENCE_ARRAY_MAX) {
+			if (rule->by_month_day[1] != ICAL_RECURRENCE_ARRAY_MAX || rule->by_month_day[0] < 1)
+				return FALSE;
+		}
+		return monthly_rule_day(rule, dtstart.day, dtstart.month, dtstart.year) == dtstart.day;
+	default:
+		return FALSE;
+	}
+}
+
+// Reports the occurrences of the event overlapping range, as
+// icalcomponent_foreach_recurrence would, but without iterating from DTSTART.
+// Returns FALSE without reporting anything if the event's recurrence is not
+// one of the common shapes handled here.
+static gboolean event_foreach_occurrence_fast(Event* ev, icaltime_span range, OccurrenceCallback callback, void* data)
+{
+	FastExpansion fx = {.cmp = ev->cmp, .limit = range, .callback = callback, .data = data};
+	fx.dtstart = icalcomponent_get_dtstart(ev->cmp);
+	if (icaltime_is_null_time(fx.dtstart))
+		return TRUE;
+
+	if (icalcomponent_get_first_property(ev->cmp, ICAL_EXRULE_PROPERTY))
+		return FALSE;
+	icalproperty* rrule = icalcomponent_get_first_property(ev->cmp, ICAL_RRULE_PROPERTY);
+	if (rrule) {
+		if (icalcomponent_get_next_property(ev->cmp, ICAL_RRULE_PROPERTY))
+			return FALSE;
+		fx.rule = icalproperty_get_rrule(rrule);
+		if (!fast_expansion_supports_rule(&fx.rule, fx.dtstart))
+			return FALSE;
+		if (fx.rule.interval < 1)
+			fx.rule.interval = 1;
+		if (!icaltime_is_null_time(fx.rule.until) && !fx.rule.until.is_date)
+			fx.until = icaltime_as_timet_with_zone(fx.rule.until, fx.rule.until.zone ? fx.rule.until.zone : fx.dtstart.zone ? fx.dtstart.zone : icaltimezone_get_utc_timezone());
+	} else {
+		fx.rule.until = icaltime_null_time();
+	}
+
+	// Base instance, computed as libical does
+	icaltime_span base = {timezone_time_as_timet(fx.dtstart), 0, 1};
+	icaltimetype dtend = icalcomponent_get_dtend(ev->cmp);
+	if (icaltime_is_null_time(dtend)) {
+		if (fx.dtstart.is_date) {
+			dtend = fx.dtstart;
+			icaltime_adjust(&dtend, 1, 0, 0, 0);
+			base.end = timezone_time_as_timet(dtend);
+		} else {
+			base.end = base.start;
+		}
+	} else {
+		base.end = timezone_time_as_timet(dtend);
+	}
+	fx.duration = base.end - base.start;
+	// one day of slack for DST transitions between DTSTART and the range
+	fx.skip_days = MAX(0, (range.start - fx.duration - base.start) / (24 * 60 * 60) - 1);
+
+	// Collected up front, the component has only a single property iterator.
+	// A TZID is resolved against the VTIMEZONEs of the calendar object, like
+	// libical does, icalproperty_get_exdate would return a floating time.
+	fx.exdates = g_array_new(FALSE, FALSE, sizeof(icaltimetype));
+	for (icalproperty* p = icalcomponent_get_first_property(ev->cmp, ICAL_EXDATE_PROPERTY); p; p = icalcomponent_get_next_property(ev->cmp, ICAL_EXDATE_PROPERTY)) {
+		icaltimetype ex = icalproperty_get_datetime_with_component(p, ev->cmp);
+		g_array_append_val(fx.exdates, ex);
+	}
+	GArray* rdates = g_array_new(FALSE, FALSE, sizeof(icaltimetype));
+	for (icalproperty* p = icalcomponent_get_first_property(ev->cmp, ICAL_RDATE_PROPERTY); p; p = icalcomponent_get_next_property(ev->cmp, ICAL_RDATE_PROPERTY)) {
+		// like libical, only RDATEs given as a DATE-TIME or DATE are supported
+		struct icaldatetimeperiodtype rdate = icalproperty_get_rdate(p);
+		if (!icaltime_is_null_time(rdate.time)) {
+			icaltimetype tt = icalproperty_get_datetime_with_component(p, ev->cmp);
+			g_array_append_val(rdates, tt);
+		}
+	}
+
+	fast_expansion_report(&fx, fx.dtstart, &base);
+
+	if (rrule) {
+		switch (fx.rule.freq) {
+		case ICAL_DAILY_RECURRENCE:
+			fast_expand_daily(&fx);
+			break;
+		case ICAL_WEEKLY_RECURRENCE:
+			fast_expand_weekly(&fx);
+			break;
+		case ICAL_MONTHLY_RECURRENCE:
+			fast_expand_monthly(&fx);
+			break;
+		default:
+			g_assert_not_reached();
+		}
+	}
+
+	for (guint i = 0; i < rdates->len; ++i) {
+		icaltimetype tt = g_array_index(rdates, icaltimetype, i);
+		icaltime_span span = {timezone_time_as_timet(tt), 0, 1};
+		span.end = span.start + fx.duration;
+		fast_expansion_report(&fx, tt, &span);
+	}
+
+	g_array_free(rdates, TRUE);
+	g_array_free(fx.exdates, TRUE);
+	return TRUE;
+}
+
+// Drop-in replacement for icalcomponent_foreach_recurrence over a time_t range
+static void event_foreach_occurrence(Event* ev, icaltime_span range, OccurrenceCallback callback, void* data)
+{
+	if (event_foreach_occurrence_fast(ev, range, callback, data))
+		return;
+
+	icaltimetype start = icaltime_from_timet_with_zone(range.start, 0, icaltimezone_get_utc_timezone()),
+				 end = icaltime_from_timet_with_zone(range.end, 0, icaltimezone_get_utc_timezone());
+	icalcomponent_foreach_recurrence(ev->cmp, start, end, callback, data);
+}
+
+// Occurrences are expanded over a window this much wider than requested on each
+// side, so that moving to a neighbouring week or rescanning reminders is served
+// from the cache. Rules not handled by the fast path are iterated by libical
+// from DTSTART, so a wider window costs little more to expand than a narrow one.
+#define OCCURRENCE_CACHE_PADDING (8 * 7 * 24 * 60 * 60)
+
+static void collect_occurrence(icalcomponent* comp, struct icaltime_span* span, void* data)
+{
+	g_array_append_val((GArray*) data, *span);
+}
+
+static gboolean event_has_recurrence_properties(Event* ev)
+{
+	return icalcomponent_get_first_property(ev->cmp, ICAL_RRULE_PROPERTY) || icalcomponent_get_first_property(ev->cmp, ICAL_RDATE_PROPERTY);
+}
+
+// Returns the occurrences of a recurring event, covering at least range
+static GArray* event_get_occurrences(Event* ev, icaltime_span range)
+{
+	gboolean current = ev->occurrences && ev->occurrences_revision == ev->revision;
+	if (current && ev->occurrences_window.start <= range.start && ev->occurrences_window.end >= range.end)
+		return ev->occurrences;
+
+	icaltime_span window = {range.start - OCCURRENCE_CACHE_PADDING, range.end + OCCURRENCE_CACHE_PADDING, 0};
+	if (ev->occurrences) {
+		// grow a neighbouring window rather than replacing it, so that paging
+		// back and forth stays within the cache
+		if (current && window.start <= ev->occurrences_window.end && window.end >= ev->occurrences_window.start) {
+			window.start = MIN(window.start, ev->occurrences_window.start);
+			window.end = MAX(window.end, ev->occurrences_window.end);
+		}
+		g_array_set_size(ev->occurrences, 0);
+	} else {
+		ev->occurrences = g_array_new(FALSE, FALSE, sizeof(icaltime_span));
+	}
+
+	event_foreach_occurrence(ev, window, collect_occurrence, ev->occurrences);
+	ev->occurrences_window = window;
+	ev->occurrences_revision = ev->revision;
+	return ev->occurrences;
+}
+
+void event_invalidate_occurrences(Event* ev)
+{
+	// the cached array is kept to be refilled on the next lookup
+	ev->revision++;
+}
+
 void event_each_recurrence(Event* ev, icaltimezone* user_tz, icaltime_span range, EventRecurrenceCallback callback, gpointer user)
 {
 	EventRecurrenceContext ctx;
@@ -287,26 +684,60 @@ void event_each_recurrence(Event* ev, icaltimezone* user_tz, icaltime_span range
 	ctx.callback = callback;
 	ctx.user_data = user;
 
-	icaltimetype start = icaltime_from_timet_with_zone(range.start, 0, icaltimezone_get_utc_timezone()),
-				 end = icaltime_from_timet_with_zone(range.end, 0, icaltimezone_get_utc_timezone());
+	// Nothing to gain from caching a single occurrence
+	if (!event_has_recurrence_properties(ev)) {
+		event_foreach_occurrence(ev, range, each_recurrence_marshaller, &ctx);
+		return;
+	}
 
-	icalcomponent_foreach_recurrence(ev->cmp, start, end, each_recurrence_marshaller, &ctx);
+	// Apply the same overlap test as icalcomponent_foreach_recurrence would
+	icaltime_span limit = {range.start, range.end, 0};
+	GArray* occurrences = event_get_occurrences(ev, range);
+	for (guint i = 0; i < occurrences->len; ++i) {
+		icaltime_span* span = &g_array_index(occurrences, icaltime_span, i);
+		if (icaltime_span_overlaps(span, &limit))
+			each_recurrence_marshaller(ev->cmp, span, &ctx);
+	}
 }
 
-static void test_occurrence_exists(icalcomponent* comp, struct icaltime_span* span, void* data)
+static void start_set_add(GHashTable* set, gint64 start)
 {
-	*((gboolean*) data) = TRUE;
+	gint64* key = g_new(gint64, 1);
+	*key = start;
+	g_hash_table_add(set, key);
 }
 
-void event_add_occurrence(Event* ev, icaltimetype start, icaltimetype end)
+static void collect_occurrence_start(icalcomponent* comp, struct icaltime_span* span, void* data)
 {
-	// Only add the occurrence if it doesn't already exist. Unfortunately this is awkward to check
-	gboolean exists = FALSE;
-	start = icaltime_convert_to_zone(start, icaltimezone_get_utc_timezone());
-	end = icaltime_convert_to_zone(end, icaltimezone_get_utc_timezone());
-	icalcomponent_foreach_recurrence(ev->cmp, start, end, test_occurrence_exists, &exists);
+	start_set_add((GHashTable*) data, span->start);
+}
+
+guint event_add_occurrences(Event* ev, const EventOccurrence* occurrences, guint n)
+{
+	if (n == 0)
+		return 0;
+
+	icaltimezone* utc = icaltimezone_get_utc_timezone();
+	icaltime_span range = {timezone_time_as_timet(occurrences[0].start), timezone_time_as_timet(occurrences[0].end), 0};
+	for (guint i = 1; i < n; ++i) {
+		range.start = MIN(range.start, timezone_time_as_timet(occurrences[i].start));
+		range.end = MAX(range.end, timezone_time_as_timet(occurrences[i].end));
+	}
+	// so that zero-length occurrences at the end are still reported
+	range.end++;
+
+	// Expand the existing occurrences once for all of the new ones, keyed by start time
+	GHashTable* starts = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+	event_foreach_occurrence(ev, range, collect_occurrence_start, starts);
+
+	guint added = 0;
+	for (guint i = 0; i < n; ++i) {
+		icaltimetype start = icaltime_convert_to_zone(occurrences[i].start, utc);
+		icaltimetype end = icaltime_convert_to_zone(occurrences[i].end, utc);
+		gint64 key = icaltime_as_timet(start);
+		if (g_hash_table_contains(starts, &key))
+			continue;
 
-	if (!exists) {
 		struct icaldatetimeperiodtype p = {
 			.time = start,
 			.period = {
@@ -314,7 +745,98 @@ void event_add_occurrence(Event* ev, icaltimetype start, icaltimetype end)
 				.end = end,
 				.duration = icaltime_subtract(end, start)}};
 		icalcomponent_add_property(ev->cmp, icalproperty_new_rdate(p));
+		// also guards against the same occurrence appearing twice in the input
+		start_set_add(starts, key);
+		added++;
+	}
+	g_hash_table_destroy(starts);
+
+	if (added)
+		event_invalidate_occurrences(ev);
+	return added;
+}
+
+void event_add_rrule(Event* ev, struct icalrecurrencetype rule)
+{
+	icalcomponent_add_property(ev->cmp, icalproperty_new_rrule(rule));
+	event_invalidate_occurrences(ev);
+}
+
+void event_add_exdate(Event* ev, icaltimetype exdate)
+{
+	icalcomponent_add_property(ev->cmp, icalproperty_new_exdate(exdate));
+	event_invalidate_occurrences(ev);
+}
+
+void event_clear_recurrence(Event* ev)
+{
+	const icalproperty_kind kinds[] = {ICAL_RRULE_PROPERTY, ICAL_RDATE_PROPERTY, ICAL_EXDATE_PROPERTY};
+	for (guint i = 0; i < G_N_ELEMENTS(kinds); ++i) {
+		icalproperty* p;
+		while ((p = icalcomponent_get_first_property(ev->cmp, kinds[i]))) {
+			icalcomponent_remove_property(ev->cmp, p);
+			icalproperty_free(p);
+		}
 	}
+	event_invalidate_occurrences(ev);
+}
+
+// Slack added to each side of an event's span, covers floating times which
+// are interpreted in whatever the local timezone happens to be
+#define EVENT_SPAN_SLACK (24 * 60 * 60)
+// COUNT rules longer than this are not expanded to find their last occurrence
+#define EVENT_SPAN_MAX_COUNT 5000
+
+static void collect_occurrence_end(icalcomponent* comp, struct icaltime_span* span, void* data)
+{
+	time_t* end = (time_t*) data;
+	if (span->end > *end)
+		*end = span->end;
+}
+
+icaltime_span event_get_span(Event* ev)
+{
+	icaltimetype dtstart = event_get_dtstart(ev), dtend = event_get_dtend(ev);
+	time_t start = timezone_time_as_timet(dtstart);
+	time_t end = icaltime_is_null_time(dtend) ? start : timezone_time_as_timet(dtend);
+	time_t duration = end - start;
+
+	for (icalproperty* p = icalcomponent_get_first_property(ev->cmp, ICAL_RRULE_PROPERTY); p; p = icalcomponent_get_next_property(ev->cmp, ICAL_RRULE_PROPERTY)) {
+		struct icalrecurrencetype rrule = icalproperty_get_rrule(p);
+		if (icaltime_is_null_time(rrule.until)) {
+			// The last occurrence of a COUNT rule in one of the shapes the fast
+			// path handles is cheap to find, anything else is unbounded
+			icaltime_span all = {start - 1, INTERVAL_TREE_UNBOUNDED, 0};
+			if (rrule.count > 0 && rrule.count <= EVENT_SPAN_MAX_COUNT && event_foreach_occurrence_fast(ev, all, collect_occurrence_end, &end))
+				continue;
+			end = INTERVAL_TREE_UNBOUNDED;
+			break;
+		}
+		time_t until = timezone_time_as_timet(rrule.until) + duration;
+		if (until > end)
+			end = until;
+	}
+
+	for (icalproperty* p = icalcomponent_get_first_property(ev->cmp, ICAL_RDATE_PROPERTY); p; p = icalcomponent_get_next_property(ev->cmp, ICAL_RDATE_PROPERTY)) {
+		struct icaldatetimeperiodtype rdate = icalproperty_get_rdate(p);
+		time_t rstart, rend;
+		if (!icaltime_is_null_time(rdate.time)) {
+			rstart = timezone_time_as_timet(icalproperty_get_datetime_with_component(p, ev->cmp));
+			rend = rstart + duration;
+		} else {
+			rstart = timezone_time_as_timet(rdate.period.start);
+			rend = icaltime_is_null_time(rdate.period.end) ? rstart + duration : timezone_time_as_timet(rdate.period.end);
+		}
+		if (rstart < start)
+			start = rstart;
+		if (rend > end)
+			end = rend;
+	}
+
+	icaltime_span span = {.start = start - EVENT_SPAN_SLACK, .end = end, .is_busy = 0};
+	if (end != INTERVAL_TREE_UNBOUNDED)
+		span.end = end + EVENT_SPAN_SLACK;
+	return span;
 }
 
 gboolean event_is_recurring(Event* ev)
@@ -334,6 +856,8 @@ static void event_init(Event* e)
 static void finalize(GObject* obj)
 {
 	Event* ev = FOCAL_EVENT(obj);
+	if (ev->occurrences)
+		g_array_free(ev->occurrences, TRUE);
 	icalcomponent* parent = icalcomponent_get_parent(ev->cmp);
 	if (parent)
 		icalcomponent_free(parent);
@@ -384,6 +908,7 @@ void event_replace_component(Event* ev, icalcomponent* component)
 {
 	icalcomponent_free(ev->cmp);
 	ev->cmp = component;
+	event_invalidate_occurrences(ev);
 }
 
 Event* event_new(const char* summary, icaltimetype dtstart, icaltimetype dtend, const icaltimezone* tz)
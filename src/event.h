@@ -81,7 +81,34 @@ typedef void (*EventRecurrenceCallback)(Event* event, icaltimetype dtstart, stru
 void event_each_recurrence(Event* ev, icaltimezone* tz, icaltime_span range, EventRecurrenceCallback callback, gpointer user);
 gboolean event_is_recurring(Event* ev);
 
-void event_add_occurrence(Event* ev, icaltimetype start, icaltimetype end);
+// Expanded occurrences are cached per event, keyed on a revision which the
+// setters of DTSTART, DTEND and the recurrence properties, as well as
+// event_replace_component, bump. Any code modifying the component returned by
+// event_get_component in a way that affects its occurrences (DTSTART, DTEND,
+// RRULE, RDATE, EXDATE) must call this afterwards to bump it.
+void event_invalidate_occurrences(Event* ev);
+
+// Recurrence setters. Like event_add_occurrences, they do not mark the event
+// dirty, since they are used to apply changes received from a server.
+void event_add_rrule(Event* ev, struct icalrecurrencetype rule);
+void event_add_exdate(Event* ev, icaltimetype exdate);
+// Removes every RRULE, RDATE and EXDATE
+void event_clear_recurrence(Event* ev);
+
+typedef struct {
+	icaltimetype start, end;
+} EventOccurrence;
+
+// Adds each of the given occurrences as an RDATE unless the event already has
+// an occurrence starting at the same time. The existing occurrences are
+// expanded only once for the whole set. Returns the number added.
+guint event_add_occurrences(Event* ev, const EventOccurrence* occurrences, guint n);
+
+// Returns a span guaranteed to contain every occurrence of the event. It may
+// be considerably wider than necessary; recurrences without an UNTIL date are
+// given an end of INTERVAL_TREE_UNBOUNDED, unless they have a COUNT and are
+// simple enough to expand cheaply.
+icaltime_span event_get_span(Event* ev);
 
 // Creates a new Event object by reading the contents of the file at the
 // given path. Returns NULL if the file could not be read or parsed.
@@ -65,7 +65,7 @@ static void save_event(Calendar* c, Event* event)
 	if (!old_event)
 		g_hash_table_insert(lc->events, g_strdup(event_get_uid(event)), event);
 
-	g_signal_emit_by_name(lc, "event-updated", old_event, event);
+	_calendar_event_changed(c, old_event, event);
 
 	write_ical_to_disk(lc);
 }
@@ -73,7 +73,7 @@ static void save_event(Calendar* c, Event* event)
 static void delete_event(Calendar* c, Event* event)
 {
 	IcsCalendar* lc = FOCAL_ICS_CALENDAR(c);
-	g_signal_emit_by_name(lc, "event-updated", event, NULL);
+	_calendar_event_changed(c, event, NULL);
 
 	g_hash_table_remove(lc->events, event_get_uid(event)); // calls event_free
 	write_ical_to_disk(lc);
@@ -122,6 +122,7 @@ static void sync_done(IcsCalendar* ic, const GString* data)
 
 	// TODO how do we know if items were removed spontaneously?
 
+	_calendar_begin_changes(FOCAL_CALENDAR(ic));
 	for (icalcomponent* e = icalcomponent_get_first_component(ic->ical, ICAL_VEVENT_COMPONENT); (e = icalcomponent_get_current_component(ic->ical));) {
 		if (icalcomponent_isa(e) == ICAL_VEVENT_COMPONENT) {
 			// try not to invalidate already known events
@@ -131,12 +132,12 @@ static void sync_done(IcsCalendar* ic, const GString* data)
 			if (existing) {
 				event_replace_component(existing, icalcomponent_new_clone(e));
 				// TODO only if actually modified?
-				g_signal_emit_by_name(ic, "event-updated", existing, existing);
+				_calendar_event_changed(FOCAL_CALENDAR(ic), existing, existing);
 			} else {
 				Event* ev = event_new_from_icalcomponent(icalcomponent_new_clone(e));
 				event_set_calendar(ev, FOCAL_CALENDAR(ic));
 				g_hash_table_insert(ic->events, g_strdup(uid), ev);
-				g_signal_emit_by_name(ic, "event-updated", NULL, ev);
+				_calendar_event_changed(FOCAL_CALENDAR(ic), NULL, ev);
 			}
 			icalcomponent_remove_component(ic->ical, e);
 			icalcomponent_free(e);
@@ -145,6 +146,7 @@ static void sync_done(IcsCalendar* ic, const GString* data)
 		}
 	}
 
+	_calendar_end_changes(FOCAL_CALENDAR(ic));
 	g_signal_emit_by_name(ic, "sync-done", TRUE, 0);
 }
 
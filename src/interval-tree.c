@@ -0,0 +1,197 @@
+/*
+ * interval-tree.c
+ * This file is part of focal, a calendar application for Linux
+ * Copyright 2020 Oliver Giles and focal contributors.
+ *
+ * Focal is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Focal is distributed without any explicit or implied warranty.
+ * You should have received a copy of the GNU General Public License
+ * version 3 with focal. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "interval-tree.h"
+
+typedef struct _Node Node;
+struct _Node {
+	time_t start;
+	time_t end;
+	// largest end of any interval in this subtree
+	time_t max_end;
+	gpointer item;
+	guint32 priority;
+	Node* left;
+	Node* right;
+};
+
+struct _IntervalTree {
+	Node* root;
+	// item -> Node*, needed to find the key of an item being removed
+	GHashTable* nodes;
+	GDestroyNotify item_destroy;
+};
+
+// Orders nodes by start, ties are broken by item address
+static int node_compare(const Node* a, const Node* b)
+{
+	if (a->start != b->start)
+		return a->start < b->start ? -1 : 1;
+	if (a->item != b->item)
+		return (guintptr) a->item < (guintptr) b->item ? -1 : 1;
+	return 0;
+}
+
+static void node_update(Node* n)
+{
+	n->max_end = n->end;
+	if (n->left && n->left->max_end > n->max_end)
+		n->max_end = n->left->max_end;
+	if (n->right && n->right->max_end > n->max_end)
+		n->max_end = n->right->max_end;
+}
+
+static Node* rotate_right(Node* n)
+{
+	Node* l = n->left;
+	n->left = l->right;
+	l->right = n;
+	node_update(n);
+	node_update(l);
+	return l;
+}
+
+static Node* rotate_left(Node* n)
+{
+	Node* r = n->right;
+	n->right = r->left;
+	r->left = n;
+	node_update(n);
+	node_update(r);
+	return r;
+}
+
+static Node* node_insert(Node* root, Node* n)
+{
+	if (!root)
+		return n;
+	if (node_compare(n, root) < 0) {
+		root->left = node_insert(root->left, n);
+		if (root->left->priority > root->priority)
+			root = rotate_right(root);
+	} else {
+		root->right = node_insert(root->right, n);
+		if (root->right->priority > root->priority)
+			root = rotate_left(root);
+	}
+	node_update(root);
+	return root;
+}
+
+// Unlinks n, which must be present in the subtree
+static Node* node_remove(Node* root, Node* n)
+{
+	int c = node_compare(n, root);
+	if (c < 0) {
+		root->left = node_remove(root->left, n);
+	} else if (c > 0) {
+		root->right = node_remove(root->right, n);
+	} else {
+		// rotate the node down until it has at most one child
+		if (!root->left)
+			return root->right;
+		if (!root->right)
+			return root->left;
+		if (root->left->priority > root->right->priority) {
+			root = rotate_right(root);
+			root->right = node_remove(root->right, n);
+		} else {
+			root = rotate_left(root);
+			root->left = node_remove(root->left, n);
+		}
+	}
+	node_update(root);
+	return root;
+}
+
+static void node_query(Node* n, time_t start, time_t end, IntervalTreeFunc func, gpointer user)
+{
+	// nothing in this subtree ends after the query starts
+	if (!n || n->max_end <= start)
+		return;
+	node_query(n->left, start, end, func, user);
+	// this node and everything to its right start after the query ends
+	if (n->start >= end)
+		return;
+	if (n->end > start)
+		func(n->item, user);
+	node_query(n->right, start, end, func, user);
+}
+
+static void node_free(Node* n, GDestroyNotify item_destroy)
+{
+	if (!n)
+		return;
+	node_free(n->left, item_destroy);
+	node_free(n->right, item_destroy);
+	if (item_destroy)
+		item_destroy(n->item);
+	g_free(n);
+}
+
+IntervalTree* interval_tree_new(GDestroyNotify item_destroy)
+{
+	IntervalTree* tree = g_new0(IntervalTree, 1);
+	tree->nodes = g_hash_table_new(NULL, NULL);
+	tree->item_destroy = item_destroy;
+	return tree;
+}
+
+void interval_tree_free(IntervalTree* tree)
+{
+	node_free(tree->root, tree->item_destroy);
+	g_hash_table_destroy(tree->nodes);
+	g_free(tree);
+}
+
+void interval_tree_insert(IntervalTree* tree, time_t start, time_t end, gpointer item)
+{
+	Node* n = g_hash_table_lookup(tree->nodes, item);
+	if (n) {
+		// re-key the existing node without destroying the item
+		tree->root = node_remove(tree->root, n);
+	} else {
+		n = g_new(Node, 1);
+		n->item = item;
+		n->priority = g_random_int();
+		g_hash_table_insert(tree->nodes, item, n);
+	}
+	n->start = start;
+	n->end = end;
+	n->left = n->right = NULL;
+	node_update(n);
+	tree->root = node_insert(tree->root, n);
+}
+
+gboolean interval_tree_remove(IntervalTree* tree, gpointer item)
+{
+	Node* n = g_hash_table_lookup(tree->nodes, item);
+	if (!n)
+		return FALSE;
+	tree->root = node_remove(tree->root, n);
+	g_hash_table_remove(tree->nodes, item);
+	if (tree->item_destroy)
+		tree->item_destroy(item);
+	g_free(n);
+	return TRUE;
+}
+
+guint interval_tree_size(IntervalTree* tree)
+{
+	return g_hash_table_size(tree->nodes);
+}
+
+void interval_tree_query(IntervalTree* tree, time_t start, time_t end, IntervalTreeFunc func, gpointer user)
+{
+	node_query(tree->root, start, end, func, user);
+}
@@ -0,0 +1,47 @@
+/*
+ * interval-tree.h
+ * This file is part of focal, a calendar application for Linux
+ * Copyright 2020 Oliver Giles and focal contributors.
+ *
+ * Focal is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Focal is distributed without any explicit or implied warranty.
+ * You should have received a copy of the GNU General Public License
+ * version 3 with focal. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef INTERVAL_TREE_H
+#define INTERVAL_TREE_H
+
+#include <glib.h>
+#include <time.h>
+
+// IntervalTree maps items to half-open time intervals [start, end) and finds
+// all items overlapping a given interval in O(log n + k). It is implemented as
+// a treap ordered by interval start, augmented with the maximum interval end
+// of each subtree. Each item (compared by pointer) may be present only once.
+typedef struct _IntervalTree IntervalTree;
+
+// An interval ending here is open-ended
+#define INTERVAL_TREE_UNBOUNDED ((time_t) G_MAXINT64)
+
+// The destroy function, if not NULL, is called on items when they are removed
+// and when the tree is freed
+IntervalTree* interval_tree_new(GDestroyNotify item_destroy);
+void interval_tree_free(IntervalTree* tree);
+
+// Adds an item, replacing its interval if it was already present
+void interval_tree_insert(IntervalTree* tree, time_t start, time_t end, gpointer item);
+
+// Returns FALSE if the item was not present
+gboolean interval_tree_remove(IntervalTree* tree, gpointer item);
+
+guint interval_tree_size(IntervalTree* tree);
+
+// Calls func for every item whose interval overlaps [start, end), in order of
+// interval start. The tree must not be modified from within func.
+typedef void (*IntervalTreeFunc)(gpointer item, gpointer user);
+void interval_tree_query(IntervalTree* tree, time_t start, time_t end, IntervalTreeFunc func, gpointer user);
+
+#endif // INTERVAL_TREE_H
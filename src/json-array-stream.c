@@ -0,0 +1,247 @@
+/*
+ * json-array-stream.c
+ * This file is part of focal, a calendar application for Linux
+ * Copyright 2020 Oliver Giles and focal contributors.
+ *
+ * Focal is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Focal is distributed without any explicit or implied warranty.
+ * You should have received a copy of the GNU General Public License
+ * version 3 with focal. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "json-array-stream.h"
+
+#include <string.h>
+
+typedef enum {
+	STATE_START,		// before the top-level object
+	STATE_KEY,			// expecting a member name or the end of the object
+	STATE_IN_KEY,		// within a member name
+	STATE_COLON,		// expecting the colon after a member name
+	STATE_MEMBER_VALUE, // expecting a member value
+	STATE_ARRAY,		// within the array, expecting an element or its end
+	STATE_CAPTURE,		// within a member value or array element being kept
+	STATE_AFTER_MEMBER, // expecting a comma or the end of the object
+	STATE_DONE,
+	STATE_ERROR
+} State;
+
+struct _JsonArrayStream {
+	char* array_member;
+	JsonArrayStreamFunc func;
+	void* user;
+	State state;
+	// string state, only tracked in STATE_IN_KEY and STATE_CAPTURE
+	gboolean in_string;
+	gboolean escape;
+	// whether the capture is an array element rather than a member value
+	gboolean capture_element;
+	// depth of brackets within the capture
+	int nesting;
+	GString* key;
+	GString* capture;
+	// member name -> JSON text of its value
+	GHashTable* members;
+	JsonParser* parser;
+};
+
+JsonArrayStream* json_array_stream_new(const char* array_member, JsonArrayStreamFunc func, void* user)
+{
+	JsonArrayStream* stream = g_new0(JsonArrayStream, 1);
+	stream->array_member = g_strdup(array_member);
+	stream->func = func;
+	stream->user = user;
+	stream->key = g_string_new(NULL);
+	stream->capture = g_string_new(NULL);
+	stream->members = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	stream->parser = json_parser_new();
+	return stream;
+}
+
+void json_array_stream_free(JsonArrayStream* stream)
+{
+	g_free(stream->array_member);
+	g_string_free(stream->key, TRUE);
+	g_string_free(stream->capture, TRUE);
+	g_hash_table_destroy(stream->members);
+	g_object_unref(stream->parser);
+	g_free(stream);
+}
+
+void json_array_stream_reset(JsonArrayStream* stream)
+{
+	stream->state = STATE_START;
+	stream->in_string = stream->escape = FALSE;
+	stream->nesting = 0;
+	g_string_truncate(stream->key, 0);
+	g_string_truncate(stream->capture, 0);
+	g_hash_table_remove_all(stream->members);
+}
+
+gboolean json_array_stream_is_complete(JsonArrayStream* stream)
+{
+	return stream->state == STATE_DONE;
+}
+
+static gboolean is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Tracks string boundaries. Returns TRUE if c is part of a string
+static gboolean consume_string(JsonArrayStream* stream, char c)
+{
+	if (!stream->in_string)
+		return FALSE;
+	if (stream->escape)
+		stream->escape = FALSE;
+	else if (c == '\\')
+		stream->escape = TRUE;
+	else if (c == '"')
+		stream->in_string = FALSE;
+	return TRUE;
+}
+
+static gboolean finish_capture(JsonArrayStream* stream)
+{
+	if (stream->capture_element) {
+		if (!json_parser_load_from_data(stream->parser, stream->capture->str, stream->capture->len, NULL))
+			return FALSE;
+		JsonReader* reader = json_reader_new(json_parser_get_root(stream->parser));
+		stream->func(reader, stream->user);
+		g_object_unref(reader);
+	} else {
+		g_hash_table_insert(stream->members, g_strdup(stream->key->str), g_strdup(stream->capture->str));
+	}
+	g_string_truncate(stream->capture, 0);
+	return TRUE;
+}
+
+static void begin_capture(JsonArrayStream* stream, gboolean element)
+{
+	stream->state = STATE_CAPTURE;
+	stream->capture_element = element;
+	stream->nesting = 0;
+	g_string_truncate(stream->capture, 0);
+}
+
+gboolean json_array_stream_feed(JsonArrayStream* stream, const char* data, gsize len)
+{
+	gsize i = 0;
+	while (i < len && stream->state != STATE_ERROR) {
+		char c = data[i];
+		switch (stream->state) {
+		case STATE_START:
+			if (c == '{')
+				stream->state = STATE_KEY;
+			else if (!is_space(c))
+				stream->state = STATE_ERROR;
+			break;
+		case STATE_KEY:
+			if (c == '"') {
+				g_string_truncate(stream->key, 0);
+				stream->in_string = TRUE;
+				stream->state = STATE_IN_KEY;
+			} else if (c == '}') {
+				stream->state = STATE_DONE;
+			} else if (!is_space(c)) {
+				stream->state = STATE_ERROR;
+			}
+			break;
+		case STATE_IN_KEY:
+			consume_string(stream, c);
+			if (stream->in_string)
+				g_string_append_c(stream->key, c);
+			else
+				stream->state = STATE_COLON;
+			break;
+		case STATE_COLON:
+			if (c == ':')
+				stream->state = STATE_MEMBER_VALUE;
+			else if (!is_space(c))
+				stream->state = STATE_ERROR;
+			break;
+		case STATE_MEMBER_VALUE:
+			if (is_space(c))
+				break;
+			if (c == '[' && strcmp(stream->key->str, stream->array_member) == 0) {
+				stream->state = STATE_ARRAY;
+				break;
+			}
+			begin_capture(stream, FALSE);
+			continue; // the first character of the value
+		case STATE_ARRAY:
+			if (c == ']')
+				stream->state = STATE_AFTER_MEMBER;
+			else if (c != ',' && !is_space(c)) {
+				begin_capture(stream, TRUE);
+				continue;
+			}
+			break;
+		case STATE_CAPTURE:
+			if (consume_string(stream, c)) {
+				g_string_append_c(stream->capture, c);
+				break;
+			}
+			if (stream->nesting == 0 && (c == ',' || c == '}' || c == ']')) {
+				// end of a scalar, the terminator belongs to the enclosing value
+				if (!finish_capture(stream)) {
+					stream->state = STATE_ERROR;
+					break;
+				}
+				stream->state = stream->capture_element ? STATE_ARRAY : STATE_AFTER_MEMBER;
+				continue;
+			}
+			g_string_append_c(stream->capture, c);
+			if (c == '"') {
+				stream->in_string = TRUE;
+			} else if (c == '{' || c == '[') {
+				stream->nesting++;
+			} else if ((c == '}' || c == ']') && --stream->nesting == 0) {
+				if (!finish_capture(stream)) {
+					stream->state = STATE_ERROR;
+					break;
+				}
+				stream->state = stream->capture_element ? STATE_ARRAY : STATE_AFTER_MEMBER;
+			}
+			break;
+		case STATE_AFTER_MEMBER:
+			if (c == ',')
+				stream->state = STATE_KEY;
+			else if (c == '}')
+				stream->state = STATE_DONE;
+			else if (!is_space(c))
+				stream->state = STATE_ERROR;
+			break;
+		case STATE_DONE:
+			if (!is_space(c))
+				stream->state = STATE_ERROR;
+			break;
+		case STATE_ERROR:
+			break;
+		}
+		i++;
+	}
+	return stream->state != STATE_ERROR;
+}
+
+gchar* json_array_stream_dup_string_member(JsonArrayStream* stream, const char* name)
+{
+	const char* text = g_hash_table_lookup(stream->members, name);
+	if (!text)
+		return NULL;
+
+	// wrapped in an array, since a bare scalar is not accepted as a document
+	gchar* doc = g_strdup_printf("[%s]", text);
+	gchar* result = NULL;
+	if (json_parser_load_from_data(stream->parser, doc, -1, NULL)) {
+		JsonArray* array = json_node_get_array(json_parser_get_root(stream->parser));
+		JsonNode* node = json_array_get_length(array) == 1 ? json_array_get_element(array, 0) : NULL;
+		if (node && JSON_NODE_HOLDS_VALUE(node) && json_node_get_value_type(node) == G_TYPE_STRING)
+			result = g_strdup(json_node_get_string(node));
+	}
+	g_free(doc);
+	return result;
+}
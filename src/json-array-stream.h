@@ -0,0 +1,49 @@
+/*
+ * json-array-stream.h
+ * This file is part of focal, a calendar application for Linux
+ * Copyright 2020 Oliver Giles and focal contributors.
+ *
+ * Focal is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Focal is distributed without any explicit or implied warranty.
+ * You should have received a copy of the GNU General Public License
+ * version 3 with focal. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef JSON_ARRAY_STREAM_H
+#define JSON_ARRAY_STREAM_H
+
+#include <json-glib/json-glib.h>
+
+// JsonArrayStream incrementally parses a JSON object of the form
+//   {"value": [{...}, {...}, ...], "other": ...}
+// as it is received, e.g. a page of a Microsoft Graph collection. Each element
+// of the named array member is parsed on its own and handed to a callback as
+// soon as it is complete, so that only one element is ever held in memory
+// rather than the whole document. Other top-level members are kept as text
+// and can be retrieved once the document is complete.
+typedef struct _JsonArrayStream JsonArrayStream;
+
+// Called with a reader positioned at the root of each element of the array.
+// The reader is only valid for the duration of the call.
+typedef void (*JsonArrayStreamFunc)(JsonReader* element, void* user);
+
+JsonArrayStream* json_array_stream_new(const char* array_member, JsonArrayStreamFunc func, void* user);
+void json_array_stream_free(JsonArrayStream* stream);
+
+// Consumes the next part of the document. Returns FALSE if the document is
+// malformed, after which further input is ignored.
+gboolean json_array_stream_feed(JsonArrayStream* stream, const char* data, gsize len);
+
+// Returns TRUE if a complete, well-formed top-level object has been consumed
+gboolean json_array_stream_is_complete(JsonArrayStream* stream);
+
+// Returns a newly allocated copy of a top-level string member other than the
+// array, or NULL if there is no such member or it is not a string
+gchar* json_array_stream_dup_string_member(JsonArrayStream* stream, const char* name);
+
+// Prepares the stream for another document
+void json_array_stream_reset(JsonArrayStream* stream);
+
+#endif // JSON_ARRAY_STREAM_H
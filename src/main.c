@@ -14,6 +14,7 @@
 #include "accounts-dialog.h"
 #include "app-header.h"
 #include "async-curl.h"
+#include "caldav-calendar.h"
 #include "calendar-collection.h"
 #include "calendar-config.h"
 #include "calendar.h"
@@ -21,11 +22,14 @@
 #include "event-popup.h"
 #include "event.h"
 #include "reminder.h"
+#include "secret-cache.h"
+#include "timezone.h"
 #include "week-view.h"
 
 #include <curl/curl.h>
 #include <gtk/gtk.h>
 #include <libical/ical.h>
+#include <stdio.h>
 #include <string.h>
 #include <strings.h>
 
@@ -36,6 +40,8 @@ typedef struct {
 	int week_start_day;
 	int week_end_day;
 	int auto_sync_interval;
+	gboolean http2;
+	int http2_max_streams;
 } FocalPrefs;
 
 struct _FocalApp {
@@ -54,8 +60,6 @@ struct _FocalApp {
 	GtkWidget* popover;
 	GtkWidget* eventDetail;
 	GtkWidget* revealer;
-	int running_syncs;
-	guint sync_timer_id;
 };
 
 enum {
@@ -153,8 +157,12 @@ static void calendar_config_modified(FocalApp* fm, Calendar* cal)
 
 static void calendar_synced(FocalApp* fm)
 {
-	if (--fm->running_syncs == 0) {
+	if (!calendar_collection_is_syncing(fm->calendars)) {
 		app_header_set_sync_in_progress(FOCAL_APP_HEADER(fm->header), FALSE);
+		// shows how well connections are being reused
+		AsyncCurlStats stats;
+		async_curl_get_stats(&stats);
+		printf("network: %lu requests over %lu connections, %lu using HTTP/2\n", stats.requests, stats.connections, stats.http2_requests);
 	}
 }
 static GMenu* create_menu(FocalApp* fm)
@@ -166,18 +174,11 @@ static GMenu* create_menu(FocalApp* fm)
 	return menu_main;
 }
 
-static gboolean do_calendar_sync(FocalApp* fm)
+static void do_calendar_sync(FocalApp* fm)
 {
-	// Don't run if a sync is already in progress
-	if (fm->running_syncs > 0) {
-		g_info("%s", "Ignoring sync request while sync running");
-		return G_SOURCE_CONTINUE;
-	}
-
-	app_header_set_sync_in_progress(FOCAL_APP_HEADER(fm->header), TRUE);
-	fm->running_syncs = g_menu_model_get_n_items(G_MENU_MODEL(fm->calendars));
-	calendar_collection_sync_all(fm->calendars);
-	return G_SOURCE_CONTINUE;
+	// Calendars already syncing are left to finish, the others start now
+	if (calendar_collection_sync_all(fm->calendars) > 0)
+		app_header_set_sync_in_progress(FOCAL_APP_HEADER(fm->header), TRUE);
 }
 
 static void on_accounts_changed(FocalApp* fm)
@@ -200,12 +201,7 @@ static void open_accounts_dialog(GSimpleAction* simple, GVariant* parameter, gpo
 static void apply_preferences(FocalApp* fa)
 {
 	week_view_set_day_span(FOCAL_WEEK_VIEW(fa->weekView), fa->prefs.week_start_day, fa->prefs.week_end_day);
-	if (fa->sync_timer_id)
-		g_source_remove(fa->sync_timer_id);
-	if (fa->prefs.auto_sync_interval) {
-		fa->sync_timer_id = g_timeout_add_seconds(fa->prefs.auto_sync_interval, G_SOURCE_FUNC(do_calendar_sync), fa);
-		g_source_set_name_by_id(fa->sync_timer_id, "[focal] sync_timer");
-	}
+	calendar_collection_set_sync_interval(fa->calendars, fa->prefs.auto_sync_interval);
 }
 
 static void open_prefs_dialog(GSimpleAction* simple, GVariant* parameter, gpointer user_data)
@@ -396,6 +392,8 @@ static void load_preferences(const char* filename, FocalPrefs* out)
 	out->week_start_day = 0;	 // Sunday
 	out->week_end_day = 6;		 // Saturday
 	out->auto_sync_interval = 0; // Auto-sync disabled
+	out->http2 = FALSE;
+	out->http2_max_streams = 0; // libcurl/server default
 
 	GKeyFile* kf = g_key_file_new();
 	GError* err = NULL;
@@ -409,6 +407,9 @@ static void load_preferences(const char* filename, FocalPrefs* out)
 	out->week_start_day = g_key_file_get_integer(kf, "general", "week_start_day", NULL);
 	out->week_end_day = g_key_file_get_integer(kf, "general", "week_end_day", NULL);
 	out->auto_sync_interval = g_key_file_get_integer(kf, "general", "auto_sync_interval", NULL);
+	// no UI for these, they must be set in the file
+	out->http2 = g_key_file_get_boolean(kf, "network", "http2", NULL);
+	out->http2_max_streams = g_key_file_get_integer(kf, "network", "http2_max_streams", NULL);
 	g_key_file_free(kf);
 }
 
@@ -453,7 +454,12 @@ static void focal_startup(GApplication* app)
 	g_free(config_dir);
 
 	fm->accounts = calendar_config_load_from_file(fm->path_accounts);
+	// all accounts' credentials at once, so the first syncs need not each wait
+	// for the secret service in turn
+	if (fm->accounts)
+		secret_cache_prefetch();
 	load_preferences(fm->path_prefs, &fm->prefs);
+	async_curl_set_http2(fm->prefs.http2, fm->prefs.http2_max_streams);
 
 	fm->calendars = calendar_collection_new();
 	g_signal_connect_swapped(fm->calendars, "calendar-added", (GCallback) calendar_added, fm);
@@ -476,14 +482,15 @@ static void focal_shutdown(GApplication* app)
 {
 	FocalApp* fm = FOCAL_APP(app);
 
-	if (fm->sync_timer_id)
-		g_source_remove(fm->sync_timer_id);
 	g_object_unref(fm->calendars);
 	g_slist_free_full(fm->accounts, (GDestroyNotify) calendar_config_free);
 	g_free(fm->path_accounts);
 	g_free(fm->path_prefs);
+	caldav_calendar_cleanup();
 	async_curl_cleanup();
+	secret_cache_cleanup();
 	reminder_cleanup();
+	timezone_cleanup();
 }
 
 static gint focal_cmdline(GApplication* application, GApplicationCommandLine* command_line)
@@ -533,8 +540,6 @@ static void focal_app_class_init(FocalAppClass* klass)
 
 static void focal_app_init(FocalApp* focal)
 {
-	focal->sync_timer_id = 0;
-	focal->running_syncs = 0;
 }
 
 int main(int argc, char** argv)
@@ -27,13 +27,13 @@ static void save_event(Calendar* c, Event* event)
 	if (!old_event)
 		g_hash_table_insert(mc->events, g_strdup(event_get_uid(event)), event);
 
-	g_signal_emit_by_name(mc, "event-updated", old_event, event);
+	_calendar_event_changed(c, old_event, event);
 }
 
 static void delete_event(Calendar* c, Event* event)
 {
 	MemoryCalendar* mc = FOCAL_MEMORY_CALENDAR(c);
-	g_signal_emit_by_name(mc, "event-updated", event, NULL);
+	_calendar_event_changed(c, event, NULL);
 	g_hash_table_remove(mc->events, event_get_uid(event)); // calls event_free
 }
 
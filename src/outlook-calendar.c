@@ -13,14 +13,19 @@
  */
 #include "outlook-calendar.h"
 #include "async-curl.h"
+#include "calendar-cache.h"
+#include "json-array-stream.h"
 #include "oauth2-provider-outlook.h"
 #include "remote-auth-oauth2.h"
+#include "timezone.h"
 #include <curl/curl.h>
 #include <json-glib/json-glib.h>
 #include <libsecret/secret.h>
 #include <stdlib.h>
 #include <string.h>
 
+typedef struct _SyncContext SyncContext;
+
 struct _OutlookCalendar {
 	Calendar parent;
 	const CalendarConfig* cfg;
@@ -29,15 +34,15 @@ struct _OutlookCalendar {
 	gchar* tz;
 	gchar* prefer_tz;
 	icaltimezone* ical_tz;
-	gchar* sync_url;
-	icaltime_span sync_range;
+	// SyncWindow*, every range fetched so far
+	GPtrArray* windows;
+	CalendarCache* cache;
+	// the sync in progress, if any
+	SyncContext* sync;
 };
 
 G_DEFINE_TYPE(OutlookCalendar, outlook_calendar, TYPE_CALENDAR)
 
-// defined in windows-tz-map.gperf
-extern const char* outlook_timezone_to_tzid(const char* windows_name);
-
 struct EachEventContext {
 	CalendarEachEventCallback callback;
 	gpointer user;
@@ -58,6 +63,29 @@ static void each_event(Calendar* c, CalendarEachEventCallback callback, void* us
 	g_hash_table_foreach(oc->events, on_each_event, &ctx);
 }
 
+// Writes the event through to the on-disk cache, if one has been loaded.
+// Graph has no per-event ETag usable for sync, so only the VEVENT is stored.
+static void cache_store_event(OutlookCalendar* oc, Event* ev)
+{
+	if (!oc->cache)
+		return;
+	char* data = icalcomponent_as_ical_string_r(event_get_component(ev));
+	calendar_cache_put(oc->cache, event_get_url(ev), NULL, data);
+	free(data);
+}
+
+static void cache_remove_event(OutlookCalendar* oc, const char* id)
+{
+	if (oc->cache)
+		calendar_cache_remove(oc->cache, id);
+}
+
+static void cache_flush(OutlookCalendar* oc)
+{
+	if (oc->cache)
+		calendar_cache_flush(oc->cache);
+}
+
 typedef struct {
 	OutlookCalendar* oc;
 	char* url;
@@ -82,9 +110,10 @@ static void on_delete_complete(CURL* curl, CURLcode ret, void* user)
 	long response_code;
 	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
 	if (response_code == 204) {
+		cache_remove_event(mc->oc, event_get_url(mc->event));
+		cache_flush(mc->oc);
+		_calendar_event_changed(FOCAL_CALENDAR(mc->oc), mc->event, NULL);
 		g_hash_table_remove(mc->oc->events, event_get_url(mc->event)); // calls event_free
-		// reuse the sync-done event since for now the action is the same -> refresh the UI
-		g_signal_emit_by_name(mc->oc, "sync-done", TRUE, 0);
 	}
 
 	g_free(mc);
@@ -92,14 +121,19 @@ static void on_delete_complete(CURL* curl, CURLcode ret, void* user)
 
 static void do_delete_event(OutlookCalendar* oc, gchar* err, CURL* curl, struct curl_slist* headers, Event* event)
 {
+	if (err) {
+		_calendar_error(FOCAL_CALENDAR(oc), "Failed to delete event: %s", err);
+		g_free(err);
+		return;
+	}
+
 	ModifyContext* pc = g_new0(ModifyContext, 1);
 	pc->oc = oc;
 	pc->event = event;
 	pc->url = g_strdup_printf("https://graph.microsoft.com/v1.0/me/events/%s", event_get_url(event));
 
-	curl_easy_setopt(curl, CURLOPT_URL, pc->url);
 	curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
-	async_curl_add_request(curl, headers, on_delete_complete, pc);
+	async_curl_add_request(curl, pc->url, headers, ASYNC_CURL_PRIORITY_INTERACTIVE, on_delete_complete, pc);
 }
 
 static void delete_event(Calendar* c, Event* event)
@@ -120,9 +154,8 @@ struct icaltimetype icaltime_from_outlook_json(JsonReader* reader)
 
 	json_reader_read_member(reader, "timeZone");
 	const char* zone_str = json_reader_get_string_value(reader);
-	r.zone = icaltimezone_get_builtin_timezone(zone_str);
-	if (!r.zone) // try Windows timezone names
-		r.zone = icaltimezone_get_builtin_timezone(outlook_timezone_to_tzid(zone_str));
+	// may be an Olson or a Windows timezone name
+	r.zone = timezone_lookup(zone_str);
 	json_reader_end_member(reader);
 
 	return r;
@@ -172,6 +205,8 @@ static void populate_event_from_json(Event* e, JsonReader* reader)
 	json_reader_read_member(reader, "end");
 	icalcomponent_set_dtend(event, icaltime_from_outlook_json(reader));
 	json_reader_end_member(reader);
+	// the times are set directly so as not to mark the event dirty
+	event_invalidate_occurrences(e);
 
 	json_reader_read_member(reader, "recurrence");
 	if (json_reader_is_object(reader)) {
@@ -228,7 +263,7 @@ static void populate_event_from_json(Event* e, JsonReader* reader)
 		}
 		json_reader_end_member(reader); //range
 		// TODO: more complicated recurrence
-		icalcomponent_add_property(event, icalproperty_new_rrule(r));
+		event_add_rrule(e, r);
 	}
 	json_reader_end_member(reader);
 
@@ -305,9 +340,10 @@ static void on_create_event_complete(CURL* curl, CURLcode ret, void* user)
 
 		if (mc->requires_add)
 			g_hash_table_insert(mc->oc->events, g_strdup(event_get_url(mc->event)), mc->event);
+		cache_store_event(mc->oc, mc->event);
+		cache_flush(mc->oc);
 
-		// reuse the sync-done event since for now the action is the same -> refresh the UI
-		g_signal_emit_by_name(mc->oc, "sync-done", TRUE, 0);
+		_calendar_event_changed(FOCAL_CALENDAR(mc->oc), mc->requires_add ? NULL : mc->event, mc->event);
 	}
 
 	g_string_free(mc->put_response, TRUE);
@@ -316,6 +352,12 @@ static void on_create_event_complete(CURL* curl, CURLcode ret, void* user)
 
 static void do_outlook_add_event(OutlookCalendar* oc, gchar* err, CURL* curl, struct curl_slist* headers, Event* event)
 {
+	if (err) {
+		_calendar_error(FOCAL_CALENDAR(oc), "Failed to create event: %s", err);
+		g_free(err);
+		return;
+	}
+
 	JsonBuilder* builder = json_builder_new();
 
 	// For properties see https://docs.microsoft.com/en-us/graph/api/resources/event?view=graph-rest-1.0
@@ -388,14 +430,13 @@ static void do_outlook_add_event(OutlookCalendar* oc, gchar* err, CURL* curl, st
 		curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PATCH");
 		sc->url = g_strdup_printf("https://graph.microsoft.com/v1.0/me/events/%s", event_get_url(event));
 	}
-	curl_easy_setopt(curl, CURLOPT_URL, sc->url);
 	curl_easy_setopt(curl, CURLOPT_WRITEDATA, sc->put_response);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_to_gstring);
 	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, sc->payload);
 
 	// debug
 	//curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
-	async_curl_add_request(curl, headers, on_create_event_complete, sc);
+	async_curl_add_request(curl, sc->url, headers, ASYNC_CURL_PRIORITY_INTERACTIVE, on_create_event_complete, sc);
 }
 
 static void add_event(Calendar* c, Event* event)
@@ -404,69 +445,314 @@ static void add_event(Calendar* c, Event* event)
 	remote_auth_new_request(oc->auth, do_outlook_add_event, oc, event);
 }
 
-static void do_outlook_sync(OutlookCalendar* oc, gchar* err, CURL* curl, struct curl_slist* headers);
+static gboolean outlook_is_read_only(Calendar* c)
+{
+	return FALSE;
+}
+
+// Windows fetched more recently than this are not fetched again on navigation
+#define WINDOW_FRESH_SECONDS 300
+// Beyond this, the least recently synced window is forgotten
+#define MAX_WINDOWS 16
+
+// Event properties requested when syncing, see populate_event_from_json and
+// parse_recurrence_info_from_json
+#define SYNC_SELECT "subject,body,start,end,originalStartTimeZone,recurrence,attendees,isCancelled,type,seriesMasterId,originalStart"
+
+// A range which has been fetched, with the deltaLink that returns what has
+// changed within it since
+typedef struct {
+	icaltime_span range;
+	char* delta_link;
+	time_t synced_at;
+} SyncWindow;
+
+typedef struct {
+	gboolean exception;
+	char* seriesMasterId;
+	icaltimetype originalStart, start, end;
+} RecurrenceInfo;
+
+struct _SyncContext {
+	OutlookCalendar* oc;
+	// authentication and other headers, copied for each request
+	struct curl_slist* headers;
+	// parses each page as it is received
+	JsonArrayStream* stream;
+	// seriesMasterId -> GPtrArray of RecurrenceInfo* for the window being fetched
+	GHashTable* recurrences;
+	AsyncCurlPriority priority;
+	// request for the page currently being fetched, NULL while waiting for authentication
+	AsyncCurlRequest* request;
+	// ranges to fetch in order, the first is in progress
+	GArray* ranges;
+};
+
+static void sync_window_free(SyncWindow* w)
+{
+	g_free(w->delta_link);
+	g_free(w);
+}
+
+static gboolean same_range(icaltime_span a, icaltime_span b)
+{
+	return a.start == b.start && a.end == b.end;
+}
+
+static gboolean ranges_contain(GArray* ranges, icaltime_span range)
+{
+	for (guint i = 0; i < ranges->len; ++i) {
+		if (same_range(g_array_index(ranges, icaltime_span, i), range))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static SyncWindow* window_find(OutlookCalendar* oc, icaltime_span range)
+{
+	for (guint i = 0; i < oc->windows->len; ++i) {
+		SyncWindow* w = g_ptr_array_index(oc->windows, i);
+		if (same_range(w->range, range))
+			return w;
+	}
+	return NULL;
+}
+
+static void window_update(OutlookCalendar* oc, icaltime_span range, const char* delta_link)
+{
+	SyncWindow* w = window_find(oc, range);
+	if (!w) {
+		w = g_new0(SyncWindow, 1);
+		w->range = range;
+		g_ptr_array_add(oc->windows, w);
+	}
+	g_free(w->delta_link);
+	w->delta_link = g_strdup(delta_link);
+	w->synced_at = time(NULL);
+
+	if (oc->windows->len > MAX_WINDOWS) {
+		guint oldest = 0;
+		for (guint i = 1; i < oc->windows->len; ++i) {
+			if (((SyncWindow*) g_ptr_array_index(oc->windows, i))->synced_at < ((SyncWindow*) g_ptr_array_index(oc->windows, oldest))->synced_at)
+				oldest = i;
+		}
+		g_ptr_array_remove_index_fast(oc->windows, oldest);
+	}
+}
+
+// The windows are persisted as lines of "start end synced_at deltaLink"
+static void windows_store(OutlookCalendar* oc)
+{
+	if (!oc->cache)
+		return;
+	GString* str = g_string_new(NULL);
+	for (guint i = 0; i < oc->windows->len; ++i) {
+		SyncWindow* w = g_ptr_array_index(oc->windows, i);
+		g_string_append_printf(str, "%" G_GINT64_FORMAT " %" G_GINT64_FORMAT " %" G_GINT64_FORMAT " %s\n", (gint64) w->range.start, (gint64) w->range.end, (gint64) w->synced_at, w->delta_link);
+	}
+	calendar_cache_set_token(oc->cache, "windows", str->str);
+	g_string_free(str, TRUE);
+}
+
+static void windows_load(OutlookCalendar* oc, const char* str)
+{
+	gchar** lines = g_strsplit(str, "\n", -1);
+	for (gchar** line = lines; *line; ++line) {
+		char* p = *line;
+		icaltime_span range;
+		range.start = g_ascii_strtoll(p, &p, 10);
+		range.end = g_ascii_strtoll(p, &p, 10);
+		time_t synced_at = g_ascii_strtoll(p, &p, 10);
+		if (*p != ' ' || !p[1])
+			continue;
+		SyncWindow* w = g_new0(SyncWindow, 1);
+		w->range = range;
+		w->synced_at = synced_at;
+		w->delta_link = g_strdup(p + 1);
+		g_ptr_array_add(oc->windows, w);
+	}
+	g_strfreev(lines);
+}
+
+static char* window_initial_url(icaltime_span range)
+{
+	char buf_from[32], buf_to[32];
+	struct tm tm_from, tm_to;
+	localtime_r(&range.start, &tm_from);
+	localtime_r(&range.end, &tm_to);
+	strftime(buf_from, 24, "%FT00:00:00", &tm_from);
+	strftime(buf_to, 24, "%FT00:00:00", &tm_to);
+	// Only the properties read by sync_process_item. The nextLink and deltaLink
+	// returned carry the selection over to subsequent requests
+	return g_strdup_printf("https://graph.microsoft.com/v1.0/me/calendarView/delta?startDateTime=%s&endDateTime=%s&$select=%s", buf_from, buf_to, SYNC_SELECT);
+}
+
+static void recurrence_info_free(RecurrenceInfo* ri)
+{
+	g_free(ri->seriesMasterId);
+	g_free(ri);
+}
+
+static void sync_context_free(SyncContext* sc)
+{
+	g_hash_table_destroy(sc->recurrences);
+	curl_slist_free_all(sc->headers);
+	json_array_stream_free(sc->stream);
+	g_array_free(sc->ranges, TRUE);
+	g_free(sc);
+}
+
+// Ends the sync, whose last window's changes must already have been ended
+static void sync_finish(SyncContext* sc, gboolean ok)
+{
+	OutlookCalendar* oc = sc->oc;
+	oc->sync = NULL;
+	sync_context_free(sc);
+	g_signal_emit_by_name(oc, "sync-done", ok, 0);
+}
+
+// Abandons a sync which is fetching a page, because it has been superseded.
+// Changes already reported remain valid, and the superseding sync emits
+// sync-done in its place
+static void sync_cancel(OutlookCalendar* oc)
+{
+	SyncContext* sc = oc->sync;
+	async_curl_cancel(sc->request);
+	sync_context_free(sc);
+	oc->sync = NULL;
+	_calendar_end_changes(FOCAL_CALENDAR(oc));
+}
+
+static void on_sync_response(CURL* curl, CURLcode ret, void* user);
+static void sync_process_item(JsonReader* reader, void* user);
+
+static size_t sync_write(char* ptr, size_t size, size_t nmemb, void* user)
+{
+	// a malformed page is reported once it is complete
+	json_array_stream_feed(((SyncContext*) user)->stream, ptr, size * nmemb);
+	return size * nmemb;
+}
+
+static void sync_fetch(SyncContext* sc, CURL* curl, const char* url)
+{
+	json_array_stream_reset(sc->stream);
+	struct curl_slist* headers = NULL;
+	for (struct curl_slist* it = sc->headers; it; it = it->next)
+		headers = curl_slist_append(headers, it->data);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, sc);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, sync_write);
+	sc->request = async_curl_add_request(curl, url, headers, sc->priority, on_sync_response, sc);
+}
+
+// Fetches the first remaining range, using its deltaLink if it has been fetched before
+static void sync_fetch_window(SyncContext* sc, CURL* curl)
+{
+	icaltime_span range = g_array_index(sc->ranges, icaltime_span, 0);
+	SyncWindow* w = window_find(sc->oc, range);
+	char* url = w ? g_strdup(w->delta_link) : window_initial_url(range);
+	// All pages of a window are delivered as a single change set
+	_calendar_begin_changes(FOCAL_CALENDAR(sc->oc));
+	sync_fetch(sc, curl, url);
+	g_free(url);
+}
+
+static void do_outlook_sync(OutlookCalendar* oc, gchar* err, CURL* curl, struct curl_slist* headers, SyncContext* sc);
+
+static void sync_start(OutlookCalendar* oc, GArray* ranges, AsyncCurlPriority priority)
+{
+	SyncContext* sc = g_new0(SyncContext, 1);
+	sc->oc = oc;
+	sc->stream = json_array_stream_new("value", sync_process_item, sc);
+	sc->recurrences = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_ptr_array_unref);
+	sc->ranges = ranges;
+	sc->priority = priority;
+	oc->sync = sc;
+	remote_auth_new_request(oc->auth, do_outlook_sync, oc, sc);
+}
 
 static void outlook_sync(Calendar* c)
 {
 	OutlookCalendar* oc = FOCAL_OUTLOOK_CALENDAR(c);
 	// range has not been set yet with outlook_sync_date_range
-	if (!oc->sync_url) {
+	if (oc->windows->len == 0) {
 		// Date range not yet set. Probably initial sync. Notify done so it will be added to the view. TODO cleaner way?
 		g_signal_emit_by_name(oc, "sync-done", FALSE, 0);
 		return;
 	}
 
-	remote_auth_new_request(oc->auth, do_outlook_sync, oc, NULL);
+	// Every window fetched so far is refreshed. A sync already in progress
+	// takes them on, and its sync-done covers this request
+	GArray* ranges = oc->sync ? oc->sync->ranges : g_array_new(FALSE, FALSE, sizeof(icaltime_span));
+	for (guint i = 0; i < oc->windows->len; ++i) {
+		SyncWindow* w = g_ptr_array_index(oc->windows, i);
+		if (!ranges_contain(ranges, w->range))
+			g_array_append_val(ranges, w->range);
+	}
+	if (!oc->sync)
+		sync_start(oc, ranges, ASYNC_CURL_PRIORITY_BACKGROUND);
 }
 
-static gboolean outlook_is_read_only(Calendar* c)
+// Applies all the occurrences and exceptions received for one series master:
+// an EXDATE for the original start of each exception not already excluded,
+// then an RDATE for each occurrence the master does not already produce.
+// Returns TRUE if the master was modified
+static gboolean apply_recurrences(Event* master, GPtrArray* infos)
 {
-	return FALSE;
-}
+	icalcomponent* cmp = event_get_component(master);
+	gboolean changed = FALSE;
+
+	GHashTable* exdates = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+	for (icalproperty* p = icalcomponent_get_first_property(cmp, ICAL_EXDATE_PROPERTY); p; p = icalcomponent_get_next_property(cmp, ICAL_EXDATE_PROPERTY)) {
+		gint64* t = g_new(gint64, 1);
+		*t = timezone_time_as_timet(icalproperty_get_exdate(p));
+		g_hash_table_add(exdates, t);
+	}
 
-typedef struct {
-	OutlookCalendar* oc;
-	struct curl_slist* headers;
-	GString* resp;
-	GSList* recurrences;
-} SyncContext;
+	EventOccurrence* occurrences = g_new(EventOccurrence, infos->len);
+	for (guint i = 0; i < infos->len; ++i) {
+		RecurrenceInfo* ri = g_ptr_array_index(infos, i);
+		if (ri->exception) {
+			gint64* t = g_new(gint64, 1);
+			*t = timezone_time_as_timet(ri->originalStart);
+			if (g_hash_table_contains(exdates, t)) {
+				g_free(t);
+			} else {
+				event_add_exdate(master, ri->originalStart);
+				g_hash_table_add(exdates, t);
+				changed = TRUE;
+			}
+		}
+		occurrences[i].start = ri->start;
+		occurrences[i].end = ri->end;
+	}
+	g_hash_table_destroy(exdates);
 
-typedef struct {
-	gboolean exception;
-	char* seriesMasterId;
-	icaltimetype originalStart, start, end;
-} RecurrenceInfo;
+	if (event_add_occurrences(master, occurrences, infos->len) > 0)
+		changed = TRUE;
+	g_free(occurrences);
+	return changed;
+}
 
 static void process_event_exceptions(SyncContext* sc)
 {
-	GSList* updated = 0;
-
-	for (GSList* s = sc->recurrences; s; s = s->next) {
-		RecurrenceInfo* ri = (RecurrenceInfo*) s->data;
-		Event* master = g_hash_table_lookup(sc->oc->events, ri->seriesMasterId);
+	GHashTableIter it;
+	const char* master_id;
+	GPtrArray* infos;
+	g_hash_table_iter_init(&it, sc->recurrences);
+	while (g_hash_table_iter_next(&it, (gpointer*) &master_id, (gpointer*) &infos)) {
+		Event* master = g_hash_table_lookup(sc->oc->events, master_id);
 		if (!master) {
 			// Probably the event was cancelled, no need to warn
-			//g_warning("Series master not found: %s", ri->seriesMasterId);
+			//g_warning("Series master not found: %s", master_id);
 			continue;
 		}
 
-		icalcomponent* cmp = event_get_component(master);
-		if (ri->exception) {
-			icalcomponent_add_property(cmp, icalproperty_new_exdate(ri->originalStart));
+		// at most one update per series, however many occurrences were received
+		if (apply_recurrences(master, infos)) {
+			cache_store_event(sc->oc, master);
+			_calendar_event_changed(FOCAL_CALENDAR(sc->oc), master, master);
 		}
-
-		event_add_occurrence(master, ri->start, ri->end);
-		updated = g_slist_append(updated, master);
-
-		// TODO: would be cleaner to provide a descructor for RecurrenceInfo
-		g_free(ri->seriesMasterId);
 	}
-
-	for (GSList* s = updated; s; s = s->next) {
-		g_signal_emit_by_name(sc->oc, "event-updated", s->data, s->data);
-	}
-
-	g_slist_free(updated);
 }
 
 static RecurrenceInfo* parse_recurrence_info_from_json(JsonReader* reader)
@@ -502,144 +788,159 @@ static RecurrenceInfo* parse_recurrence_info_from_json(JsonReader* reader)
 	return ri;
 }
 
+// Handles one element of the "value" array of a page, as soon as it has been received
+static void sync_process_item(JsonReader* reader, void* user)
+{
+	SyncContext* sc = (SyncContext*) user;
+	OutlookCalendar* oc = sc->oc;
+
+	// ignore cancelled events
+	json_reader_read_member(reader, "isCancelled");
+	gboolean isCancelled = json_reader_get_boolean_value(reader);
+	json_reader_end_member(reader);
+	if(isCancelled)
+		return;
+
+	json_reader_read_member(reader, "type");
+	// The API helpfully returns the seriesMaster for occurrences within the requested
+	// range even if the seriesMaster itself is outside the range. We need this so we
+	// can build a normal ical event structure, but we cannot discount the expanded
+	// occurrences returned by the API since there may be extra occurrences (analagous
+	// to RDATE). Later we check whether we already knew about this recurrence and
+	// discard it if so.
+	gboolean do_defer = g_strcmp0(json_reader_get_string_value(reader), "occurrence") == 0 || g_strcmp0(json_reader_get_string_value(reader), "exception") == 0;
+	json_reader_end_member(reader);
+
+	if (do_defer) {
+		RecurrenceInfo* ri = parse_recurrence_info_from_json(reader);
+		if (!ri->seriesMasterId) {
+			recurrence_info_free(ri);
+			return;
+		}
+		GPtrArray* infos = g_hash_table_lookup(sc->recurrences, ri->seriesMasterId);
+		if (!infos) {
+			infos = g_ptr_array_new_with_free_func((GDestroyNotify) recurrence_info_free);
+			g_hash_table_insert(sc->recurrences, g_strdup(ri->seriesMasterId), infos);
+		}
+		g_ptr_array_add(infos, ri);
+	} else {
+		// TODO deduplicate fetching id with populate_event_from_json
+		json_reader_read_member(reader, "id");
+		char* id = strdup(json_reader_get_string_value(reader));
+		json_reader_end_member(reader);
+
+		// Handle removed events
+		gboolean delete = json_reader_read_member(reader, "@removed");
+		json_reader_end_member(reader);
+
+		Event* existing = g_hash_table_lookup(oc->events, id);
+
+		if (delete) {
+			_calendar_event_changed(FOCAL_CALENDAR(oc), existing, NULL);
+			cache_remove_event(oc, id);
+			g_hash_table_remove(oc->events, id);
+		} else if (existing) {
+			// Can't just call populate_event_from_json because currently it assumes
+			// an empty event, i.e. it will *add* elements rather than checking and
+			// updating existing ones. TODO improve this! For now we delete all RRULEs,
+			// RDATEs and EXDATEs
+			event_clear_recurrence(existing);
+			// then repopulate...
+			populate_event_from_json(existing, reader);
+			cache_store_event(oc, existing);
+			_calendar_event_changed(FOCAL_CALENDAR(oc), existing, existing);
+		} else {
+			Event* event = event_new_from_icalcomponent(icalcomponent_new_vevent());
+			populate_event_from_json(event, reader);
+			event_set_calendar(event, FOCAL_CALENDAR(oc));
+			g_hash_table_insert(oc->events, g_strdup(event_get_url(event)), event);
+			cache_store_event(oc, event);
+			_calendar_event_changed(FOCAL_CALENDAR(oc), NULL, event);
+		}
+		free(id);
+	}
+}
+
 static void on_sync_response(CURL* curl, CURLcode ret, void* user)
 {
 	SyncContext* sc = (SyncContext*) user;
 	OutlookCalendar* oc = sc->oc;
+	sc->request = NULL;
 
 	if (ret != CURLE_OK) {
 		_calendar_error(FOCAL_CALENDAR(oc), "Error syncing calendar: %s", curl_easy_strerror(ret));
-		g_string_free(sc->resp, TRUE);
-		free(sc);
-		g_signal_emit_by_name(oc, "sync-done", FALSE, 0);
+		_calendar_end_changes(FOCAL_CALENDAR(oc));
+		sync_finish(sc, FALSE);
 		return;
 	}
 
-	// debug
-	//printf("received: [%s]\n", sc->resp->str);
-
 	long response_code;
 	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
 	if (response_code == 401) {
 		g_warning("401 Unauthorized. Assuming auth token has expired and attempting refresh");
-		g_string_free(sc->resp, TRUE);
-		g_free(sc);
-		remote_auth_invalidate_credential(oc->auth, do_outlook_sync, oc, NULL);
+		// the window is fetched again from the start once reauthenticated
+		g_hash_table_remove_all(sc->recurrences);
+		_calendar_end_changes(FOCAL_CALENDAR(oc));
+		remote_auth_invalidate_credential(oc->auth, do_outlook_sync, oc, sc);
 		return;
 	} else if (response_code != 200) {
 		g_critical("Unexpected response code %ld", response_code);
 	}
 
-	JsonParser* parser = json_parser_new();
-	json_parser_load_from_data(parser, sc->resp->str, sc->resp->len, NULL);
-	JsonReader* reader = json_reader_new(json_parser_get_root(parser));
-
-	json_reader_read_member(reader, "value");
-	for (int i = 0, n = json_reader_count_elements(reader); i < n; ++i) {
-		json_reader_read_element(reader, i);
-
-		// ignore cancelled events
-		json_reader_read_member(reader, "isCancelled");
-		gboolean isCancelled = json_reader_get_boolean_value(reader);
-		json_reader_end_member(reader);
-		if(isCancelled) {
-			json_reader_end_element(reader);
-			continue;
-		}
-
-		json_reader_read_member(reader, "type");
-		// The API helpfully returns the seriesMaster for occurrences within the requested
-		// range even if the seriesMaster itself is outside the range. We need this so we
-		// can build a normal ical event structure, but we cannot discount the expanded
-		// occurrences returned by the API since there may be extra occurrences (analagous
-		// to RDATE). Later we check whether we already knew about this recurrence and
-		// discard it if so.
-		gboolean do_defer = g_strcmp0(json_reader_get_string_value(reader), "occurrence") == 0 || g_strcmp0(json_reader_get_string_value(reader), "exception") == 0;
-		json_reader_end_member(reader);
-
-		if (do_defer) {
-			sc->recurrences = g_slist_append(sc->recurrences, parse_recurrence_info_from_json(reader));
-		} else {
-			// TODO deduplicate fetching id with populate_event_from_json
-			json_reader_read_member(reader, "id");
-			char* id = strdup(json_reader_get_string_value(reader));
-			json_reader_end_member(reader);
-
-			// Handle removed events
-			gboolean delete = json_reader_read_member(reader, "@removed");
-			json_reader_end_member(reader);
-
-			Event* existing = g_hash_table_lookup(oc->events, id);
-
-			if (delete) {
-				g_signal_emit_by_name(oc, "event-updated", existing, NULL);
-				g_hash_table_remove(oc->events, id);
-			} else if (existing) {
-				// Can't just call populate_event_from_json because currently it assumes
-				// an empty event, i.e. it will *add* elements rather than checking and
-				// updating existing ones. TODO improve this! For now we delete all RRULEs,
-				// RDATEs and EXDATEs
-				icalcomponent* cmp = event_get_component(existing);
-				for(icalproperty* p = icalcomponent_get_first_property(cmp, ICAL_RRULE_PROPERTY); p; p = icalcomponent_get_next_property(cmp, ICAL_RRULE_PROPERTY))
-					icalcomponent_remove_property(cmp, p);
-				for(icalproperty* p = icalcomponent_get_first_property(cmp, ICAL_RDATE_PROPERTY); p; p = icalcomponent_get_next_property(cmp, ICAL_RDATE_PROPERTY))
-					icalcomponent_remove_property(cmp, p);
-				for(icalproperty* p = icalcomponent_get_first_property(cmp, ICAL_EXDATE_PROPERTY); p; p = icalcomponent_get_next_property(cmp, ICAL_EXDATE_PROPERTY))
-					icalcomponent_remove_property(cmp, p);
-				// then repopulate...
-				populate_event_from_json(existing, reader);
-				g_signal_emit_by_name(oc, "event-updated", existing, existing);
-			} else {
-				Event* event = event_new_from_icalcomponent(icalcomponent_new_vevent());
-				populate_event_from_json(event, reader);
-				event_set_calendar(event, FOCAL_CALENDAR(oc));
-				g_hash_table_insert(oc->events, g_strdup(event_get_url(event)), event);
-				g_signal_emit_by_name(oc, "event-updated", NULL, event);
-			}
-			free(id);
-		}
-		json_reader_end_element(reader);
-	}
-	json_reader_end_member(reader);
-
 	// Response will either contain @odata.nextLink (more events to fetch)...
-	if (json_reader_read_member(reader, "@odata.nextLink")) {
-		g_string_truncate(sc->resp, 0);
-
-		// TODO try to reuse the handle instead of creating a new one?
-		curl = curl_easy_duphandle(curl);
-		struct curl_slist* headers = NULL;
-		for (struct curl_slist* it = sc->headers; it; it = it->next)
-			headers = curl_slist_append(headers, it->data);
-		curl_easy_setopt(curl, CURLOPT_URL, json_reader_get_string_value(reader));
-		async_curl_add_request(curl, headers, on_sync_response, sc);
-	}
-	json_reader_end_member(reader);
-
+	char* next_link = json_array_stream_dup_string_member(sc->stream, "@odata.nextLink");
 	// ...or @odata.deltaLink, which should be used to fetch incremental updates
-	if (json_reader_read_member(reader, "@odata.deltaLink")) {
-		g_free(oc->sync_url);
-		oc->sync_url = g_strdup(json_reader_get_string_value(reader));
+	char* delta_link = json_array_stream_dup_string_member(sc->stream, "@odata.deltaLink");
+	if (!json_array_stream_is_complete(sc->stream)) {
+		g_free(next_link);
+		g_free(delta_link);
+		next_link = delta_link = NULL;
+	}
 
-		// In this case syncing is done
+	if (next_link) {
+		// This handle is released when the callback returns. A clone keeps the
+		// authentication and the shared connection cache
+		sync_fetch(sc, curl_easy_duphandle(curl), next_link);
+	} else if (delta_link) {
+		// In this case the window is done
 		process_event_exceptions(sc);
-		g_slist_free_full(sc->recurrences, g_free);
-		g_string_free(sc->resp, TRUE);
-		g_free(sc);
-		g_signal_emit_by_name(oc, "sync-done", TRUE, 0);
+		g_hash_table_remove_all(sc->recurrences);
+		window_update(oc, g_array_index(sc->ranges, icaltime_span, 0), delta_link);
+		g_array_remove_index(sc->ranges, 0);
+		windows_store(oc);
+		cache_flush(oc);
+		_calendar_end_changes(FOCAL_CALENDAR(oc));
+
+		if (sc->ranges->len > 0) {
+			// Only the first window can have been asked for by the view, the
+			// rest are refreshed in the background
+			sc->priority = ASYNC_CURL_PRIORITY_BACKGROUND;
+			sync_fetch_window(sc, curl_easy_duphandle(curl));
+		} else {
+			sync_finish(sc, TRUE);
+		}
+	} else {
+		_calendar_error(FOCAL_CALENDAR(oc), "Error syncing calendar: unexpected response");
+		// The deltaLink may have expired, so the window will be fetched anew
+		SyncWindow* w = window_find(oc, g_array_index(sc->ranges, icaltime_span, 0));
+		if (w) {
+			g_ptr_array_remove(oc->windows, w);
+			windows_store(oc);
+			cache_flush(oc);
+		}
+		_calendar_end_changes(FOCAL_CALENDAR(oc));
+		sync_finish(sc, FALSE);
 	}
-	json_reader_end_member(reader);
-
-	g_object_unref(reader);
-	g_object_unref(parser);
+	g_free(next_link);
+	g_free(delta_link);
 }
 
-static void do_outlook_sync(OutlookCalendar* oc, gchar* err, CURL* curl, struct curl_slist* headers)
+static void do_outlook_sync(OutlookCalendar* oc, gchar* err, CURL* curl, struct curl_slist* headers, SyncContext* sc)
 {
 	if (err) {
 		_calendar_error(FOCAL_CALENDAR(oc), "%s", err);
-		g_signal_emit_by_name(oc, "sync-done", FALSE, 0);
 		g_free(err);
+		sync_finish(sc, FALSE);
 		return;
 	}
 
@@ -648,47 +949,114 @@ static void do_outlook_sync(OutlookCalendar* oc, gchar* err, CURL* curl, struct
 	headers = curl_slist_append(headers, "Prefer: outlook.body-content-type=\"text\"");
 	headers = curl_slist_append(headers, oc->prefer_tz);
 
-	SyncContext* sc = g_new0(SyncContext, 1);
-	sc->oc = oc;
-
-	// Save a cheeky reference to the CURL headers so we can lazily duplicate them later
-	// (before the on_sync_response callback exits) without having to request a new auth handle
-	// TODO implement a cleaner API that obviates this?
+	// Kept so that every page and window can be requested without going
+	// through the RemoteAuth again
+	curl_slist_free_all(sc->headers);
 	sc->headers = headers;
 
-	sc->resp = g_string_new(NULL);
+	sync_fetch_window(sc, curl);
+}
 
-	curl_easy_setopt(curl, CURLOPT_URL, oc->sync_url);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, sc->resp);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_to_gstring);
+static void outlook_sync_date_range(Calendar* c, icaltime_span range)
+{
+	OutlookCalendar* oc = FOCAL_OUTLOOK_CALENDAR(c);
+
+	// Nothing to do if the range was fetched recently, e.g. when navigating
+	// back to a week just viewed. Otherwise a range fetched before (possibly
+	// restored from the cache at startup) only needs a delta query
+	SyncWindow* w = window_find(oc, range);
+	if (w && time(NULL) - w->synced_at < WINDOW_FRESH_SECONDS)
+		return;
+	if (oc->sync && oc->sync->request && same_range(g_array_index(oc->sync->ranges, icaltime_span, 0), range))
+		return;
+
+	// The range is fetched first. Windows a sync in progress was refreshing
+	// are kept, but a range it was fetching for the first time has been
+	// navigated away from
+	GArray* ranges = g_array_new(FALSE, FALSE, sizeof(icaltime_span));
+	g_array_append_val(ranges, range);
+	for (guint i = 0; oc->sync && i < oc->sync->ranges->len; ++i) {
+		icaltime_span r = g_array_index(oc->sync->ranges, icaltime_span, i);
+		if (window_find(oc, r) && !ranges_contain(ranges, r))
+			g_array_append_val(ranges, r);
+	}
 
-	async_curl_add_request(curl, headers, on_sync_response, sc);
+	if (oc->sync && !oc->sync->request) {
+		// Still waiting for authentication, so it can simply be redirected
+		g_array_free(oc->sync->ranges, TRUE);
+		oc->sync->ranges = ranges;
+		oc->sync->priority = ASYNC_CURL_PRIORITY_VISIBLE;
+		return;
+	}
+	if (oc->sync)
+		sync_cancel(oc);
+
+	// the range being navigated to is fetched ahead of background syncs
+	sync_start(oc, ranges, ASYNC_CURL_PRIORITY_VISIBLE);
 }
 
-static void outlook_sync_date_range(Calendar* c, icaltime_span range)
+static void load_cached_event(void* user, const char* href, const char* etag, const char* data)
+{
+	OutlookCalendar* oc = (OutlookCalendar*) user;
+	icalcomponent* cmp = icalcomponent_new_from_string(data);
+	if (!cmp)
+		return;
+	Event* event = event_new_from_icalcomponent(cmp);
+	event_set_url(event, href);
+	event_set_calendar(event, FOCAL_CALENDAR(oc));
+	g_hash_table_insert(oc->events, g_strdup(href), event);
+	_calendar_event_changed(FOCAL_CALENDAR(oc), NULL, event);
+}
+
+static gboolean outlook_load_cache(Calendar* c, CalendarCache* cache)
 {
 	OutlookCalendar* oc = FOCAL_OUTLOOK_CALENDAR(c);
+	oc->cache = cache;
 
-	char buf_from[32], buf_to[32];
-	struct tm tm_from, tm_to;
-	localtime_r(&range.start, &tm_from);
-	localtime_r(&range.end, &tm_to);
-	strftime(buf_from, 24, "%FT00:00:00", &tm_from);
-	strftime(buf_to, 24, "%FT00:00:00", &tm_to);
+	char* windows = calendar_cache_get_token(cache, "windows");
+	if (windows) {
+		windows_load(oc, windows);
+		g_free(windows);
+	} else {
+		// written by earlier versions, which kept a single window
+		char* delta_link = calendar_cache_get_token(cache, "delta-link");
+		char* range_start = calendar_cache_get_token(cache, "range-start");
+		char* range_end = calendar_cache_get_token(cache, "range-end");
+		if (delta_link && range_start && range_end) {
+			SyncWindow* w = g_new0(SyncWindow, 1);
+			w->range.start = g_ascii_strtoll(range_start, NULL, 10);
+			w->range.end = g_ascii_strtoll(range_end, NULL, 10);
+			w->delta_link = delta_link;
+			g_ptr_array_add(oc->windows, w);
+		} else {
+			g_free(delta_link);
+		}
+		g_free(range_start);
+		g_free(range_end);
+	}
 
-	g_free(oc->sync_url);
-	oc->sync_url = g_strdup_printf("https://graph.microsoft.com/v1.0/me/calendarView/delta?startDateTime=%s&endDateTime=%s", buf_from, buf_to);
-	oc->sync_range = range;
+	if (oc->windows->len > 0) {
+		_calendar_begin_changes(c);
+		calendar_cache_each(cache, load_cached_event, oc);
+		_calendar_end_changes(c);
+	} else {
+		calendar_cache_clear(cache);
+	}
 
-	remote_auth_new_request(oc->auth, do_outlook_sync, oc, NULL);
+	return g_hash_table_size(oc->events) > 0;
 }
 
 static void finalize(GObject* gobject)
 {
 	OutlookCalendar* oc = FOCAL_OUTLOOK_CALENDAR(gobject);
+	// without sync_cancel, which would report changes from a dying calendar
+	if (oc->sync && oc->sync->request) {
+		async_curl_cancel(oc->sync->request);
+		sync_context_free(oc->sync);
+	}
 	g_object_unref(oc->auth);
 	g_hash_table_destroy(oc->events);
-	g_free(oc->sync_url);
+	g_ptr_array_free(oc->windows, TRUE);
 	g_free(oc->tz);
 	g_free(oc->prefer_tz);
 	G_OBJECT_CLASS(outlook_calendar_parent_class)->finalize(gobject);
@@ -711,6 +1079,7 @@ void outlook_calendar_class_init(OutlookCalendarClass* klass)
 	FOCAL_CALENDAR_CLASS(klass)->sync = outlook_sync;
 	FOCAL_CALENDAR_CLASS(klass)->read_only = outlook_is_read_only;
 	FOCAL_CALENDAR_CLASS(klass)->sync_date_range = outlook_sync_date_range;
+	FOCAL_CALENDAR_CLASS(klass)->load_cache = outlook_load_cache;
 	FOCAL_CALENDAR_CLASS(klass)->attach_authenticator = attach_authenticator;
 	G_OBJECT_CLASS(klass)->finalize = finalize;
 }
@@ -720,13 +1089,10 @@ Calendar* outlook_calendar_new(CalendarConfig* cfg)
 	OutlookCalendar* oc = g_object_new(OUTLOOK_CALENDAR_TYPE, "auth", g_object_new(REMOTE_AUTH_OAUTH2_TYPE, "cfg", cfg, "provider", g_object_new(TYPE_OAUTH2_PROVIDER_OUTLOOK, NULL), NULL), NULL);
 	oc->cfg = cfg;
 	oc->events = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_object_unref);
-	oc->sync_url = NULL;
+	oc->windows = g_ptr_array_new_with_free_func((GDestroyNotify) sync_window_free);
 
-	// TODO: error handling
-	char* localtime_link = realpath("/etc/localtime", NULL);
-	oc->tz = g_strdup(localtime_link + strlen("/usr/share/zoneinfo/"));
-	free(localtime_link);
-	oc->ical_tz = icaltimezone_get_builtin_timezone(oc->tz);
+	oc->tz = g_strdup(timezone_get_local_location());
+	oc->ical_tz = timezone_get_local();
 	oc->prefer_tz = g_strdup_printf("Prefer: outlook.timezone=\"%s\"", oc->tz);
 
 	return FOCAL_CALENDAR(oc);
@@ -12,7 +12,9 @@
  * version 3 with focal. If not, see <http://www.gnu.org/licenses/>.
  */
 #include "reminder.h"
+#include "calendar-collection.h"
 #include "calendar.h"
+#include "timezone.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -21,6 +23,13 @@ static icaltimezone* current_tz;
 static icaltimetype now;
 static icaltime_span notify_range;
 static GHashTable* reminders;
+static CalendarCollection* collection;
+static guint rescan_source_id;
+
+// Individual changes are applied as they are reported, but the window of
+// upcoming events moves with time, so all calendars are rescanned regularly.
+// Must be well below the length of notify_range.
+#define RESCAN_INTERVAL_SECONDS 3600
 
 typedef struct {
 	time_t at;
@@ -127,33 +136,58 @@ static void notification_free(Reminder* rem)
 	g_free(rem);
 }
 
-static void update_notifications(CalendarCollection* cc, gboolean success, Calendar* c)
+static void update_notifications(Calendar* c)
 {
-	if (!success)
-		return;
-
 	g_assert_nonnull(reminders);
 	update_current_time();
 
 	g_hash_table_foreach(reminders, notification_mark_unknown, c);
-	calendar_each_event(c, check_event_add_notification, NULL);
+	calendar_each_event_in_range(c, notify_range, check_event_add_notification, NULL);
 	g_hash_table_foreach_remove(reminders, notification_is_unknown, NULL);
 }
 
+static void calendar_added(CalendarCollection* cc, Calendar* c)
+{
+	update_notifications(c);
+}
+
+static void events_changed(CalendarCollection* cc, const CalendarChanges* changes, Calendar* c)
+{
+	g_assert_nonnull(reminders);
+	update_current_time();
+
+	for (guint i = 0; i < changes->changes->len; ++i) {
+		CalendarEventChange* change = &g_array_index(changes->changes, CalendarEventChange, i);
+		if (change->old_event)
+			g_hash_table_remove(reminders, change->old_event);
+		if (change->new_event)
+			check_event_add_notification(NULL, change->new_event);
+	}
+}
+
+static gboolean rescan_all(gpointer user)
+{
+	calendar_collection_foreach (it, collection) {
+		update_notifications(it.cal);
+	}
+	return G_SOURCE_CONTINUE;
+}
+
 void reminder_init(CalendarCollection* cc)
 {
 	g_assert_null(current_tz);
 	g_assert_null(reminders);
 
-	char* zoneinfo_link = realpath("/etc/localtime", NULL);
-	current_tz = icaltimezone_get_builtin_timezone(zoneinfo_link + strlen("/usr/share/zoneinfo/"));
-	free(zoneinfo_link);
+	current_tz = timezone_get_local();
 
 	update_current_time();
 
 	reminders = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify) notification_free);
 
-	g_signal_connect(cc, "sync-done", (GCallback) update_notifications, NULL);
+	collection = cc;
+	g_signal_connect(cc, "calendar-added", (GCallback) calendar_added, NULL);
+	g_signal_connect(cc, "events-changed", (GCallback) events_changed, NULL);
+	rescan_source_id = g_timeout_add_seconds(RESCAN_INTERVAL_SECONDS, rescan_all, NULL);
 }
 
 void reminder_sync_notifications(GSList* calendars)
@@ -163,6 +197,8 @@ void reminder_sync_notifications(GSList* calendars)
 void reminder_cleanup(void)
 {
 	g_assert_nonnull(reminders);
+	g_source_remove(rescan_source_id);
+	collection = NULL;
 	g_hash_table_destroy(reminders);
 	reminders = NULL;
 }
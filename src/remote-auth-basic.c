@@ -12,7 +12,9 @@
  * version 3 with focal. If not, see <http://www.gnu.org/licenses/>.
  */
 #include "remote-auth-basic.h"
+#include "async-curl.h"
 #include "calendar-config.h"
+#include "secret-cache.h"
 #include <libsecret/secret.h>
 
 typedef struct {
@@ -24,7 +26,13 @@ typedef struct {
 struct _RemoteAuthBasic {
 	RemoteAuth parent;
 	CalendarConfig* cfg;
-	DeferredFunc* ctx;
+	// requests waiting for the password
+	GQueue* waiting;
+	// the password is being looked up. Requests made in the meantime wait for it
+	gboolean acquiring;
+	// kept after the first successful lookup until a request is rejected
+	gchar* password;
+	guint deliver_source;
 };
 G_DEFINE_TYPE(RemoteAuthBasic, remote_auth_basic, TYPE_REMOTE_AUTH)
 
@@ -68,15 +76,60 @@ static char* prompt_user_credentials(GtkWindow* parent, const char* account_name
 	return res;
 }
 
-static void on_password_lookup(GObject* source, GAsyncResult* result, gpointer user);
+static void on_password_lookup(gchar* password, GError* error, gpointer user);
 
 static void password_lookup(RemoteAuthBasic* ba)
 {
 	CalendarConfig* cfg = ba->cfg;
-	secret_password_lookup(&focal_basic_schema, NULL, on_password_lookup, ba,
-						   "url", cfg->location,
-						   "user", cfg->login,
-						   NULL);
+	secret_cache_lookup(&focal_basic_schema, on_password_lookup, ba,
+						"url", cfg->location,
+						"user", cfg->login,
+						NULL);
+}
+
+// Invokes the callbacks of all waiting requests with the cached password
+static void deliver_password(RemoteAuthBasic* ba)
+{
+	CalendarConfig* cfg = ba->cfg;
+	ba->acquiring = FALSE;
+	// A callback may invalidate the password, whereupon requests made after it
+	// must wait for the next lookup
+	GQueue* waiting = ba->waiting;
+	ba->waiting = g_queue_new();
+	for (DeferredFunc* dfc; (dfc = g_queue_pop_head(waiting));) {
+		CURL* curl = async_curl_new_handle();
+		g_assert_nonnull(curl);
+		curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_ANY);
+		curl_easy_setopt(curl, CURLOPT_USERNAME, cfg->login);
+		curl_easy_setopt(curl, CURLOPT_PASSWORD, ba->password);
+		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1);
+		struct curl_slist* hdrs = curl_slist_append(NULL, "User-Agent: Focal/0.1");
+		(*dfc->callback)(dfc->user, NULL, curl, hdrs, dfc->arg);
+		g_free(dfc);
+	}
+	g_queue_free(waiting);
+}
+
+// Fails all waiting requests, invoking their callbacks with (a copy of) the
+// error message and no CURL handle
+static void fail_waiting(RemoteAuthBasic* ba, const char* message)
+{
+	ba->acquiring = FALSE;
+	GQueue* waiting = ba->waiting;
+	ba->waiting = g_queue_new();
+	for (DeferredFunc* dfc; (dfc = g_queue_pop_head(waiting));) {
+		(*dfc->callback)(dfc->user, g_strdup(message), NULL, NULL, dfc->arg);
+		g_free(dfc);
+	}
+	g_queue_free(waiting);
+}
+
+static void clear_password(RemoteAuthBasic* ba)
+{
+	if (ba->password) {
+		secret_password_free(ba->password);
+		ba->password = NULL;
+	}
 }
 
 static void on_password_stored(GObject* source, GAsyncResult* result, gpointer user)
@@ -86,28 +139,24 @@ static void on_password_stored(GObject* source, GAsyncResult* result, gpointer u
 	secret_password_store_finish(result, &error);
 	if (error != NULL) {
 		g_warning("%s", error->message);
+		// cancel current operations
+		fail_waiting(ba, error->message);
 		g_error_free(error);
-		// cancel current operation
-		g_free(ba->ctx);
-		ba->ctx = NULL;
 	} else {
 		// immediately look up the password again so we can continue the originally
-		// requested async operation
+		// requested async operations
 		password_lookup(ba);
 	}
 }
 
-static void on_password_lookup(GObject* source, GAsyncResult* result, gpointer user)
+static void on_password_lookup(gchar* password, GError* error, gpointer user)
 {
-	GError* error = NULL;
-	gchar* password = secret_password_lookup_finish(result, &error);
 	RemoteAuthBasic* ba = (RemoteAuthBasic*) user;
-	DeferredFunc* dfc = ba->ctx;
 	CalendarConfig* cfg = ba->cfg;
 
 	if (error != NULL) {
 		g_critical("%s", error->message);
-		g_error_free(error);
+		fail_waiting(ba, error->message);
 	} else if (password == NULL) {
 		// no matching password found, prompt the user to create one
 		GtkWindow* window = gtk_application_get_active_window(GTK_APPLICATION(g_application_get_default()));
@@ -123,39 +172,103 @@ static void on_password_lookup(GObject* source, GAsyncResult* result, gpointer u
 								  "user", cfg->login,
 								  NULL);
 			g_free(pass);
-			// skip free of dfc, it will be cleaned up in on_password_stored callback
+			// the waiting requests continue in the on_password_stored callback
 			return;
 		} else {
 			// user declined to enter password
+			fail_waiting(ba, "Authentication cancelled");
 			g_signal_emit_by_name(ba, "cancelled", NULL);
 		}
 	} else {
-		CURL* curl = curl_easy_init();
-		g_assert_nonnull(curl);
-		curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_ANY);
-		curl_easy_setopt(curl, CURLOPT_USERNAME, cfg->login);
-		curl_easy_setopt(curl, CURLOPT_PASSWORD, password);
-		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1);
-		struct curl_slist* hdrs = curl_slist_append(NULL, "User-Agent: Focal/0.1");
-		(*dfc->callback)(dfc->user, curl, hdrs, dfc->arg);
-		secret_password_free(password);
+		clear_password(ba);
+		ba->password = password;
+		deliver_password(ba);
 	}
-	g_free(dfc);
-	ba->ctx = NULL;
+}
+
+static gboolean on_deliver_idle(gpointer user)
+{
+	RemoteAuthBasic* ba = (RemoteAuthBasic*) user;
+	ba->deliver_source = 0;
+	// otherwise the password was invalidated meanwhile, and the waiting
+	// requests are served once it has been looked up again
+	if (!ba->acquiring)
+		deliver_password(ba);
+	return G_SOURCE_REMOVE;
 }
 
 static void remote_auth_basic_new_request(RemoteAuth* ra, void (*callback)(), void* user, void* arg)
 {
 	RemoteAuthBasic* ba = FOCAL_REMOTE_AUTH_BASIC(ra);
-	g_assert_null(ba->ctx);
-	ba->ctx = g_new0(DeferredFunc, 1);
-	ba->ctx->callback = callback;
-	ba->ctx->user = user;
-	ba->ctx->arg = arg;
+	DeferredFunc* dfc = g_new0(DeferredFunc, 1);
+	dfc->callback = callback;
+	dfc->user = user;
+	dfc->arg = arg;
+	g_queue_push_tail(ba->waiting, dfc);
 
+	// share the lookup already in progress
+	if (ba->acquiring)
+		return;
+
+	if (ba->password) {
+		// Callers expect the callback to be invoked asynchronously
+		if (!ba->deliver_source)
+			ba->deliver_source = g_idle_add(on_deliver_idle, ba);
+		return;
+	}
+
+	ba->acquiring = TRUE;
 	password_lookup(ba);
 }
 
+static void on_password_cleared(GObject* source, GAsyncResult* result, gpointer user)
+{
+	GError* error = NULL;
+	secret_password_clear_finish(result, &error);
+	RemoteAuthBasic* ba = (RemoteAuthBasic*) user;
+
+	if (error != NULL) {
+		g_critical("%s", error->message);
+		fail_waiting(ba, error->message);
+		g_error_free(error);
+	} else {
+		// finds nothing, so the user is prompted for the password
+		password_lookup(ba);
+	}
+}
+
+static void remote_auth_basic_invalidate_credential(RemoteAuth* ra, void (*callback)(), void* user, void* arg)
+{
+	RemoteAuthBasic* ba = FOCAL_REMOTE_AUTH_BASIC(ra);
+	DeferredFunc* dfc = g_new0(DeferredFunc, 1);
+	dfc->callback = callback;
+	dfc->user = user;
+	dfc->arg = arg;
+	g_queue_push_tail(ba->waiting, dfc);
+
+	if (ba->acquiring)
+		return;
+
+	// The server rejected the password, remove it from the store too
+	clear_password(ba);
+	ba->acquiring = TRUE;
+	CalendarConfig* cfg = ba->cfg;
+	secret_password_clear(&focal_basic_schema, NULL, on_password_cleared, ba,
+						  "url", cfg->location,
+						  "user", cfg->login,
+						  NULL);
+}
+
+static void finalize(GObject* gobject)
+{
+	RemoteAuthBasic* ba = FOCAL_REMOTE_AUTH_BASIC(gobject);
+	if (ba->deliver_source)
+		g_source_remove(ba->deliver_source);
+	g_queue_free_full(ba->waiting, g_free);
+	clear_password(ba);
+	G_OBJECT_CLASS(remote_auth_basic_parent_class)->finalize(gobject);
+}
+
 enum {
 	PROP_0,
 	PROP_CALENDAR_CONFIG,
@@ -169,11 +282,14 @@ static void set_property(GObject* object, guint prop_id, const GValue* value, GP
 
 void remote_auth_basic_class_init(RemoteAuthBasicClass* klass)
 {
+	G_OBJECT_CLASS(klass)->finalize = finalize;
 	G_OBJECT_CLASS(klass)->set_property = set_property;
 	g_object_class_override_property(G_OBJECT_CLASS(klass), PROP_CALENDAR_CONFIG, "cfg");
 	FOCAL_REMOTE_AUTH_CLASS(klass)->new_request = remote_auth_basic_new_request;
+	FOCAL_REMOTE_AUTH_CLASS(klass)->invalidate_credential = remote_auth_basic_invalidate_credential;
 }
 
 void remote_auth_basic_init(RemoteAuthBasic* rab)
 {
+	rab->waiting = g_queue_new();
 }
@@ -15,6 +15,7 @@
 #include "async-curl.h"
 #include "calendar-config.h"
 #include "oauth2-provider.h"
+#include "secret-cache.h"
 #include <json-glib/json-glib.h>
 #include <libsecret/secret.h>
 #include <string.h>
@@ -28,10 +29,24 @@ typedef struct {
 struct _RemoteAuthOAuth2 {
 	RemoteAuth parent;
 	CalendarConfig* cfg;
-	DeferredFunc* ctx;
+	// requests waiting for an access token
+	GQueue* waiting;
+	// an access token is being looked up or requested. All requests made in the
+	// meantime wait for it rather than starting an acquisition of their own
+	gboolean acquiring;
 	GString* response_body;
 	OAuth2Provider* provider;
 	gchar* cookie;
+	// the current access token and its expiry in seconds since the epoch, or 0
+	// if unknown (a token stored by an older version)
+	gchar* access_token;
+	gint64 expires_at;
+	// kept after the first lookup, NULL if not yet known
+	gchar* refresh_token;
+	guint refresh_source;
+	// seconds until a refresh that could not reach the server is retried
+	guint retry_delay;
+	guint deliver_source;
 };
 G_DEFINE_TYPE(RemoteAuthOAuth2, remote_auth_oauth2, TYPE_REMOTE_AUTH)
 
@@ -43,7 +58,16 @@ static const SecretSchema focal_oauth2_schema = {
 											  {"NULL", 0},
 										  }};
 
+// The access token is refreshed this long before it expires
+#define REFRESH_MARGIN_SECONDS 300
+
+// A refresh that could not reach the server is retried after this long,
+// doubling on each further failure
+#define RETRY_MIN_SECONDS 30
+#define RETRY_MAX_SECONDS 900
+
 static void on_request_access_token_complete(CURL* curl, CURLcode ret, void* user);
+static void refresh_token_lookup(RemoteAuthOAuth2* ra);
 
 // Callback when focal is invoked via OAuth2 redirect custom URL scheme, e.g.
 //  /path/to/focal net.ohwg.focal:/auth/google?code=...
@@ -55,17 +79,16 @@ static void on_external_browser_response(void* user_data, const gchar* cookie, c
 	// Every instance of RemoteAuth receives this callback. Check that this event was really
 	// intended for us by comparing the cookie attached to the event
 	if (ba->cookie && g_strcmp0(ba->cookie, cookie) == 0) {
-		CURL* curl = curl_easy_init();
+		CURL* curl = async_curl_new_handle();
 		g_assert_nonnull(curl);
 		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1);
 		g_string_truncate(ba->response_body, 0);
 		curl_easy_setopt(curl, CURLOPT_WRITEDATA, ba->response_body);
 		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_to_gstring);
-		curl_easy_setopt(curl, CURLOPT_URL, oauth2_provider_token_url(ba->provider));
 		gchar* query = oauth2_provider_auth_code_query(ba->provider, code, cookie);
 		g_assert_nonnull(query);
 		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, query);
-		async_curl_add_request(curl, NULL, on_request_access_token_complete, ba);
+		async_curl_add_request(curl, oauth2_provider_token_url(ba->provider), NULL, ASYNC_CURL_PRIORITY_INTERACTIVE, on_request_access_token_complete, ba);
 	}
 }
 
@@ -86,62 +109,140 @@ static void launch_external_authentication(RemoteAuthOAuth2* oa)
 		g_error("Could not launch web browser: %s", error->message);
 }
 
-static void on_access_token_lookup_complete(GObject* source, GAsyncResult* result, gpointer user);
+static void on_access_token_lookup_complete(gchar* token, GError* error, gpointer user);
 
 static void access_token_lookup(RemoteAuthOAuth2* oa)
 {
 	CalendarConfig* cfg = oa->cfg;
-	secret_password_lookup(&focal_oauth2_schema, NULL, on_access_token_lookup_complete, oa,
-						   "type", "access",
-						   "email", cfg->email,
-						   NULL);
+	secret_cache_lookup(&focal_oauth2_schema, on_access_token_lookup_complete, oa,
+						"type", "access",
+						"email", cfg->email,
+						NULL);
 }
 
-static void on_access_token_stored(GObject* source, GAsyncResult* result, gpointer user)
+static void on_token_stored(GObject* source, GAsyncResult* result, gpointer user)
 {
 	GError* error = NULL;
 	secret_password_store_finish(result, &error);
 	if (error != NULL) {
 		g_critical("%s", error->message);
 		g_error_free(error);
-	} else {
-		// fetch the auth token again so we can continue with the original async request
-		access_token_lookup(FOCAL_REMOTE_AUTH_OAUTH2(user));
 	}
 }
 
-static void on_refresh_token_stored(GObject* source, GAsyncResult* result, gpointer user)
+static gboolean token_is_fresh(RemoteAuthOAuth2* oa)
 {
-	GError* error = NULL;
-	secret_password_store_finish(result, &error);
-	if (error != NULL) {
-		g_critical("%s", error->message);
-		g_error_free(error);
+	return oa->expires_at == 0 || g_get_real_time() / G_USEC_PER_SEC < oa->expires_at - REFRESH_MARGIN_SECONDS;
+}
+
+// Invokes the callbacks of all waiting requests with the current access token
+static void deliver_access_token(RemoteAuthOAuth2* oa)
+{
+	oa->acquiring = FALSE;
+	char* auth_header = g_strdup_printf("Authorization: Bearer %s", oa->access_token);
+	// A callback may invalidate the token, whereupon requests made after it
+	// must wait for the next one
+	GQueue* waiting = oa->waiting;
+	oa->waiting = g_queue_new();
+	for (DeferredFunc* df; (df = g_queue_pop_head(waiting));) {
+		CURL* curl = async_curl_new_handle();
+		g_assert_nonnull(curl);
+		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1);
+		struct curl_slist* hdrs = curl_slist_append(NULL, "User-Agent: Focal/0.1");
+		hdrs = curl_slist_append(hdrs, auth_header);
+		(*df->callback)(df->user, NULL, curl, hdrs, df->arg);
+		g_free(df);
 	}
+	g_queue_free(waiting);
+	g_free(auth_header);
+}
+
+// Fails all waiting requests, invoking their callbacks with (a copy of) the
+// error message and no CURL handle
+static void fail_waiting(RemoteAuthOAuth2* oa, const char* message)
+{
+	oa->acquiring = FALSE;
+	GQueue* waiting = oa->waiting;
+	oa->waiting = g_queue_new();
+	for (DeferredFunc* df; (df = g_queue_pop_head(waiting));) {
+		(*df->callback)(df->user, g_strdup(message), NULL, NULL, df->arg);
+		g_free(df);
+	}
+	g_queue_free(waiting);
+}
+
+static gboolean on_refresh_due(gpointer user)
+{
+	RemoteAuthOAuth2* oa = (RemoteAuthOAuth2*) user;
+	oa->refresh_source = 0;
+	// in the background, so that no request has to wait for it or fail first
+	if (!oa->acquiring) {
+		oa->acquiring = TRUE;
+		refresh_token_lookup(oa);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+// Makes token the current access token and schedules its refresh
+static void set_access_token(RemoteAuthOAuth2* oa, const char* token, gint64 expires_at)
+{
+	g_free(oa->access_token);
+	oa->access_token = g_strdup(token);
+	oa->expires_at = expires_at;
+
+	if (oa->refresh_source) {
+		g_source_remove(oa->refresh_source);
+		oa->refresh_source = 0;
+	}
+	if (expires_at) {
+		gint64 delay = expires_at - REFRESH_MARGIN_SECONDS - g_get_real_time() / G_USEC_PER_SEC;
+		oa->refresh_source = g_timeout_add_seconds(MAX(delay, 0), on_refresh_due, oa);
+	}
+}
+
+static void clear_access_token(RemoteAuthOAuth2* oa)
+{
+	set_access_token(oa, NULL, 0);
 }
 
 static void on_request_access_token_complete(CURL* curl, CURLcode ret, void* user)
 {
+	RemoteAuthOAuth2* oa = (RemoteAuthOAuth2*) user;
+
 	if (ret != CURLE_OK) {
-		// TODO better handling
-		g_error("CURL NOK");
+		// e.g. offline, or just resumed. The current token remains in use
+		// until it expires, and the refresh is tried again later
+		g_warning("OAuth2 token request failed: %s", curl_easy_strerror(ret));
+		oa->retry_delay = oa->retry_delay ? MIN(oa->retry_delay * 2, RETRY_MAX_SECONDS) : RETRY_MIN_SECONDS;
+		if (oa->access_token) {
+			if (oa->refresh_source)
+				g_source_remove(oa->refresh_source);
+			oa->refresh_source = g_timeout_add_seconds(oa->retry_delay, on_refresh_due, oa);
+		}
+		char* message = g_strdup_printf("Could not obtain access token: %s", curl_easy_strerror(ret));
+		fail_waiting(oa, message);
+		g_free(message);
 		return;
 	}
+	oa->retry_delay = 0;
 
-	RemoteAuthOAuth2* oa = (RemoteAuthOAuth2*) user;
 	long response_code;
 	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
 
 	if (response_code == 400) {
-		// invoke original handler
-		(*oa->ctx->callback)(oa->ctx->user, g_strdup(oa->response_body->str), NULL, NULL, oa->ctx->arg);
-		g_free(oa->ctx);
-		oa->ctx = NULL;
+		// invoke original handlers. For a refresh ahead of expiry, nobody is
+		// waiting and the current token remains usable until it expires
+		g_free(oa->refresh_token);
+		oa->refresh_token = NULL;
+		fail_waiting(oa, oa->response_body->str);
 		return;
 	}
 
 	if (response_code != 200) {
 		g_critical("unhandled response code %ld, response %s\n", response_code, oa->response_body->str);
+		char* message = g_strdup_printf("Could not obtain access token: unexpected response code %ld", response_code);
+		fail_waiting(oa, message);
+		g_free(message);
 		return;
 	}
 
@@ -157,6 +258,11 @@ static void on_request_access_token_complete(CURL* curl, CURLcode ret, void* use
 	const char* refresh_token = json_reader_get_string_value(reader);
 	json_reader_end_member(reader);
 
+	// lifetime of the access token in seconds
+	json_reader_read_member(reader, "expires_in");
+	gint64 expires_in = json_reader_get_int_value(reader);
+	json_reader_end_member(reader);
+
 	json_reader_read_member(reader, "id_token");
 	const char* id_token = json_reader_get_string_value(reader);
 	json_reader_end_member(reader);
@@ -191,8 +297,10 @@ static void on_request_access_token_complete(CURL* curl, CURLcode ret, void* use
 	}
 
 	if (refresh_token) {
+		g_free(oa->refresh_token);
+		oa->refresh_token = g_strdup(refresh_token);
 		secret_password_store(&focal_oauth2_schema, SECRET_COLLECTION_DEFAULT, "Focal OAuth2 Refresh Token",
-							  refresh_token, NULL, on_refresh_token_stored, oa,
+							  refresh_token, NULL, on_token_stored, oa,
 							  "type", "refresh",
 							  "email", oa->cfg->email,
 							  NULL);
@@ -200,22 +308,30 @@ static void on_request_access_token_complete(CURL* curl, CURLcode ret, void* use
 		g_warning("OAuth2 response did not contain new refresh token");
 	}
 
+	gint64 expires_at = expires_in > 0 ? g_get_real_time() / G_USEC_PER_SEC + expires_in : 0;
+	set_access_token(oa, access_token, expires_at);
+
+	// The expiry is kept with the token, so that it is known after a restart too
+	gchar* secret = expires_at ? g_strdup_printf("%s\n%" G_GINT64_FORMAT, access_token, expires_at) : g_strdup(access_token);
 	secret_password_store(&focal_oauth2_schema, SECRET_COLLECTION_DEFAULT, "Focal OAuth2 Access Token",
-						  access_token, NULL, on_access_token_stored, oa,
+						  secret, NULL, on_token_stored, oa,
 						  "type", "access",
 						  "email", oa->cfg->email,
 						  NULL);
+	g_free(secret);
 
 	g_object_unref(reader);
 	g_object_unref(parser);
+
+	// No need to wait for the store, the token is already at hand
+	deliver_access_token(oa);
 }
 
 static void request_new_access_token(RemoteAuthOAuth2* oa, const char* refresh_token)
 {
-	CURL* curl = curl_easy_init();
+	CURL* curl = async_curl_new_handle();
 	g_assert_nonnull(curl);
 
-	curl_easy_setopt(curl, CURLOPT_URL, oauth2_provider_token_url(oa->provider));
 	char* postdata = oauth2_provider_refresh_token_query(oa->provider, refresh_token);
 	g_string_truncate(oa->response_body, 0);
 
@@ -224,25 +340,27 @@ static void request_new_access_token(RemoteAuthOAuth2* oa, const char* refresh_t
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_to_gstring);
 	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postdata);
 
-	async_curl_add_request(curl, NULL, on_request_access_token_complete, oa);
+	// every request of the account is waiting on this one
+	async_curl_add_request(curl, oauth2_provider_token_url(oa->provider), NULL, ASYNC_CURL_PRIORITY_INTERACTIVE, on_request_access_token_complete, oa);
 }
 
-static void on_refresh_token_lookup(GObject* source, GAsyncResult* result, gpointer user)
+static void on_refresh_token_lookup(gchar* token, GError* error, gpointer user)
 {
-	GError* error = NULL;
-	gchar* token = secret_password_lookup_finish(result, &error);
 	RemoteAuthOAuth2* oa = (RemoteAuthOAuth2*) user;
 
 	if (error != NULL) {
 		g_critical("%s", error->message);
-		g_error_free(error);
-		g_free(oa->ctx);
-		oa->ctx = NULL;
+		fail_waiting(oa, error->message);
+	} else if (token == NULL && g_queue_is_empty(oa->waiting)) {
+		// a refresh ahead of expiry, which should not open a browser unprompted.
+		// Authentication is run once the token is actually needed
+		oa->acquiring = FALSE;
 	} else if (token == NULL) {
 		// no refresh token in password store, we need to run authentication again!
 		g_warning("no refresh token, rerun authentication");
 		launch_external_authentication(oa);
 	} else {
+		oa->refresh_token = g_strdup(token);
 		request_new_access_token(oa, token);
 		secret_password_free(token);
 	}
@@ -250,40 +368,56 @@ static void on_refresh_token_lookup(GObject* source, GAsyncResult* result, gpoin
 
 static void refresh_token_lookup(RemoteAuthOAuth2* ra)
 {
+	if (ra->refresh_token) {
+		request_new_access_token(ra, ra->refresh_token);
+		return;
+	}
 	CalendarConfig* cfg = ra->cfg;
-	secret_password_lookup(&focal_oauth2_schema, NULL, on_refresh_token_lookup, ra,
-						   "type", "refresh",
-						   "email", cfg->email,
-						   NULL);
+	secret_cache_lookup(&focal_oauth2_schema, on_refresh_token_lookup, ra,
+						"type", "refresh",
+						"email", cfg->email,
+						NULL);
 }
 
-static void on_access_token_lookup_complete(GObject* source, GAsyncResult* result, gpointer user)
+static void on_access_token_lookup_complete(gchar* token, GError* error, gpointer user)
 {
-	GError* error = NULL;
-	gchar* token = secret_password_lookup_finish(result, &error);
 	RemoteAuthOAuth2* ba = (RemoteAuthOAuth2*) user;
 
 	if (error != NULL) {
 		g_critical("%s", error->message);
-		g_error_free(error);
+		fail_waiting(ba, error->message);
+		return;
 	} else if (token == NULL) {
 		// no auth token in password store, try to acquire another using the refresh token
 		refresh_token_lookup(ba);
 		return;
-	} else {
-		CURL* curl = curl_easy_init();
-		g_assert_nonnull(curl);
-		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1);
-		struct curl_slist* hdrs = curl_slist_append(NULL, "User-Agent: Focal/0.1");
-		char* auth_header = g_strdup_printf("Authorization: Bearer %s", token);
-		hdrs = curl_slist_append(hdrs, auth_header);
-		g_free(auth_header);
-		// invoke original handler
-		(*ba->ctx->callback)(ba->ctx->user, NULL, curl, hdrs, ba->ctx->arg);
-		secret_password_free(token);
 	}
-	g_free(ba->ctx);
-	ba->ctx = NULL;
+
+	// The token may be followed by its expiry
+	gint64 expires_at = 0;
+	char* nl = strchr(token, '\n');
+	if (nl) {
+		*nl = '\0';
+		expires_at = g_ascii_strtoll(nl + 1, NULL, 10);
+	}
+	set_access_token(ba, token, expires_at);
+	secret_password_free(token);
+
+	if (token_is_fresh(ba))
+		deliver_access_token(ba);
+	else
+		refresh_token_lookup(ba);
+}
+
+static gboolean on_deliver_idle(gpointer user)
+{
+	RemoteAuthOAuth2* oa = (RemoteAuthOAuth2*) user;
+	oa->deliver_source = 0;
+	// otherwise the token was invalidated meanwhile, and the waiting requests
+	// are served once a new one has been acquired
+	if (!oa->acquiring)
+		deliver_access_token(oa);
+	return G_SOURCE_REMOVE;
 }
 
 static void remote_auth_oauth2_new_request(RemoteAuth* ra, void (*callback)(), void* user, void* arg)
@@ -291,13 +425,27 @@ static void remote_auth_oauth2_new_request(RemoteAuth* ra, void (*callback)(), v
 	RemoteAuthOAuth2* oa = FOCAL_REMOTE_AUTH_OAUTH2(ra);
 
 	g_assert_nonnull(oa->provider);
-	g_assert_null(oa->ctx);
-	oa->ctx = g_new0(DeferredFunc, 1);
-	oa->ctx->callback = callback;
-	oa->ctx->user = user;
-	oa->ctx->arg = arg;
+	DeferredFunc* df = g_new0(DeferredFunc, 1);
+	df->callback = callback;
+	df->user = user;
+	df->arg = arg;
+	g_queue_push_tail(oa->waiting, df);
+
+	// share the token already being acquired
+	if (oa->acquiring)
+		return;
+
+	if (oa->access_token && token_is_fresh(oa)) {
+		// Callers expect the callback to be invoked asynchronously
+		if (!oa->deliver_source)
+			oa->deliver_source = g_idle_add(on_deliver_idle, oa);
+		return;
+	}
 
-	if (oa->cfg->email)
+	oa->acquiring = TRUE;
+	if (oa->access_token)
+		refresh_token_lookup(oa);
+	else if (oa->cfg->email)
 		access_token_lookup(oa);
 	else
 		launch_external_authentication(oa);
@@ -311,9 +459,8 @@ static void on_access_token_clear_complete(GObject* source, GAsyncResult* result
 
 	if (error != NULL) {
 		g_critical("%s", error->message);
+		fail_waiting(ba, error->message);
 		g_error_free(error);
-		g_free(ba->ctx);
-		ba->ctx = NULL;
 	} else {
 		// try to acquire a new access token using the refresh token
 		refresh_token_lookup(ba);
@@ -323,12 +470,20 @@ static void on_access_token_clear_complete(GObject* source, GAsyncResult* result
 static void remote_auth_oauth2_invalidate_credential(RemoteAuth* ra, void (*callback)(), void* user, void* arg)
 {
 	RemoteAuthOAuth2* oa = FOCAL_REMOTE_AUTH_OAUTH2(ra);
-	g_assert_null(oa->ctx);
 
-	oa->ctx = g_new0(DeferredFunc, 1);
-	oa->ctx->callback = callback;
-	oa->ctx->user = user;
-	oa->ctx->arg = arg;
+	DeferredFunc* df = g_new0(DeferredFunc, 1);
+	df->callback = callback;
+	df->user = user;
+	df->arg = arg;
+	g_queue_push_tail(oa->waiting, df);
+
+	// Usually rare since tokens are refreshed before they expire, but the
+	// server may revoke a token early. A token already being acquired will do
+	if (oa->acquiring)
+		return;
+
+	clear_access_token(oa);
+	oa->acquiring = TRUE;
 	// remove the invalidated auth token from the store. In the callback, request another.
 	secret_password_clear(&focal_oauth2_schema, NULL, on_access_token_clear_complete, ra,
 						  "type", "access",
@@ -339,6 +494,13 @@ static void remote_auth_oauth2_invalidate_credential(RemoteAuth* ra, void (*call
 static void finalize(GObject* gobject)
 {
 	RemoteAuthOAuth2* oa = FOCAL_REMOTE_AUTH_OAUTH2(gobject);
+	if (oa->refresh_source)
+		g_source_remove(oa->refresh_source);
+	if (oa->deliver_source)
+		g_source_remove(oa->deliver_source);
+	g_queue_free_full(oa->waiting, g_free);
+	g_free(oa->access_token);
+	g_free(oa->refresh_token);
 	g_string_free(oa->response_body, TRUE);
 	g_object_unref(oa->provider);
 	G_OBJECT_CLASS(remote_auth_oauth2_parent_class)->finalize(gobject);
@@ -379,4 +541,5 @@ void remote_auth_oauth2_init(RemoteAuthOAuth2* oa)
 	// responsibility to verify that this signal is intended for this RemoteAuth instance.
 	g_signal_connect_swapped(g_application_get_default(), "browser-auth-response", G_CALLBACK(on_external_browser_response), oa);
 	oa->response_body = g_string_new("");
+	oa->waiting = g_queue_new();
 }
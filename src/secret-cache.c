@@ -0,0 +1,167 @@
+/*
+ * secret-cache.c
+ * This file is part of focal, a calendar application for Linux
+ * Copyright 2020 Oliver Giles and focal contributors.
+ *
+ * Focal is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Focal is distributed without any explicit or implied warranty.
+ * You should have received a copy of the GNU General Public License
+ * version 3 with focal. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "secret-cache.h"
+
+#include <string.h>
+
+// Matches every item stored by focal, whatever its attributes
+static const SecretSchema focal_any_schema = {
+	"net.ohwg.focal", SECRET_SCHEMA_NONE, {
+											  {"NULL", 0},
+										  }};
+
+typedef struct {
+	SecretCacheCallback callback;
+	gpointer user;
+	const SecretSchema* schema;
+	GHashTable* attributes;
+} Lookup;
+
+// attributes key -> secret, NULL until the prefetch has completed
+static GHashTable* prefetched = NULL;
+static gboolean prefetching = FALSE;
+// lookups made while prefetching
+static GQueue waiting = G_QUEUE_INIT;
+
+static void lookup_free(Lookup* l)
+{
+	g_hash_table_unref(l->attributes);
+	g_free(l);
+}
+
+static gint compare_strings(gconstpointer a, gconstpointer b)
+{
+	return strcmp(*(const char**) a, *(const char**) b);
+}
+
+// Canonical form of a set of attributes, excluding those added by libsecret
+static gchar* attributes_key(GHashTable* attributes)
+{
+	GPtrArray* pairs = g_ptr_array_new_with_free_func(g_free);
+	GHashTableIter it;
+	const char *name, *value;
+	g_hash_table_iter_init(&it, attributes);
+	while (g_hash_table_iter_next(&it, (gpointer*) &name, (gpointer*) &value)) {
+		if (!g_str_has_prefix(name, "xdg:"))
+			g_ptr_array_add(pairs, g_strdup_printf("%s=%s", name, value));
+	}
+	g_ptr_array_sort(pairs, compare_strings);
+	g_ptr_array_add(pairs, NULL);
+	gchar* key = g_strjoinv("\n", (gchar**) pairs->pdata);
+	g_ptr_array_free(pairs, TRUE);
+	return key;
+}
+
+static void on_lookup_complete(GObject* source, GAsyncResult* result, gpointer user)
+{
+	Lookup* l = (Lookup*) user;
+	GError* error = NULL;
+	gchar* secret = secret_password_lookup_finish(result, &error);
+	l->callback(secret, error, l->user);
+	if (error)
+		g_error_free(error);
+	lookup_free(l);
+}
+
+static void serve(Lookup* l)
+{
+	gchar* key = attributes_key(l->attributes);
+	gchar* stored_key;
+	gchar* secret;
+	if (prefetched && g_hash_table_lookup_extended(prefetched, key, (gpointer*) &stored_key, (gpointer*) &secret)) {
+		g_hash_table_steal(prefetched, key);
+		g_free(stored_key);
+		l->callback(secret, NULL, l->user);
+		lookup_free(l);
+	} else {
+		// not prefetched, e.g. stored since or the prefetch failed
+		secret_password_lookupv(l->schema, l->attributes, NULL, on_lookup_complete, l);
+	}
+	g_free(key);
+}
+
+static gboolean serve_idle(gpointer user)
+{
+	serve((Lookup*) user);
+	return G_SOURCE_REMOVE;
+}
+
+static void on_search_complete(GObject* source, GAsyncResult* result, gpointer user)
+{
+	GError* error = NULL;
+	GList* items = secret_service_search_finish(NULL, result, &error);
+	if (error != NULL) {
+		g_warning("Could not prefetch secrets: %s", error->message);
+		g_error_free(error);
+	}
+
+	prefetched = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) secret_password_free);
+	for (GList* i = items; i; i = i->next) {
+		SecretItem* item = SECRET_ITEM(i->data);
+		SecretValue* value = secret_item_get_secret(item);
+		if (!value)
+			continue;
+		const gchar* text = secret_value_get_text(value);
+		if (text) {
+			GHashTable* attributes = secret_item_get_attributes(item);
+			g_hash_table_insert(prefetched, attributes_key(attributes), g_strdup(text));
+			g_hash_table_unref(attributes);
+		}
+		secret_value_unref(value);
+	}
+	g_list_free_full(items, g_object_unref);
+	prefetching = FALSE;
+
+	for (Lookup* l; (l = g_queue_pop_head(&waiting));)
+		serve(l);
+}
+
+void secret_cache_prefetch()
+{
+	if (prefetching || prefetched)
+		return;
+
+	prefetching = TRUE;
+	// Unlocking the collection happens once here instead of on the first lookup
+	GHashTable* attributes = g_hash_table_new(g_str_hash, g_str_equal);
+	secret_service_search(NULL, &focal_any_schema, attributes, SECRET_SEARCH_ALL | SECRET_SEARCH_UNLOCK | SECRET_SEARCH_LOAD_SECRETS, NULL, on_search_complete, NULL);
+	g_hash_table_unref(attributes);
+}
+
+void secret_cache_lookup(const SecretSchema* schema, SecretCacheCallback callback, gpointer user, ...)
+{
+	Lookup* l = g_new0(Lookup, 1);
+	l->callback = callback;
+	l->user = user;
+	l->schema = schema;
+	va_list va;
+	va_start(va, user);
+	l->attributes = secret_attributes_buildv(schema, va);
+	va_end(va);
+
+	if (prefetching)
+		g_queue_push_tail(&waiting, l);
+	else
+		g_idle_add(serve_idle, l);
+}
+
+void secret_cache_cleanup()
+{
+	if (prefetched) {
+		g_hash_table_destroy(prefetched);
+		prefetched = NULL;
+	}
+	for (Lookup* l; (l = g_queue_pop_head(&waiting));)
+		lookup_free(l);
+}
@@ -0,0 +1,38 @@
+/*
+ * secret-cache.h
+ * This file is part of focal, a calendar application for Linux
+ * Copyright 2020 Oliver Giles and focal contributors.
+ *
+ * Focal is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Focal is distributed without any explicit or implied warranty.
+ * You should have received a copy of the GNU General Public License
+ * version 3 with focal. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SECRET_CACHE_H
+#define SECRET_CACHE_H
+
+#include <libsecret/secret.h>
+
+// Called with the secret, or NULL if there is none, which must be freed with
+// secret_password_free. error is set if the lookup failed, and is only valid
+// for the duration of the call.
+typedef void (*SecretCacheCallback)(gchar* secret, GError* error, gpointer user);
+
+// Starts loading all of focal's secrets from the secret service in a single
+// search, rather than one D-Bus round trip per account. Call once at startup,
+// before the calendars are synced.
+void secret_cache_prefetch();
+
+// Looks up a secret like secret_password_lookup, with the attributes given as
+// NULL-terminated name/value pairs. Each prefetched secret is handed out once,
+// later lookups go to the secret service. Lookups made while the prefetch is
+// in progress wait for it. The callback is always invoked asynchronously.
+void secret_cache_lookup(const SecretSchema* schema, SecretCacheCallback callback, gpointer user, ...) G_GNUC_NULL_TERMINATED;
+
+// Call once before application exit. Wipes any secrets which were not used.
+void secret_cache_cleanup();
+
+#endif // SECRET_CACHE_H
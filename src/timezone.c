@@ -0,0 +1,292 @@
+/*
+ * timezone.c
+ * This file is part of focal, a calendar application for Linux
+ * Copyright 2020 Oliver Giles and focal contributors.
+ *
+ * Focal is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Focal is distributed without any explicit or implied warranty.
+ * You should have received a copy of the GNU General Public License
+ * version 3 with focal. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "timezone.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// defined in windows-tz-map.gperf
+extern const char* outlook_timezone_to_tzid(const char* windows_name);
+
+// Transition tables are only built for this range of years, anything outside
+// it is rare enough to be left to libical
+#define TABLE_MIN_YEAR 1900
+#define TABLE_MAX_YEAR 2200
+
+#define SECONDS_PER_DAY (24 * 60 * 60)
+
+// julian day number of 1970-01-01 as counted by GDate
+#define JULIAN_UNIX_EPOCH 719163
+
+typedef struct {
+	time_t at;		// UTC time from which the offset applies
+	int utc_offset; // seconds east of UTC
+} Transition;
+
+typedef struct {
+	icaltimezone* zone;
+	int first_year, last_year;
+	time_t start, end;	 // range covered by the table
+	GArray* transitions; // Transition, ordered by at. The first is at start
+} TransitionTable;
+
+static icaltimezone* local_zone;
+// builtin icaltimezone* -> TransitionTable*
+static GHashTable* tables;
+// name -> builtin icaltimezone*, or NULL if the name is not recognised
+static GHashTable* zones_by_name;
+// tzid of any zone seen in a conversion -> builtin icaltimezone*, or NULL
+static GHashTable* zones_by_tzid;
+
+static time_t year_start(int year)
+{
+	GDate date;
+	g_date_clear(&date, 1);
+	g_date_set_dmy(&date, 1, G_DATE_JANUARY, year);
+	return ((time_t) g_date_get_julian(&date) - JULIAN_UNIX_EPOCH) * SECONDS_PER_DAY;
+}
+
+// Wall-clock fields of tt as if they were UTC
+static time_t local_seconds(icaltimetype tt)
+{
+	GDate date;
+	g_date_clear(&date, 1);
+	g_date_set_dmy(&date, tt.day, tt.month, tt.year);
+	time_t t = ((time_t) g_date_get_julian(&date) - JULIAN_UNIX_EPOCH) * SECONDS_PER_DAY;
+	if (!tt.is_date)
+		t += tt.hour * 3600 + tt.minute * 60 + tt.second;
+	return t;
+}
+
+static int libical_utc_offset(icaltimezone* zone, time_t t)
+{
+	icaltimetype tt = icaltime_from_timet_with_zone(t, 0, icaltimezone_get_utc_timezone());
+	int is_daylight;
+	return icaltimezone_get_utc_offset_of_utc_time(zone, &tt, &is_daylight);
+}
+
+// (Re)computes the table for the given years by sampling libical daily and
+// bisecting to the second wherever the offset changes
+static void transition_table_build(TransitionTable* table, int first_year, int last_year)
+{
+	table->first_year = first_year;
+	table->last_year = last_year;
+	table->start = year_start(first_year);
+	table->end = year_start(last_year + 1);
+	g_array_set_size(table->transitions, 0);
+
+	Transition tr = {table->start, libical_utc_offset(table->zone, table->start)};
+	g_array_append_val(table->transitions, tr);
+	for (time_t t = table->start; t < table->end; t += SECONDS_PER_DAY) {
+		time_t next = MIN(t + SECONDS_PER_DAY, table->end);
+		int next_offset = libical_utc_offset(table->zone, next);
+		if (next_offset == tr.utc_offset)
+			continue;
+		time_t lo = t, hi = next;
+		while (hi - lo > 1) {
+			time_t mid = lo + (hi - lo) / 2;
+			if (libical_utc_offset(table->zone, mid) == tr.utc_offset)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		tr.at = hi;
+		tr.utc_offset = next_offset;
+		g_array_append_val(table->transitions, tr);
+	}
+}
+
+static void transition_table_free(TransitionTable* table)
+{
+	g_array_free(table->transitions, TRUE);
+	g_free(table);
+}
+
+// Returns FALSE if t lies outside the years for which tables are built
+static gboolean transition_table_offset(TransitionTable* table, time_t t, int* offset)
+{
+	if (t < table->start || t >= table->end) {
+		struct tm tm;
+		if (!gmtime_r(&t, &tm))
+			return FALSE;
+		int year = tm.tm_year + 1900;
+		if (year < TABLE_MIN_YEAR || year > TABLE_MAX_YEAR)
+			return FALSE;
+		transition_table_build(table, MIN(year, table->first_year), MAX(year, table->last_year));
+	}
+
+	// last transition at or before t
+	const Transition* tr = (const Transition*) table->transitions->data;
+	guint lo = 0, hi = table->transitions->len;
+	while (hi - lo > 1) {
+		guint mid = lo + (hi - lo) / 2;
+		if (tr[mid].at <= t)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	*offset = tr[lo].utc_offset;
+	return TRUE;
+}
+
+static void ensure_init(void)
+{
+	if (tables)
+		return;
+	tables = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify) transition_table_free);
+	zones_by_name = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	zones_by_tzid = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+}
+
+icaltimezone* timezone_lookup(const char* name)
+{
+	if (!name)
+		return NULL;
+	ensure_init();
+
+	icaltimezone* zone;
+	if (g_hash_table_lookup_extended(zones_by_name, name, NULL, (gpointer*) &zone))
+		return zone;
+
+	zone = icaltimezone_get_builtin_timezone(name);
+	if (!zone) {
+		const char* tzid = outlook_timezone_to_tzid(name);
+		if (tzid)
+			zone = icaltimezone_get_builtin_timezone(tzid);
+	}
+	g_hash_table_insert(zones_by_name, g_strdup(name), zone);
+	return zone;
+}
+
+icaltimezone* timezone_get_local(void)
+{
+	if (local_zone)
+		return local_zone;
+
+	char* zoneinfo_link = realpath("/etc/localtime", NULL);
+	const char* name = zoneinfo_link ? strstr(zoneinfo_link, "zoneinfo/") : NULL;
+	if (name)
+		local_zone = timezone_lookup(name + strlen("zoneinfo/"));
+	free(zoneinfo_link);
+
+	const char* tz_env = g_getenv("TZ");
+	if (!local_zone && tz_env)
+		local_zone = timezone_lookup(tz_env[0] == ':' ? tz_env + 1 : tz_env);
+	if (!local_zone) {
+		g_warning("Could not determine the local timezone, using UTC");
+		local_zone = icaltimezone_get_utc_timezone();
+	}
+	return local_zone;
+}
+
+const char* timezone_get_local_location(void)
+{
+	icaltimezone* zone = timezone_get_local();
+	return zone == icaltimezone_get_utc_timezone() ? "UTC" : icaltimezone_get_location(zone);
+}
+
+// Finds the builtin zone equivalent to any zone, such as one defined by a
+// VTIMEZONE in a calendar object, so that its transition table can be shared.
+static icaltimezone* builtin_zone(icaltimezone* zone)
+{
+	const char* tzid = icaltimezone_get_tzid(zone);
+	if (!tzid)
+		return NULL;
+
+	icaltimezone* builtin;
+	if (g_hash_table_lookup_extended(zones_by_tzid, tzid, NULL, (gpointer*) &builtin))
+		return builtin;
+
+	builtin = icaltimezone_get_builtin_timezone_from_tzid(tzid);
+	if (!builtin && icaltimezone_get_location(zone))
+		builtin = timezone_lookup(icaltimezone_get_location(zone));
+	if (!builtin)
+		builtin = timezone_lookup(tzid);
+	g_hash_table_insert(zones_by_tzid, g_strdup(tzid), builtin);
+	return builtin;
+}
+
+static TransitionTable* transition_table_for_zone(icaltimezone* zone)
+{
+	ensure_init();
+	if (zone == icaltimezone_get_utc_timezone())
+		return NULL;
+	icaltimezone* builtin = builtin_zone(zone);
+	if (!builtin)
+		return NULL;
+
+	TransitionTable* table = g_hash_table_lookup(tables, builtin);
+	if (!table) {
+		table = g_new0(TransitionTable, 1);
+		table->zone = builtin;
+		table->transitions = g_array_new(FALSE, FALSE, sizeof(Transition));
+		// start with the years around now, extended on demand
+		GDate today;
+		g_date_clear(&today, 1);
+		g_date_set_time_t(&today, time(NULL));
+		int year = g_date_get_year(&today);
+		transition_table_build(table, year - 1, year + 1);
+		g_hash_table_insert(tables, builtin, table);
+	}
+	return table;
+}
+
+icaltimetype timezone_time_from_timet(time_t t, gboolean is_date, icaltimezone* zone)
+{
+	TransitionTable* table = zone ? transition_table_for_zone(zone) : NULL;
+	int offset;
+	if (!table || !transition_table_offset(table, t, &offset))
+		return icaltime_from_timet_with_zone(t, is_date, zone);
+
+	// Without a zone, libical only breaks down the time as UTC
+	icaltimetype tt = icaltime_from_timet_with_zone(t + offset, is_date, NULL);
+	tt.zone = zone;
+	return tt;
+}
+
+time_t timezone_time_as_timet(icaltimetype tt)
+{
+	icaltimezone* zone = (icaltimezone*) tt.zone;
+	if (icaltime_is_null_time(tt))
+		return 0;
+	if (!zone || zone == icaltimezone_get_utc_timezone())
+		return local_seconds(tt);
+
+	TransitionTable* table = transition_table_for_zone(zone);
+	time_t local = local_seconds(tt);
+	int guess, offset;
+	// The offset in effect at the wall-clock time, found by first assuming
+	// the offset in effect at the same UTC time
+	if (!table || !transition_table_offset(table, local, &guess) || !transition_table_offset(table, local - guess, &offset))
+		return icaltime_as_timet_with_zone(tt, zone);
+	return local - offset;
+}
+
+icaltimetype timezone_convert_time(icaltimetype tt, icaltimezone* zone)
+{
+	if (tt.is_date || !tt.zone || !zone || tt.zone == zone)
+		return tt;
+	return timezone_time_from_timet(timezone_time_as_timet(tt), FALSE, zone);
+}
+
+void timezone_cleanup(void)
+{
+	if (!tables)
+		return;
+	g_hash_table_destroy(tables);
+	g_hash_table_destroy(zones_by_name);
+	g_hash_table_destroy(zones_by_tzid);
+	tables = zones_by_name = zones_by_tzid = NULL;
+	local_zone = NULL;
+}
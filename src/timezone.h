@@ -0,0 +1,51 @@
+/*
+ * timezone.h
+ * This file is part of focal, a calendar application for Linux
+ * Copyright 2020 Oliver Giles and focal contributors.
+ *
+ * Focal is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Focal is distributed without any explicit or implied warranty.
+ * You should have received a copy of the GNU General Public License
+ * version 3 with focal. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TIMEZONE_H
+#define TIMEZONE_H
+
+#include <glib.h>
+#include <libical/ical.h>
+
+// Shared timezone lookups and conversions. Zones are resolved once and the
+// UTC offsets of each zone in use are kept in a table of transitions, so that
+// converting between a time_t and a wall-clock time is a binary search rather
+// than a walk of the VTIMEZONE definition. Zones which cannot be matched to a
+// libical builtin zone are converted by libical as before.
+// Not thread safe: for use from the main thread only.
+
+// Returns the user's timezone, resolved from /etc/localtime on first use.
+// Falls back to UTC if it cannot be determined.
+icaltimezone* timezone_get_local(void);
+
+// Returns the Olson name of the user's timezone, e.g. "Europe/Berlin"
+const char* timezone_get_local_location(void);
+
+// Looks up a builtin timezone by Olson name or by Windows timezone name, as
+// used by Exchange. Returns NULL if the name is not recognised.
+icaltimezone* timezone_lookup(const char* name);
+
+// Equivalent to icaltime_from_timet_with_zone
+icaltimetype timezone_time_from_timet(time_t t, gboolean is_date, icaltimezone* zone);
+
+// Equivalent to icaltime_as_timet_with_zone with the time's own zone, or UTC
+// for floating times
+time_t timezone_time_as_timet(icaltimetype tt);
+
+// Equivalent to icaltimezone_convert_time from the time's own zone. Dates and
+// floating times are returned unchanged.
+icaltimetype timezone_convert_time(icaltimetype tt, icaltimezone* zone);
+
+void timezone_cleanup(void);
+
+#endif // TIMEZONE_H
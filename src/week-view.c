@@ -18,6 +18,7 @@
 #include <string.h>
 
 #include "memory-calendar.h"
+#include "timezone.h"
 #include "week-view.h"
 
 struct _EventWidget {
@@ -636,7 +637,6 @@ static void clear_all_events(WeekView* wv)
 static void week_view_finalize(GObject* gobject)
 {
 	WeekView* wv = FOCAL_WEEK_VIEW(gobject);
-	icaltimezone_free(wv->current_tz, TRUE);
 	g_slist_free(wv->calendars);
 	clear_all_events(wv);
 	g_object_unref(wv->unsaved_events);
@@ -825,9 +825,7 @@ GtkWidget* week_view_new(void)
 {
 	WeekView* cw = g_object_new(FOCAL_TYPE_WEEK_VIEW, NULL);
 
-	char* zoneinfo_link = realpath("/etc/localtime", NULL);
-	cw->current_tz = icaltimezone_get_builtin_timezone(zoneinfo_link + strlen("/usr/share/zoneinfo/"));
-	free(zoneinfo_link);
+	cw->current_tz = timezone_get_local();
 
 	update_current_time(cw);
 
@@ -885,12 +883,11 @@ void week_view_add_event(WeekView* wv, Event* vevent)
 	gtk_widget_queue_draw((GtkWidget*) wv);
 }
 
-void week_view_remove_event(WeekView* wv, Event* ev)
+static void remove_event_widgets(WeekView* wv, Event* ev)
 {
 	icaltimetype dtstart = event_get_dtstart(ev);
-	const icaltimezone* tz = icaltime_get_timezone(dtstart);
 	// convert to local time
-	icaltimezone_convert_time(&dtstart, (icaltimezone*) tz, wv->current_tz);
+	dtstart = timezone_convert_time(dtstart, wv->current_tz);
 	dayindex di = dayindex_from_icaltime(wv, dtstart);
 
 	if (wv->current_selection == ev) {
@@ -909,19 +906,26 @@ void week_view_remove_event(WeekView* wv, Event* ev)
 			break;
 		}
 	}
+}
 
+void week_view_remove_event(WeekView* wv, Event* ev)
+{
+	remove_event_widgets(wv, ev);
 	gtk_widget_queue_draw((GtkWidget*) wv);
 }
 
-static void calendar_event_updated(WeekView* wv, Event* old_event, Event* new_event, Calendar* cal)
+static void calendar_events_changed(WeekView* wv, const CalendarChanges* changes, Calendar* cal)
 {
-	// all references to old_event are about to become invalid
-	if (old_event) {
-		week_view_remove_event(wv, old_event);
-	}
-	if (new_event) {
-		week_view_add_event(wv, new_event);
+	// Apply the whole change set, then redraw once
+	for (guint i = 0; i < changes->changes->len; ++i) {
+		CalendarEventChange* change = &g_array_index(changes->changes, CalendarEventChange, i);
+		// all references to old_event are about to become invalid
+		if (change->old_event)
+			remove_event_widgets(wv, change->old_event);
+		if (change->new_event)
+			add_event_from_calendar(wv, change->new_event);
 	}
+	gtk_widget_queue_draw((GtkWidget*) wv);
 }
 
 int week_view_get_week(WeekView* wv)
@@ -944,7 +948,7 @@ static void week_view_populate_view(WeekView* wv)
 	wv->now.within_shown_range = icaltime_span_contains(&icalnow, &wv->current_view);
 
 	for (GSList* p = wv->calendars; p; p = p->next)
-		calendar_each_event(FOCAL_CALENDAR(p->data), add_event_from_calendar, wv);
+		calendar_each_event_in_range(FOCAL_CALENDAR(p->data), wv->current_view, add_event_from_calendar, wv);
 
 	gtk_widget_queue_draw((GtkWidget*) wv);
 }
@@ -952,8 +956,8 @@ static void week_view_populate_view(WeekView* wv)
 void week_view_add_calendar(WeekView* wv, Calendar* cal)
 {
 	wv->calendars = g_slist_append(wv->calendars, cal);
-	g_signal_connect_swapped(cal, "event-updated", G_CALLBACK(calendar_event_updated), wv);
-	calendar_each_event(cal, add_event_from_calendar, wv);
+	g_signal_connect_swapped(cal, "events-changed", G_CALLBACK(calendar_events_changed), wv);
+	calendar_each_event_in_range(cal, wv->current_view, add_event_from_calendar, wv);
 	//week_view_populate_view(wv);
 	gtk_widget_queue_draw((GtkWidget*) wv);
 	calendar_sync_date_range(cal, wv->current_view);
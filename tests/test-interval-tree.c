@@ -0,0 +1,187 @@
+/*
+ * test-interval-tree.c
+ * This file is part of focal, a calendar application for Linux
+ * Copyright 2020 Oliver Giles and focal contributors.
+ *
+ * Focal is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Focal is distributed without any explicit or implied warranty.
+ * You should have received a copy of the GNU General Public License
+ * version 3 with focal. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Random inserts, re-inserts and removals are applied both to an interval tree
+// and to a plain array, and every query is compared with a linear scan of the
+// array. The test includes interval-tree.c directly to also check the treap
+// invariants after each change. A failure can be reproduced by passing its --seed.
+#include "interval-tree.c"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define N_ITEMS 200
+#define OPERATIONS_PER_RUN 5000
+
+typedef struct {
+	time_t start;
+	time_t end;
+	gboolean present;
+	// number of times the tree called the destroy function on it
+	int destroyed;
+} Item;
+
+static Item items[N_ITEMS];
+
+static void item_destroy(gpointer data)
+{
+	((Item*) data)->destroyed++;
+}
+
+// Clustered starts make ties and nested intervals common
+static void random_interval(time_t* start, time_t* end)
+{
+	*start = g_test_rand_int_range(0, 1000);
+	switch (g_test_rand_int_range(0, 8)) {
+	case 0:
+		*end = *start;
+		break;
+	case 1:
+		*end = INTERVAL_TREE_UNBOUNDED;
+		break;
+	case 2:
+		*end = *start + g_test_rand_int_range(1, 1000);
+		break;
+	default:
+		*end = *start + g_test_rand_int_range(1, 30);
+	}
+}
+
+// Walks the subtree in order, checking the heap property on priorities and
+// the max_end augmentation, and that each node is indexed by its item.
+// Returns the number of nodes.
+static guint check_node(IntervalTree* tree, Node* n, Node** prev)
+{
+	if (!n)
+		return 0;
+	if (n->left)
+		g_assert_cmpuint(n->left->priority, <=, n->priority);
+	if (n->right)
+		g_assert_cmpuint(n->right->priority, <=, n->priority);
+
+	guint count = check_node(tree, n->left, prev);
+	if (*prev)
+		g_assert_cmpint(node_compare(*prev, n), <, 0);
+	*prev = n;
+	count += 1 + check_node(tree, n->right, prev);
+
+	time_t max_end = n->end;
+	if (n->left)
+		max_end = MAX(max_end, n->left->max_end);
+	if (n->right)
+		max_end = MAX(max_end, n->right->max_end);
+	g_assert_cmpint(n->max_end, ==, max_end);
+
+	Item* item = n->item;
+	g_assert_true(g_hash_table_lookup(tree->nodes, item) == n);
+	g_assert_true(item->present);
+	g_assert_cmpint(n->start, ==, item->start);
+	g_assert_cmpint(n->end, ==, item->end);
+	return count;
+}
+
+static void check_tree(IntervalTree* tree)
+{
+	guint present = 0;
+	for (int i = 0; i < N_ITEMS; ++i)
+		present += items[i].present;
+	Node* prev = NULL;
+	g_assert_cmpuint(check_node(tree, tree->root, &prev), ==, present);
+	g_assert_cmpuint(interval_tree_size(tree), ==, present);
+}
+
+static void collect_item(gpointer item, gpointer user)
+{
+	g_ptr_array_add((GPtrArray*) user, item);
+}
+
+// The order interval_tree_query promises: by start, then by item address
+static int compare_items(const void* a, const void* b)
+{
+	const Item* x = *(const Item**) a;
+	const Item* y = *(const Item**) b;
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+	return x < y ? -1 : x > y;
+}
+
+static void check_query(IntervalTree* tree, time_t start, time_t end)
+{
+	GPtrArray* expected = g_ptr_array_new();
+	for (int i = 0; i < N_ITEMS; ++i) {
+		if (items[i].present && items[i].start < end && items[i].end > start)
+			g_ptr_array_add(expected, &items[i]);
+	}
+	qsort(expected->pdata, expected->len, sizeof(gpointer), compare_items);
+
+	GPtrArray* actual = g_ptr_array_new();
+	interval_tree_query(tree, start, end, collect_item, actual);
+
+	if (actual->len != expected->len)
+		g_test_message("query %ld to %ld, %u items expected, %u found", (long) start, (long) end, expected->len, actual->len);
+	g_assert_cmpuint(actual->len, ==, expected->len);
+	for (guint i = 0; i < expected->len; ++i)
+		g_assert_true(g_ptr_array_index(actual, i) == g_ptr_array_index(expected, i));
+
+	g_ptr_array_free(expected, TRUE);
+	g_ptr_array_free(actual, TRUE);
+}
+
+static void test_random_operations(void)
+{
+	memset(items, 0, sizeof(items));
+	// the treap priorities come from g_random_int, so seed it from the test seed
+	g_random_set_seed(g_test_rand_int());
+	IntervalTree* tree = interval_tree_new(item_destroy);
+
+	for (int op = 0; op < OPERATIONS_PER_RUN; ++op) {
+		Item* item = &items[g_test_rand_int_range(0, N_ITEMS)];
+		int destroyed = item->destroyed;
+		if (g_test_rand_int_range(0, 3) == 0) {
+			g_assert_cmpint(interval_tree_remove(tree, item), ==, item->present);
+			g_assert_cmpint(item->destroyed, ==, destroyed + item->present);
+			item->present = FALSE;
+		} else {
+			// re-inserting a present item moves it without destroying it
+			random_interval(&item->start, &item->end);
+			interval_tree_insert(tree, item->start, item->end, item);
+			g_assert_cmpint(item->destroyed, ==, destroyed);
+			item->present = TRUE;
+		}
+		check_tree(tree);
+
+		time_t start, end;
+		random_interval(&start, &end);
+		check_query(tree, start, end);
+	}
+
+	// unbounded queries, and queries around the edges of the range used
+	check_query(tree, 0, INTERVAL_TREE_UNBOUNDED);
+	check_query(tree, G_MININT64, 0);
+	check_query(tree, 2000, INTERVAL_TREE_UNBOUNDED);
+
+	int destroyed[N_ITEMS];
+	for (int i = 0; i < N_ITEMS; ++i)
+		destroyed[i] = items[i].destroyed;
+	interval_tree_free(tree);
+	for (int i = 0; i < N_ITEMS; ++i)
+		g_assert_cmpint(items[i].destroyed, ==, destroyed[i] + items[i].present);
+}
+
+int main(int argc, char** argv)
+{
+	g_test_init(&argc, &argv, NULL);
+	g_test_add_func("/interval-tree/random-operations", test_random_operations);
+	return g_test_run();
+}
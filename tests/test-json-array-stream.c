@@ -0,0 +1,150 @@
+/*
+ * test-json-array-stream.c
+ * This file is part of focal, a calendar application for Linux
+ * Copyright 2020 Oliver Giles and focal contributors.
+ *
+ * Focal is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Focal is distributed without any explicit or implied warranty.
+ * You should have received a copy of the GNU General Public License
+ * version 3 with focal. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Every document is fed whole, one byte at a time and split in two at each
+// position, since the state machine has to give the same result however the
+// response arrives from the network.
+#include "json-array-stream.h"
+
+#include <string.h>
+
+static void collect_id(JsonReader* reader, void* user)
+{
+	json_reader_read_member(reader, "id");
+	g_ptr_array_add((GPtrArray*) user, g_strdup(json_reader_get_string_value(reader)));
+	json_reader_end_member(reader);
+}
+
+typedef struct {
+	const char* doc;
+	gboolean valid;
+	// ids of the elements of "value", NULL-terminated
+	const char* ids[4];
+	// a string member other than "value" and its expected value, or NULL if
+	// the member should not be found as a string
+	const char* member;
+	const char* member_value;
+} Case;
+
+static void check_result(const Case* tc, JsonArrayStream* stream, gboolean ok, GPtrArray* ids)
+{
+	g_assert_cmpint(ok, ==, tc->valid);
+	if (!tc->valid)
+		return;
+	g_assert_true(json_array_stream_is_complete(stream));
+
+	guint n = 0;
+	while (tc->ids[n])
+		n++;
+	g_assert_cmpuint(ids->len, ==, n);
+	for (guint i = 0; i < n; ++i)
+		g_assert_cmpstr(g_ptr_array_index(ids, i), ==, tc->ids[i]);
+
+	if (tc->member) {
+		gchar* value = json_array_stream_dup_string_member(stream, tc->member);
+		g_assert_cmpstr(value, ==, tc->member_value);
+		g_free(value);
+	}
+}
+
+// Feeds the document in the pieces given by the split points, which must be
+// in ascending order and end with its length
+static void feed_pieces(const Case* tc, const gsize* splits, gsize n_splits)
+{
+	GPtrArray* ids = g_ptr_array_new_with_free_func(g_free);
+	JsonArrayStream* stream = json_array_stream_new("value", collect_id, ids);
+	gboolean ok = TRUE;
+	gsize pos = 0;
+	for (gsize i = 0; i < n_splits && ok; ++i) {
+		ok = json_array_stream_feed(stream, tc->doc + pos, splits[i] - pos);
+		pos = splits[i];
+	}
+	check_result(tc, stream, ok, ids);
+	json_array_stream_free(stream);
+	g_ptr_array_free(ids, TRUE);
+}
+
+static void test_case(gconstpointer data)
+{
+	const Case* tc = (const Case*) data;
+	gsize len = strlen(tc->doc);
+
+	feed_pieces(tc, &len, 1);
+
+	gsize* bytes = g_new(gsize, len);
+	for (gsize i = 0; i < len; ++i)
+		bytes[i] = i + 1;
+	feed_pieces(tc, bytes, len);
+	g_free(bytes);
+
+	for (gsize i = 0; i <= len; ++i) {
+		gsize splits[] = {i, len};
+		feed_pieces(tc, splits, 2);
+	}
+}
+
+static const Case cases[] = {
+	{"{\"value\": [{\"id\": \"a\"}, {\"id\": \"b\"}], \"@odata.nextLink\": \"https://next\"}",
+	 TRUE, {"a", "b"}, "@odata.nextLink", "https://next"},
+	{"{\"value\":[]}", TRUE, {NULL}, "@odata.deltaLink", NULL},
+	// escaped quotes, and brackets and braces within strings
+	{"{\"value\": [{\"id\": \"say \\\"hi\\\"\", \"subject\": \"]}[{\\\\\"}, {\"id\": \"}\"}], \"@odata.deltaLink\": \"x\\\"]}\"}",
+	 TRUE, {"say \"hi\"", "}"}, "@odata.deltaLink", "x\"]}"},
+	// scalar members before and after the array
+	{"{\"count\": 2, \"value\": [{\"id\": \"a\", \"n\": [1, {\"x\": null}]}], \"more\": true, \"none\": null, \"n\": -1.5e3, \"s\": \"last\"}",
+	 TRUE, {"a"}, "s", "last"},
+	{"{\"value\": [{\"id\": \"a\"}], \"more\": true}", TRUE, {"a"}, "more", NULL},
+	// an object or array member other than the one streamed is kept whole
+	{"{\"other\": {\"value\": [1]}, \"value\": [{\"id\": \"a\"}], \"list\": [\"]\"]}", TRUE, {"a"}, "other", NULL},
+	{"\n {\"value\": [{\"id\": \"a\"}]} \n", TRUE, {"a"}, NULL, NULL},
+	// malformed documents
+	{"[{\"id\": \"a\"}]", FALSE},
+	{"{\"value\": [{\"id\": \"a\"}]} x", FALSE},
+	{"{\"value\": [{\"id\": }]}", FALSE},
+	{"{\"value\" [{\"id\": \"a\"}]}", FALSE},
+};
+
+static void test_incomplete(void)
+{
+	GPtrArray* ids = g_ptr_array_new_with_free_func(g_free);
+	JsonArrayStream* stream = json_array_stream_new("value", collect_id, ids);
+	const char* doc = "{\"value\": [{\"id\": \"a\"}, {\"id\": \"b\"}], \"@odata.nextLink\": \"x\"}";
+
+	// elements are delivered as soon as they are complete
+	g_assert_true(json_array_stream_feed(stream, doc, strchr(doc, ',') - doc));
+	g_assert_cmpuint(ids->len, ==, 1);
+	g_assert_false(json_array_stream_is_complete(stream));
+
+	// the stream can be reused for another document
+	json_array_stream_reset(stream);
+	g_ptr_array_set_size(ids, 0);
+	g_assert_true(json_array_stream_feed(stream, doc, strlen(doc)));
+	g_assert_true(json_array_stream_is_complete(stream));
+	g_assert_cmpuint(ids->len, ==, 2);
+
+	json_array_stream_free(stream);
+	g_ptr_array_free(ids, TRUE);
+}
+
+int main(int argc, char** argv)
+{
+	g_test_init(&argc, &argv, NULL);
+	for (guint i = 0; i < G_N_ELEMENTS(cases); ++i) {
+		char* path = g_strdup_printf("/json-array-stream/document-%u", i);
+		g_test_add_data_func(path, &cases[i], test_case);
+		g_free(path);
+	}
+	g_test_add_func("/json-array-stream/incomplete", test_incomplete);
+	return g_test_run();
+}
@@ -0,0 +1,311 @@
+/*
+ * test-recurrence.c
+ * This file is part of focal, a calendar application for Linux
+ * Copyright 2020 Oliver Giles and focal contributors.
+ *
+ * Focal is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Focal is distributed without any explicit or implied warranty.
+ * You should have received a copy of the GNU General Public License
+ * version 3 with focal. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The fast recurrence expansion of event.c is meant to give exactly the same
+// results as libical's recurrence iterator. Both are run on randomly generated
+// events, parsed from text like those received from a server, and compared.
+// A failure can be reproduced by passing its --seed.
+#include "event.c"
+
+#include <string.h>
+
+#define EVENTS_PER_SHAPE 500
+
+// event.c only uses these for events belonging to a calendar
+const char* calendar_get_email(Calendar* self) { return NULL; }
+GdkRGBA* calendar_get_color(Calendar* self) { return NULL; }
+void calendar_save_event(Calendar* self, Event* event) {}
+
+// timezone.c only uses this for Exchange timezone names
+const char* outlook_timezone_to_tzid(const char* windows_name) { return NULL; }
+
+typedef enum {
+	RULE_DAILY,
+	RULE_WEEKLY,
+	RULE_MONTHLY_BY_MONTH_DAY,
+	RULE_MONTHLY_BY_WEEKDAY,
+} RuleShape;
+
+// in libical order, from SUNDAY = 1
+static const char* weekdays[] = {"SU", "MO", "TU", "WE", "TH", "FR", "SA"};
+
+static void collect_span(icalcomponent* comp, struct icaltime_span* span, void* data)
+{
+	g_array_append_val((GArray*) data, *span);
+}
+
+static GArray* expand_with_libical(Event* ev, icaltime_span range)
+{
+	GArray* spans = g_array_new(FALSE, FALSE, sizeof(icaltime_span));
+	icaltimetype start = icaltime_from_timet_with_zone(range.start, 0, icaltimezone_get_utc_timezone()),
+				 end = icaltime_from_timet_with_zone(range.end, 0, icaltimezone_get_utc_timezone());
+	icalcomponent_foreach_recurrence(ev->cmp, start, end, collect_span, spans);
+	return spans;
+}
+
+// Zones observing daylight saving time in both hemispheres, and UTC
+static icaltimezone* random_zone(void)
+{
+	static const char* names[] = {"Europe/Berlin", "America/New_York", "Australia/Sydney", NULL};
+	const char* name = names[g_test_rand_int_range(0, G_N_ELEMENTS(names))];
+	return name ? timezone_lookup(name) : icaltimezone_get_utc_timezone();
+}
+
+// Times between 01:00 and 03:30 fall into or next to the transitions of
+// the European and American zones
+static icaltimetype random_dtstart(gboolean all_day)
+{
+	static const int hours[] = {0, 1, 2, 3, 9, 12, 23};
+	icaltimetype tt = icaltime_null_time();
+	tt.year = g_test_rand_int_range(2015, 2030);
+	tt.month = g_test_rand_int_range(1, 13);
+	tt.day = g_test_rand_int_range(1, icaltime_days_in_month(tt.month, tt.year) + 1);
+	if (all_day) {
+		tt.is_date = 1;
+		return tt;
+	}
+	tt.hour = hours[g_test_rand_int_range(0, G_N_ELEMENTS(hours))];
+	tt.minute = g_test_rand_bit() ? 30 : 0;
+	return icaltime_set_timezone(&tt, random_zone());
+}
+
+// Returns an RRULE of the given shape for which DTSTART is an instance, as
+// required by the fast path
+static char* random_rule(RuleShape shape, icaltimetype dtstart)
+{
+	GString* rule = g_string_new(NULL);
+	int weekday = icaltime_day_of_week(dtstart);
+	switch (shape) {
+	case RULE_DAILY:
+		g_string_append(rule, "FREQ=DAILY");
+		break;
+	case RULE_WEEKLY:
+		g_string_append(rule, "FREQ=WEEKLY");
+		if (g_test_rand_bit()) {
+			g_string_append_printf(rule, ";BYDAY=%s", weekdays[weekday - 1]);
+			for (int d = 1; d <= 7; ++d) {
+				if (d != weekday && g_test_rand_bit())
+					g_string_append_printf(rule, ",%s", weekdays[d - 1]);
+			}
+		}
+		if (g_test_rand_bit())
+			g_string_append_printf(rule, ";WKST=%s", weekdays[g_test_rand_int_range(0, 7)]);
+		break;
+	case RULE_MONTHLY_BY_MONTH_DAY:
+		g_string_append(rule, "FREQ=MONTHLY");
+		if (g_test_rand_bit())
+			g_string_append_printf(rule, ";BYMONTHDAY=%d", dtstart.day);
+		break;
+	case RULE_MONTHLY_BY_WEEKDAY: {
+		// the position of DTSTART's weekday, from the start or the end of the month
+		int days_in_month = icaltime_days_in_month(dtstart.month, dtstart.year);
+		int pos = g_test_rand_bit() ? (dtstart.day - 1) / 7 + 1 : -((days_in_month - dtstart.day) / 7 + 1);
+		g_string_append_printf(rule, "FREQ=MONTHLY;BYDAY=%d%s", pos, weekdays[weekday - 1]);
+		break;
+	}
+	}
+
+	int interval = g_test_rand_int_range(1, 5);
+	if (interval > 1)
+		g_string_append_printf(rule, ";INTERVAL=%d", interval);
+
+	switch (g_test_rand_int_range(0, 3)) {
+	case 0:
+		g_string_append_printf(rule, ";COUNT=%d", g_test_rand_int_range(1, 60));
+		break;
+	case 1: {
+		// a DATE for all-day events, otherwise a UTC DATE-TIME not
+		// necessarily at the time of day of DTSTART
+		icaltimetype until;
+		if (dtstart.is_date) {
+			until = dtstart;
+			icaltime_adjust(&until, g_test_rand_int_range(0, 3 * 365), 0, 0, 0);
+		} else {
+			time_t t = timezone_time_as_timet(dtstart) + (time_t) g_test_rand_int_range(0, 3 * 365) * 24 * 3600 + g_test_rand_int_range(-12, 13) * 3600;
+			until = icaltime_from_timet_with_zone(t, 0, icaltimezone_get_utc_timezone());
+		}
+		g_string_append_printf(rule, ";UNTIL=%s", icaltime_as_ical_string(until));
+		break;
+	}
+	default:
+		break;
+	}
+	return g_string_free(rule, FALSE);
+}
+
+// Builds the event inside a VCALENDAR carrying its VTIMEZONE, as received
+// from a server
+static Event* build_event(icaltimetype dtstart, const char* rrule)
+{
+	icalcomponent* vevent = icalcomponent_new_vevent();
+	icalcomponent_set_uid(vevent, "test-recurrence");
+	icalcomponent_set_dtstart(vevent, dtstart);
+	if (dtstart.is_date) {
+		// without DTEND an all-day event lasts one day
+		if (g_test_rand_bit()) {
+			icaltimetype dtend = dtstart;
+			icaltime_adjust(&dtend, g_test_rand_int_range(1, 4), 0, 0, 0);
+			icalcomponent_set_dtend(vevent, dtend);
+		}
+	} else {
+		static const int durations[] = {0, 30 * 60, 60 * 60, 25 * 60 * 60};
+		int duration = durations[g_test_rand_int_range(0, G_N_ELEMENTS(durations))];
+		if (duration)
+			icalcomponent_set_dtend(vevent, icaltime_add(dtstart, icaldurationtype_from_int(duration)));
+	}
+	icalcomponent_add_property(vevent, icalproperty_new_rrule(icalrecurrencetype_from_string(rrule)));
+
+	icalcomponent* vcalendar = icalcomponent_new_vcalendar();
+	if (dtstart.zone && !icaltime_is_utc(dtstart))
+		icalcomponent_add_component(vcalendar, icalcomponent_new_clone(icaltimezone_get_component((icaltimezone*) dtstart.zone)));
+	icalcomponent_add_component(vcalendar, vevent);
+	return event_new_from_icalcomponent(vevent);
+}
+
+// Excludes some of the instances within the first few years, given in the
+// zone of DTSTART like a client would
+static void add_random_exdates(Event* ev, icaltimetype dtstart)
+{
+	time_t start = timezone_time_as_timet(dtstart);
+	icaltime_span first_years = {start, start + 4 * 365 * 24 * 3600, 0};
+	GArray* spans = expand_with_libical(ev, first_years);
+	icaltimezone* zone = dtstart.zone ? (icaltimezone*) dtstart.zone : icaltimezone_get_utc_timezone();
+	for (guint i = 0; i < spans->len; ++i) {
+		if (g_test_rand_int_range(0, 8) != 0)
+			continue;
+		icaltimetype ex = icaltime_from_timet_with_zone(g_array_index(spans, icaltime_span, i).start, dtstart.is_date, zone);
+		icalproperty* prop = icalproperty_new_exdate(ex);
+		if (!dtstart.is_date && !icaltime_is_utc(dtstart))
+			icalproperty_add_parameter(prop, icalparameter_new_tzid(icaltimezone_get_tzid(zone)));
+		icalcomponent_add_property(ev->cmp, prop);
+	}
+	g_array_free(spans, TRUE);
+}
+
+// Adds a few extra occurrences at random times in the zone of DTSTART
+static void add_random_rdates(Event* ev, icaltimetype dtstart)
+{
+	icaltimezone* zone = dtstart.zone ? (icaltimezone*) dtstart.zone : icaltimezone_get_utc_timezone();
+	for (int n = g_test_rand_int_range(1, 4); n > 0; --n) {
+		time_t t = timezone_time_as_timet(dtstart) + (time_t) g_test_rand_int_range(-30, 2 * 365) * 24 * 3600 + g_test_rand_int_range(0, 24) * 3600;
+		struct icaldatetimeperiodtype rdate = {.time = icaltime_from_timet_with_zone(t, dtstart.is_date, zone), .period = icalperiodtype_null_period()};
+		icalproperty* prop = icalproperty_new_rdate(rdate);
+		if (!dtstart.is_date && !icaltime_is_utc(dtstart))
+			icalproperty_add_parameter(prop, icalparameter_new_tzid(icaltimezone_get_tzid(zone)));
+		icalcomponent_add_property(ev->cmp, prop);
+	}
+}
+
+// Serialises the event and parses it again. Times then carry a TZID which has
+// to be resolved against the VTIMEZONE, as when received from a server,
+// rather than a zone set in memory.
+static Event* round_trip(Event* ev)
+{
+	char* ical = icalcomponent_as_ical_string_r(icalcomponent_get_parent(ev->cmp));
+	icalcomponent* vcalendar = icalparser_parse_string(ical);
+	free(ical);
+	g_object_unref(ev);
+	return event_new_from_icalcomponent(icalcomponent_get_first_component(vcalendar, ICAL_VEVENT_COMPONENT));
+}
+
+static void assert_expansions_equal(Event* ev, icaltime_span range)
+{
+	GArray* expected = expand_with_libical(ev, range);
+	GArray* actual = g_array_new(FALSE, FALSE, sizeof(icaltime_span));
+	g_assert_true(event_foreach_occurrence_fast(ev, range, collect_span, actual));
+
+	gboolean equal = actual->len == expected->len;
+	for (guint i = 0; equal && i < actual->len; ++i) {
+		icaltime_span a = g_array_index(actual, icaltime_span, i), e = g_array_index(expected, icaltime_span, i);
+		equal = a.start == e.start && a.end == e.end;
+	}
+	if (!equal) {
+		char* ical = icalcomponent_as_ical_string_r(icalcomponent_get_parent(ev->cmp));
+		g_test_message("range %ld to %ld, %u occurrences expected, %u found\n%s", (long) range.start, (long) range.end, expected->len, actual->len, ical);
+		free(ical);
+		for (guint i = 0; i < MAX(actual->len, expected->len); ++i) {
+			long e = i < expected->len ? (long) g_array_index(expected, icaltime_span, i).start : 0;
+			long a = i < actual->len ? (long) g_array_index(actual, icaltime_span, i).start : 0;
+			g_test_message("%3u: expected %ld, found %ld", i, e, a);
+		}
+	}
+	g_assert_true(equal);
+
+	g_array_free(actual, TRUE);
+	g_array_free(expected, TRUE);
+}
+
+// Nothing may occur outside of the span the event is indexed by, and COUNT
+// rules, which the fast path handles, must be bounded
+static void assert_span_contains_occurrences(Event* ev, gboolean has_count)
+{
+	icaltime_span span = event_get_span(ev);
+	g_assert_true(!has_count || span.end != INTERVAL_TREE_UNBOUNDED);
+	if (span.end == INTERVAL_TREE_UNBOUNDED)
+		return;
+
+	icaltime_span before = {span.start - 30 * 365 * 24 * 3600, span.start, 0};
+	icaltime_span after = {span.end, span.end + 30 * 365 * 24 * 3600, 0};
+	GArray* outside = expand_with_libical(ev, before);
+	g_assert_cmpuint(outside->len, ==, 0);
+	g_array_free(outside, TRUE);
+	outside = expand_with_libical(ev, after);
+	g_assert_cmpuint(outside->len, ==, 0);
+	g_array_free(outside, TRUE);
+}
+
+static void test_rule_shape(gconstpointer data)
+{
+	RuleShape shape = (RuleShape) GPOINTER_TO_INT(data);
+	for (int i = 0; i < EVENTS_PER_SHAPE; ++i) {
+		icaltimetype dtstart = random_dtstart(g_test_rand_int_range(0, 4) == 0);
+		char* rrule = random_rule(shape, dtstart);
+		Event* ev = build_event(dtstart, rrule);
+		if (g_test_rand_bit())
+			add_random_exdates(ev, dtstart);
+		if (g_test_rand_int_range(0, 4) == 0)
+			add_random_rdates(ev, dtstart);
+		ev = round_trip(ev);
+
+		// From DTSTART, which covers every instance counted by COUNT
+		time_t start = timezone_time_as_timet(dtstart);
+		icaltime_span from_start = {start - 24 * 3600, start + 2 * 365 * 24 * 3600, 0};
+		assert_expansions_equal(ev, from_start);
+
+		// A window such as the week view shows, anywhere up to years later,
+		// where the fast path skips ahead
+		icaltime_span window;
+		window.start = start + (time_t) g_test_rand_int_range(-30, 5 * 365) * 24 * 3600 + g_test_rand_int_range(0, 24 * 3600);
+		window.end = window.start + (time_t) g_test_rand_int_range(1, 60) * 24 * 3600;
+		window.is_busy = 0;
+		assert_expansions_equal(ev, window);
+
+		assert_span_contains_occurrences(ev, strstr(rrule, "COUNT=") != NULL);
+
+		g_object_unref(ev);
+		g_free(rrule);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	g_test_init(&argc, &argv, NULL);
+	g_test_add_data_func("/recurrence/daily", GINT_TO_POINTER(RULE_DAILY), test_rule_shape);
+	g_test_add_data_func("/recurrence/weekly", GINT_TO_POINTER(RULE_WEEKLY), test_rule_shape);
+	g_test_add_data_func("/recurrence/monthly-by-month-day", GINT_TO_POINTER(RULE_MONTHLY_BY_MONTH_DAY), test_rule_shape);
+	g_test_add_data_func("/recurrence/monthly-by-weekday", GINT_TO_POINTER(RULE_MONTHLY_BY_WEEKDAY), test_rule_shape);
+	int ret = g_test_run();
+	timezone_cleanup();
+	return ret;
+}